@@ -26,5 +26,7 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
-CELL: [A-Z]+[0-9]+ ;
+// a cell of another sheet of the workbook is written as Sheet2!A1
+fragment SHEET_NAME: [A-Za-z_][A-Za-z0-9_]* ;
+CELL: (SHEET_NAME '!')? [A-Z]+[0-9]+ ;
 WS: [ \t\n\r]+ -> skip ;
\ No newline at end of file
@@ -3,12 +3,18 @@
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#include "scenario.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstdint>
+#include <limits>
 #include <memory>
 #include <optional>
+#include <set>
 #include <sstream>
+#include <unordered_map>
 
 namespace ASTImpl {
 
@@ -67,9 +73,38 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
+// Values of an expression in consecutive rows. The loops over the rows are
+// kept simple for the compiler to vectorize them.
+struct RowBatch {
+    explicit RowBatch(size_t rows)
+        : values(rows)
+        , errors(rows) {
+    }
+
+    size_t Size() const {
+        return values.size();
+    }
+
+    void SetError(size_t row, FormulaError error) {
+        errors[row] = static_cast<uint8_t>(error.GetCategory()) + 1;
+    }
+
+    std::vector<double> values;
+    // 0 for a valid value, otherwise 1 + the error category
+    std::vector<uint8_t> errors;
+};
+
 class Expr {
 public:
     virtual ~Expr() = default;
+
+    // nodes of all types are counted by the current memory scope
+    static void* operator new(size_t size) {
+        return AllocateTracked(size);
+    }
+    static void operator delete(void* p, size_t size) noexcept {
+        DeallocateTracked(p, size);
+    }
     virtual void Print(std::ostream& out) const = 0;
     virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
     virtual double Evaluate(const SheetInterface* sheet) const = 0;
@@ -77,6 +112,66 @@ public:
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
 
+    // Evaluates the expression for the first row of the batch and its copies
+    // moved down by 1, 2, ... rows for the others
+    virtual void EvaluateRows(const SheetInterface* sheet, RowBatch& out) const = 0;
+
+    // True if the expression is the other one with references moved by the offset
+    virtual bool IsShiftedCopyOf(const Expr& other, int row_shift, int col_shift) const = 0;
+
+    // Maps cells referenced by the expression to cells its copy should
+    // reference, cells that are not in the map are shared
+    struct CellMap {
+        std::unordered_map<const Position*, const Position*> cells;
+        std::unordered_map<const ExternalCell*, const ExternalCell*> external_cells;
+    };
+
+    std::unique_ptr<Expr> Clone(const CellMap& cells) const {
+        return DoClone(cells);
+    }
+
+    std::unique_ptr<Expr> Clone() const {
+        static const CellMap shared_cells;
+        return DoClone(shared_cells);
+    }
+
+    virtual std::unique_ptr<Expr> DoClone(const CellMap& cells) const = 0;
+
+    // Returns a simplified copy of the expression or nullptr if the
+    // expression cannot be simplified. The copy evaluates to the same
+    // value, or to an error whenever the expression does.
+    virtual std::unique_ptr<Expr> Simplify() const = 0;
+
+    virtual std::optional<double> GetConstantValue() const {
+        return std::nullopt;
+    }
+
+    virtual std::optional<FormulaError> GetConstantError() const {
+        return std::nullopt;
+    }
+
+    // True if the value depends on cells
+    virtual bool ReadsCells() const {
+        return false;
+    }
+
+    // Drops the values of the shared subexpressions among the nodes
+    virtual void ForgetSharedValues() const {
+    }
+
+    // Returns a copy that evaluates its subexpressions reading cells through
+    // the table, the cells of the other nodes are kept in the given lists
+    virtual std::unique_ptr<Expr> Share(SubexpressionTable& /* table */, FormulaAST::CellList& /* cells */,
+                                        FormulaAST::ExternalCellList& /* external_cells */) const {
+        return Clone();
+    }
+
+    // Returns a copy that reads the cells of the sheet through handles to
+    // them resolved now rather than by their positions
+    virtual std::unique_ptr<Expr> Bind(const BindableSheetInterface& /* sheet */) const {
+        return Clone();
+    }
+
     void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
                       bool right_child = false) const {
         auto precedence = GetPrecedence();
@@ -94,7 +189,196 @@ public:
     }
 };
 
+// A subexpression of formulas of a sheet, its value is kept for all of
+// them until one of them forgets it
+struct SharedSubexpression {
+    double Evaluate(const SheetInterface* sheet) const;
+
+    const SheetInterface* sheet = nullptr;
+    // subexpressions of it that read cells are shared too
+    std::unique_ptr<Expr> expr;
+    // the cells its own nodes point to
+    FormulaAST::CellList cells;
+    FormulaAST::ExternalCellList external_cells;
+    // nullopt until it is evaluated, after a cell it reads changed or
+    // after its cells moved
+    mutable std::optional<FormulaInterface::Value> value;
+};
+
+double SharedSubexpression::Evaluate(const SheetInterface* sheet) const {
+    // a what-if scenario replaces values of cells, possibly on several threads
+    if (sheet != this->sheet || Scenario::GetCurrent() != nullptr) {
+        return expr->Evaluate(sheet);
+    }
+    if (!value) {
+        try {
+            value = expr->Evaluate(sheet);
+        } catch (const FormulaError& error) {
+            value = error;
+        }
+    }
+    if (const double* number = std::get_if<double>(&*value)) {
+        return *number;
+    }
+    throw std::get<FormulaError>(*value);
+}
+
 namespace {
+// A node of a formula that evaluates a shared subexpression
+class SharedExpr final : public Expr {
+public:
+    explicit SharedExpr(std::shared_ptr<const SharedSubexpression> shared)
+        : shared_(std::move(shared)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        shared_->expr->Print(out);
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+        shared_->expr->DoPrintFormula(out, precedence);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return shared_->expr->GetPrecedence();
+    }
+
+    double Evaluate(const SheetInterface* sheet) const override {
+        return shared_->Evaluate(sheet);
+    }
+
+    void EvaluateRows(const SheetInterface* sheet, RowBatch& out) const override {
+        shared_->expr->EvaluateRows(sheet, out);
+    }
+
+    bool IsShiftedCopyOf(const Expr& other, int row_shift, int col_shift) const override {
+        return shared_->expr->IsShiftedCopyOf(other, row_shift, col_shift);
+    }
+
+    // the copy shares the subexpression too
+    std::unique_ptr<Expr> DoClone(const CellMap& /* cells */) const override {
+        return std::make_unique<SharedExpr>(shared_);
+    }
+
+    std::unique_ptr<Expr> Simplify() const override {
+        return nullptr;
+    }
+
+    bool ReadsCells() const override {
+        return true;
+    }
+
+    // the formulas sharing the subexpression read the same cells, so any
+    // of them may forget the value for all
+    void ForgetSharedValues() const override {
+        shared_->value.reset();
+        shared_->expr->ForgetSharedValues();
+    }
+
+private:
+    std::shared_ptr<const SharedSubexpression> shared_;
+};
+
+class NumberExpr final : public Expr {
+public:
+    explicit NumberExpr(double value)
+        : value_(value) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << value_;
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        out << value_;
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    // literals are checked to be finite when parsed, folded constants when folded
+    double Evaluate(const SheetInterface* sheet) const override {
+        return value_;
+    }
+
+    std::unique_ptr<Expr> DoClone(const CellMap& /* cells */) const override {
+        return std::make_unique<NumberExpr>(value_);
+    }
+
+    void EvaluateRows(const SheetInterface* /* sheet */, RowBatch& out) const override {
+        std::fill(out.values.begin(), out.values.end(), value_);
+    }
+
+    bool IsShiftedCopyOf(const Expr& other, int /* row_shift */, int /* col_shift */) const override {
+        auto* number = dynamic_cast<const NumberExpr*>(&other);
+        return number && number->value_ == value_ && std::signbit(number->value_) == std::signbit(value_);
+    }
+
+    std::unique_ptr<Expr> Simplify() const override {
+        return nullptr;
+    }
+
+    std::optional<double> GetConstantValue() const override {
+        return value_;
+    }
+
+private:
+    double value_;
+};
+
+// The result of folding a subexpression that always fails, e.g. 1/0.
+// It appears only in simplified expressions, which are never printed
+// back to the user.
+class ErrorExpr final : public Expr {
+public:
+    explicit ErrorExpr(FormulaError error)
+        : error_(error) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << error_;
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        out << error_;
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const SheetInterface* sheet) const override {
+        throw error_;
+    }
+
+    std::unique_ptr<Expr> DoClone(const CellMap& /* cells */) const override {
+        return std::make_unique<ErrorExpr>(error_);
+    }
+
+    void EvaluateRows(const SheetInterface* /* sheet */, RowBatch& out) const override {
+        for (size_t i = 0; i < out.Size(); ++i) {
+            out.SetError(i, error_);
+        }
+    }
+
+    bool IsShiftedCopyOf(const Expr& other, int /* row_shift */, int /* col_shift */) const override {
+        auto* error = dynamic_cast<const ErrorExpr*>(&other);
+        return error && error->error_ == error_;
+    }
+
+    std::unique_ptr<Expr> Simplify() const override {
+        return nullptr;
+    }
+
+    std::optional<FormulaError> GetConstantError() const override {
+        return error_;
+    }
+
+private:
+    FormulaError error_;
+};
+
 class BinaryOpExpr final : public Expr {
 public:
     enum Type : char {
@@ -145,8 +429,141 @@ public:
     double Evaluate(const SheetInterface* sheet) const override {
         auto left = lhs_->Evaluate(sheet);
         auto right = rhs_->Evaluate(sheet);       
+        return Apply(type_, left, right);
+    }
+
+    std::unique_ptr<Expr> DoClone(const CellMap& cells) const override {
+        return std::make_unique<BinaryOpExpr>(type_, lhs_->Clone(cells), rhs_->Clone(cells));
+    }
+
+    void EvaluateRows(const SheetInterface* sheet, RowBatch& out) const override {
+        RowBatch rhs(out.Size());
+        lhs_->EvaluateRows(sheet, out);
+        rhs_->EvaluateRows(sheet, rhs);
+
+        size_t size = out.Size();
+        double* left = out.values.data();
+        const double* right = rhs.values.data();
+        switch (type_) {
+            case Add:
+                for (size_t i = 0; i < size; ++i) left[i] += right[i];
+                break;
+            case Subtract:
+                for (size_t i = 0; i < size; ++i) left[i] -= right[i];
+                break;
+            case Multiply:
+                for (size_t i = 0; i < size; ++i) left[i] *= right[i];
+                break;
+            case Divide:
+                for (size_t i = 0; i < size; ++i) left[i] /= right[i];
+                break;
+        }
+
+        // the error of the left operand comes first, as in Evaluate(), and
+        // the result is checked as Apply() does: a division by zero or an
+        // infinity is an error, a NaN operand gives a NaN. std::fabs()
+        // vectorizes unlike std::isinf().
+        constexpr uint8_t arithmetic_error = static_cast<uint8_t>(FormulaError::Category::Arithmetic) + 1;
+        constexpr double infinity = std::numeric_limits<double>::infinity();
+        const bool divides = type_ == Divide;
+        uint8_t* left_errors = out.errors.data();
+        const uint8_t* right_errors = rhs.errors.data();
+        for (size_t i = 0; i < size; ++i) {
+            bool failed = std::fabs(left[i]) == infinity || (divides && right[i] == 0);
+            uint8_t result_error = failed ? arithmetic_error : 0;
+            uint8_t operand_error = left_errors[i] ? left_errors[i] : right_errors[i];
+            left_errors[i] = operand_error ? operand_error : result_error;
+        }
+    }
+
+    bool IsShiftedCopyOf(const Expr& other, int row_shift, int col_shift) const override {
+        auto* binary = dynamic_cast<const BinaryOpExpr*>(&other);
+        return binary && binary->type_ == type_
+               && lhs_->IsShiftedCopyOf(*binary->lhs_, row_shift, col_shift)
+               && rhs_->IsShiftedCopyOf(*binary->rhs_, row_shift, col_shift);
+    }
+
+    bool ReadsCells() const override {
+        return lhs_->ReadsCells() || rhs_->ReadsCells();
+    }
+
+    void ForgetSharedValues() const override {
+        lhs_->ForgetSharedValues();
+        rhs_->ForgetSharedValues();
+    }
+
+    std::unique_ptr<Expr> Share(SubexpressionTable& table, FormulaAST::CellList& /* cells */,
+                                FormulaAST::ExternalCellList& /* external_cells */) const override {
+        if (!ReadsCells()) {
+            return Clone();
+        }
+        return std::make_unique<SharedExpr>(table.Share(*this, [&](auto& cells, auto& external_cells) {
+            return std::make_unique<BinaryOpExpr>(type_, lhs_->Share(table, cells, external_cells),
+                                                  rhs_->Share(table, cells, external_cells));
+        }));
+    }
+
+    std::unique_ptr<Expr> Bind(const BindableSheetInterface& sheet) const override {
+        if (!ReadsCells()) {
+            return Clone();
+        }
+        return std::make_unique<BinaryOpExpr>(type_, lhs_->Bind(sheet), rhs_->Bind(sheet));
+    }
+
+    std::unique_ptr<Expr> Simplify() const override {
+        auto simplified_lhs = lhs_->Simplify();
+        auto simplified_rhs = rhs_->Simplify();
+        const Expr& lhs = simplified_lhs ? *simplified_lhs : *lhs_;
+        const Expr& rhs = simplified_rhs ? *simplified_rhs : *rhs_;
+        auto take_lhs = [&] {
+            return simplified_lhs ? std::move(simplified_lhs) : lhs_->Clone();
+        };
+        auto take_rhs = [&] {
+            return simplified_rhs ? std::move(simplified_rhs) : rhs_->Clone();
+        };
+
+        // an error of any operand is the error of the whole operation
+        if (lhs.GetConstantError()) {
+            return take_lhs();
+        }
+        if (rhs.GetConstantError()) {
+            return take_rhs();
+        }
+
+        auto left = lhs.GetConstantValue();
+        auto right = rhs.GetConstantValue();
+        if (left && right) {
+            try {
+                return std::make_unique<NumberExpr>(Apply(type_, *left, *right));
+            } catch (const FormulaError& error) {
+                return std::make_unique<ErrorExpr>(error);
+            }
+        }
+
+        // x*1, 1*x and x/1 are exactly x; so is x-0, but not x+0 as -0+0 is +0
+        bool is_zero_rhs = right && *right == 0 && !std::signbit(*right);
+        if (right && *right == 1 && (type_ == Multiply || type_ == Divide)) {
+            return take_lhs();
+        }
+        if (left && *left == 1 && type_ == Multiply) {
+            return take_rhs();
+        }
+        if (is_zero_rhs && type_ == Subtract) {
+            return take_lhs();
+        }
+        if (right && *right == 0 && type_ == Divide) {
+            return std::make_unique<ErrorExpr>(FormulaError::Category::Arithmetic);
+        }
+
+        if (!simplified_lhs && !simplified_rhs) {
+            return nullptr;
+        }
+        return std::make_unique<BinaryOpExpr>(type_, take_lhs(), take_rhs());
+    }
+
+    static double Apply(Type type, double left, double right) {
         double result;
-        switch(type_){
+        switch(type){
             case Type::Add:
                 result = left + right;
                 break;
@@ -204,8 +621,76 @@ public:
     }
 
     double Evaluate(const SheetInterface* sheet) const override {
-        auto operand = operand_->Evaluate(sheet);               
-        switch(type_){
+        return Apply(type_, operand_->Evaluate(sheet));
+    }
+
+    std::unique_ptr<Expr> DoClone(const CellMap& cells) const override {
+        return std::make_unique<UnaryOpExpr>(type_, operand_->Clone(cells));
+    }
+
+    void EvaluateRows(const SheetInterface* sheet, RowBatch& out) const override {
+        operand_->EvaluateRows(sheet, out);
+        if (type_ == UnaryMinus) {
+            for (double& value : out.values) {
+                value = Apply(type_, value);
+            }
+        }
+    }
+
+    bool IsShiftedCopyOf(const Expr& other, int row_shift, int col_shift) const override {
+        auto* unary = dynamic_cast<const UnaryOpExpr*>(&other);
+        return unary && unary->type_ == type_ && operand_->IsShiftedCopyOf(*unary->operand_, row_shift, col_shift);
+    }
+
+    bool ReadsCells() const override {
+        return operand_->ReadsCells();
+    }
+
+    void ForgetSharedValues() const override {
+        operand_->ForgetSharedValues();
+    }
+
+    std::unique_ptr<Expr> Share(SubexpressionTable& table, FormulaAST::CellList& /* cells */,
+                                FormulaAST::ExternalCellList& /* external_cells */) const override {
+        if (!ReadsCells()) {
+            return Clone();
+        }
+        return std::make_unique<SharedExpr>(table.Share(*this, [&](auto& cells, auto& external_cells) {
+            return std::make_unique<UnaryOpExpr>(type_, operand_->Share(table, cells, external_cells));
+        }));
+    }
+
+    std::unique_ptr<Expr> Bind(const BindableSheetInterface& sheet) const override {
+        if (!ReadsCells()) {
+            return Clone();
+        }
+        return std::make_unique<UnaryOpExpr>(type_, operand_->Bind(sheet));
+    }
+
+    std::unique_ptr<Expr> Simplify() const override {
+        auto simplified = operand_->Simplify();
+        const Expr& operand = simplified ? *simplified : *operand_;
+
+        if (operand.GetConstantError() || type_ == UnaryPlus) {
+            return simplified ? std::move(simplified) : operand_->Clone();
+        }
+        if (auto value = operand.GetConstantValue()) {
+            return std::make_unique<NumberExpr>(Apply(type_, *value));
+        }
+        // -(-x) is exactly x
+        if (auto* inner = dynamic_cast<const UnaryOpExpr*>(&operand); inner && inner->type_ == UnaryMinus) {
+            return simplified ? std::move(static_cast<UnaryOpExpr&>(*simplified).operand_)
+                              : inner->operand_->Clone();
+        }
+
+        if (!simplified) {
+            return nullptr;
+        }
+        return std::make_unique<UnaryOpExpr>(type_, std::move(simplified));
+    }
+
+    static double Apply(Type type, double operand) {
+        switch(type){
             case Type::UnaryPlus:
                 return operand;
             case Type::UnaryMinus:
@@ -220,17 +705,86 @@ private:
     std::unique_ptr<Expr> operand_;
 };
 
+// Returns the value of a referenced cell as a number
+double ValueToNumber(const CellInterface::Value& value) {
+    if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    }
+    if (std::holds_alternative<FormulaError>(value)) {
+        throw std::get<FormulaError>(value);
+    }         
+    const std::string& result_str = std::get<std::string>(value);
+    if (result_str == "") {
+        return 0;
+    }
+    size_t num_of_processed_symbols{};
+    double result;
+    try {
+        result = std::stod(result_str, &num_of_processed_symbols);
+    }
+    catch(...) {
+        throw FormulaError(FormulaError::Category::Value);
+    }
+    if (num_of_processed_symbols != result_str.size()) {
+        throw FormulaError(FormulaError::Category::Value);
+    }
+    return result;
+}
+
+double CellToNumber(const CellInterface* cell) {
+    if (cell == nullptr) return 0;  
+    return ValueToNumber(cell->GetValue());
+}
+
+// Prints a valid position without building a string
+void PrintPosition(std::ostream& out, Position pos) {
+    char buffer[Position::MAX_STRING_LENGTH];
+    auto end = pos.ToChars(std::begin(buffer), std::end(buffer)).ptr;
+    out.write(buffer, end - buffer);
+}
+
+// Stores the value of a referenced cell in a row of the batch
+void ReadCell(const CellInterface* cell, RowBatch& out, size_t row) {
+    try {
+        out.values[row] = CellToNumber(cell);
+    } catch (const FormulaError& error) {
+        out.SetError(row, error);
+    }
+}
+
+// Returns the position moved by the offset or Position::NONE if it leaves the table
+Position Shift(Position cell, int row_shift, int col_shift) {
+    if (!cell.IsValid()) {
+        return cell;
+    }
+    Position moved{cell.row + row_shift, cell.col + col_shift};
+    return moved.IsValid() ? moved : Position::NONE;
+}
+
+// Reads the cell and the cells below it for the rows of the batch
+void ReadColumn(const SheetInterface* sheet, Position first, RowBatch& out) {
+    for (size_t i = 0; i < out.Size(); ++i) {
+        Position pos = Shift(first, static_cast<int>(i), 0);
+        if (sheet == nullptr || !pos.IsValid()) {
+            out.SetError(i, FormulaError::Category::Ref);
+        } else {
+            ReadCell(sheet->GetCell(pos), out, i);
+        }
+    }
+}
+
 class CellExpr final : public Expr {
 public:
-    explicit CellExpr(const Position* cell)
-        : cell_(cell) {
+    explicit CellExpr(const Position* cell, const Cell* bound_cell = nullptr)
+        : cell_(cell)
+        , bound_cell_(bound_cell) {
     }
 
     void Print(std::ostream& out) const override {
         if (!cell_->IsValid()) {
-            out << FormulaError::Category::Ref;
+            out << FormulaError(FormulaError::Category::Ref);
         } else {
-            out << cell_->ToString();
+            PrintPosition(out, *cell_);
         }
     }
 
@@ -243,52 +797,74 @@ public:
     }
 
     double Evaluate(const SheetInterface* sheet) const override {           
-        cell_->ThrowIfInvalid();
-        auto cell = sheet->GetCell(*cell_); 
-        if (cell == nullptr) return 0;  
-        
-        auto value = cell->GetValue();
-        if (std::holds_alternative<double>(value)) {
-            return std::get<double>(value);
-        }
-        if (std::holds_alternative<FormulaError>(value)) {
-            throw std::get<FormulaError>(value);
-        }         
-        std::string result_str = std::get<std::string>(value);
-        if (result_str == "") {
-            return 0;
-        } else {
-            size_t num_of_processed_symbols{};
-            double result;
-            try {
-                result = std::stod(result_str, &num_of_processed_symbols);
-            }
-            catch(...) {
-                throw FormulaError(FormulaError::Category::Value);
-            }
-            if (num_of_processed_symbols != result_str.size()) {
-                throw FormulaError(FormulaError::Category::Value);
-            }
-            return result;
-        }        
+        // Cell is final, so the value is read without a virtual call
+        if (bound_cell_ != nullptr) {
+            return ValueToNumber(bound_cell_->GetValue());
+        }
+        if (!cell_->IsValid()) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        return CellToNumber(sheet->GetCell(*cell_));
+    }
+
+    std::unique_ptr<Expr> DoClone(const CellMap& cells) const override {
+        auto it = cells.cells.find(cell_);
+        return std::make_unique<CellExpr>(it == cells.cells.end() ? cell_ : it->second);
+    }
+
+    void EvaluateRows(const SheetInterface* sheet, RowBatch& out) const override {
+        ReadColumn(sheet, *cell_, out);
+    }
+
+    bool IsShiftedCopyOf(const Expr& other, int row_shift, int col_shift) const override {
+        auto* cell = dynamic_cast<const CellExpr*>(&other);
+        return cell && Shift(*cell->cell_, row_shift, col_shift) == *cell_;
+    }
+
+    std::unique_ptr<Expr> Simplify() const override {
+        return nullptr;
+    }
+
+    bool ReadsCells() const override {
+        return true;
+    }
+
+    std::unique_ptr<Expr> Share(SubexpressionTable& /* table */, FormulaAST::CellList& cells,
+                                FormulaAST::ExternalCellList& /* external_cells */) const override {
+        cells.push_front(*cell_);
+        return std::make_unique<CellExpr>(&cells.front());
+    }
+
+    // a deleted or missing cell is still looked up by its position
+    std::unique_ptr<Expr> Bind(const BindableSheetInterface& sheet) const override {
+        const Cell* cell = cell_->IsValid() ? sheet.FindBoundCell(*cell_) : nullptr;
+        return std::make_unique<CellExpr>(cell_, cell);
     }
 
 private:
     const Position* cell_;
+    // nullptr unless the node belongs to a bound expression
+    const Cell* bound_cell_;
 };
 
-class NumberExpr final : public Expr {
+// A cell of another sheet, a missing sheet evaluates to #REF!
+class ExternalCellExpr final : public Expr {
 public:
-    explicit NumberExpr(double value)
-        : value_(value) {
+    explicit ExternalCellExpr(const ExternalCell* cell)
+        : cell_(cell) {
     }
 
     void Print(std::ostream& out) const override {
-        out << value_;
+        if (!cell_->position.IsValid()) {
+            out << FormulaError(FormulaError::Category::Ref);
+        } else {
+            out << cell_->sheet << '!';
+            PrintPosition(out, cell_->position);
+        }
     }
 
     void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        out << value_;
+        Print(out);
     }
 
     ExprPrecedence GetPrecedence() const override {
@@ -296,12 +872,44 @@ public:
     }
 
     double Evaluate(const SheetInterface* sheet) const override {
-        if (!std::isfinite(value_) || std::isinf(value_)) throw FormulaError(FormulaError::Category::Arithmetic);        
-        return value_;
+        const SheetInterface* other_sheet = sheet->FindSheet(cell_->sheet);
+        if (!cell_->position.IsValid() || other_sheet == nullptr) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        return CellToNumber(other_sheet->GetCell(cell_->position));
+    }
+
+    std::unique_ptr<Expr> DoClone(const CellMap& cells) const override {
+        auto it = cells.external_cells.find(cell_);
+        return std::make_unique<ExternalCellExpr>(it == cells.external_cells.end() ? cell_ : it->second);
+    }
+
+    void EvaluateRows(const SheetInterface* sheet, RowBatch& out) const override {
+        ReadColumn(sheet->FindSheet(cell_->sheet), cell_->position, out);
+    }
+
+    bool IsShiftedCopyOf(const Expr& other, int row_shift, int col_shift) const override {
+        auto* cell = dynamic_cast<const ExternalCellExpr*>(&other);
+        return cell && cell->cell_->sheet == cell_->sheet
+               && Shift(cell->cell_->position, row_shift, col_shift) == cell_->position;
+    }
+
+    std::unique_ptr<Expr> Simplify() const override {
+        return nullptr;
+    }
+
+    bool ReadsCells() const override {
+        return true;
+    }
+
+    std::unique_ptr<Expr> Share(SubexpressionTable& /* table */, FormulaAST::CellList& /* cells */,
+                                FormulaAST::ExternalCellList& external_cells) const override {
+        external_cells.push_front(*cell_);
+        return std::make_unique<ExternalCellExpr>(&external_cells.front());
     }
 
 private:
-    double value_;
+    const ExternalCell* cell_;
 };
 
 class ParseASTListener final : public FormulaBaseListener {
@@ -314,10 +922,14 @@ public:
         return root;
     }
 
-    std::forward_list<Position> MoveCells() {
+    FormulaAST::CellList MoveCells() {
         return std::move(cells_);
     }
 
+    FormulaAST::ExternalCellList MoveExternalCells() {
+        return std::move(external_cells_);
+    }
+
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
@@ -341,7 +953,7 @@ public:
         auto valueStr = ctx->NUMBER()->getSymbol()->getText();
         std::istringstream in(valueStr);
         in >> value;
-        if (!in) {
+        if (!in || !std::isfinite(value)) {
             throw ParsingError("Invalid number: " + valueStr);
         }
 
@@ -351,11 +963,21 @@ public:
 
     void exitCell(FormulaParser::CellContext* ctx) override {
         auto value_str = ctx->CELL()->getSymbol()->getText();
-        auto value = Position::FromString(value_str);
+        auto sheet_end = value_str.find('!');
+        std::string_view position_str = value_str;
+        if (sheet_end != std::string::npos) {
+            position_str.remove_prefix(sheet_end + 1);
+        }
+        auto value = Position::FromString(position_str);
         if (!value.IsValid()) {
             throw FormulaException("Invalid position: " + value_str);
         }
 
+        if (sheet_end != std::string::npos) {
+            external_cells_.push_front({value_str.substr(0, sheet_end), value});
+            args_.push_back(std::make_unique<ExternalCellExpr>(&external_cells_.front()));
+            return;
+        }
         cells_.push_front(value);
         auto node = std::make_unique<CellExpr>(&cells_.front());
         args_.push_back(std::move(node));
@@ -391,7 +1013,8 @@ public:
 
 private:
     std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    FormulaAST::CellList cells_;
+    FormulaAST::ExternalCellList external_cells_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -428,7 +1051,9 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    FormulaAST ast(listener.MoveRoot(), listener.MoveCells(), listener.MoveExternalCells());
+    ast.Simplify();
+    return ast;
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
@@ -438,7 +1063,8 @@ FormulaAST ParseFormulaAST(const std::string& in_str) {
 
 void FormulaAST::PrintCells(std::ostream& out) const {
     for (auto cell : cells_) {
-        out << cell.ToString() << ' ';
+        ASTImpl::PrintPosition(out, cell);
+        out << ' ';
     }
 }
 
@@ -451,13 +1077,223 @@ void FormulaAST::PrintFormula(std::ostream& out) const {
 }
 
 double FormulaAST::Execute(const SheetInterface* sheet) const {
+    if (shared_expr_) {
+        return shared_expr_->Evaluate(sheet);
+    }
+    if (bound_expr_ && sheet == bound_sheet_ && bound_sheet_->AllowsBoundReads()) {
+        return bound_expr_->Evaluate(sheet);
+    }
+    if (simplified_expr_) {
+        return simplified_expr_->Evaluate(sheet);
+    }
     return root_expr_->Evaluate(sheet);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
+void FormulaAST::Simplify() {
+    simplified_expr_ = root_expr_->Simplify();
+}
+
+std::optional<FormulaError> FormulaAST::GetConstantError() const {
+    return simplified_expr_ ? simplified_expr_->GetConstantError() : root_expr_->GetConstantError();
+}
+
+namespace {
+using ASTImpl::Shift;
+
+// Rewrites the position in place and accumulates the outcome in result
+void Move(Position& cell, const StructuralChange& change, FormulaInterface::HandlingResult& result) {
+    using HandlingResult = FormulaInterface::HandlingResult;
+    if (!cell.IsValid()) {
+        return;
+    }
+    Position moved = change.Apply(cell);
+    if (moved == cell) {
+        return;
+    }
+    cell = moved;
+    if (!moved.IsValid()) {
+        result = HandlingResult::ReferencesChanged;
+    } else if (result == HandlingResult::NothingChanged) {
+        result = HandlingResult::ReferencesRenamedOnly;
+    }
+}
+}  // namespace
+
+bool FormulaAST::IsShiftedCopyOf(const FormulaAST& other, int row_shift, int col_shift) const {
+    return GetEvaluatedExpr().IsShiftedCopyOf(other.GetEvaluatedExpr(), row_shift, col_shift);
+}
+
+std::vector<FormulaInterface::Value> FormulaAST::ExecuteRows(const SheetInterface* sheet, size_t rows) const {
+    ASTImpl::RowBatch batch(rows);
+    GetEvaluatedExpr().EvaluateRows(sheet, batch);
+    std::vector<FormulaInterface::Value> result;
+    result.reserve(rows);
+    for (size_t i = 0; i < rows; ++i) {
+        if (batch.errors[i]) {
+            result.push_back(FormulaError(static_cast<FormulaError::Category>(batch.errors[i] - 1)));
+        } else {
+            result.push_back(batch.values[i]);
+        }
+    }
+    return result;
+}
+
+const ASTImpl::Expr& FormulaAST::GetEvaluatedExpr() const {
+    return simplified_expr_ ? *simplified_expr_ : *root_expr_;
+}
+
+std::vector<ExternalCell> FormulaAST::GetExternalCells() const {
+    std::set<ExternalCell> result;
+    for (const ExternalCell& cell : external_cells_) {
+        if (cell.position.IsValid()) {
+            result.insert(cell);
+        }
+    }
+    return {result.begin(), result.end()};
+}
+
+FormulaAST FormulaAST::Clone(int row_shift, int col_shift) const {
+    // the copies are counted by the current memory scope rather than with the source
+    CellList cells(cells_.begin(), cells_.end());
+    ExternalCellList external_cells(external_cells_.begin(), external_cells_.end());
+    ASTImpl::Expr::CellMap cell_map;
+    auto cell = cells.begin();
+    for (const Position& source_cell : cells_) {
+        cell_map.cells[&source_cell] = &*cell;
+        *cell = Shift(*cell, row_shift, col_shift);
+        ++cell;
+    }
+    auto external_cell = external_cells.begin();
+    for (const ExternalCell& source_cell : external_cells_) {
+        cell_map.external_cells[&source_cell] = &*external_cell;
+        external_cell->position = Shift(external_cell->position, row_shift, col_shift);
+        ++external_cell;
+    }
+
+    FormulaAST result(root_expr_->Clone(cell_map), std::move(cells), std::move(external_cells));
+    result.Simplify();
+    return result;
+}
+
+FormulaInterface::HandlingResult FormulaAST::HandleStructuralChange(const StructuralChange& change) {
+    using HandlingResult = FormulaInterface::HandlingResult;
+    HandlingResult result = HandlingResult::NothingChanged;
+    // CellExpr nodes point to the elements of cells_, so the positions
+    // are rewritten in place
+    for (Position& cell : cells_) {
+        Move(cell, change, result);
+    }
+    if (result != HandlingResult::NothingChanged) {
+        cells_.sort();
+        unique_sorted_cells_.clear();
+        ShareSubexpressions(nullptr);
+        // cells moved along with the references keep their handles, deleted ones do not
+        BindCells(bound_sheet_);
+    }
+    return result;
+}
+
+FormulaInterface::HandlingResult FormulaAST::HandleExternalStructuralChange(std::string_view sheet,
+                                                                            const StructuralChange& change) {
+    auto result = FormulaInterface::HandlingResult::NothingChanged;
+    for (ExternalCell& cell : external_cells_) {
+        if (cell.sheet == sheet) {
+            Move(cell.position, change, result);
+        }
+    }
+    if (result != FormulaInterface::HandlingResult::NothingChanged) {
+        ShareSubexpressions(nullptr);
+    }
+    return result;
+}
+
+void FormulaAST::ShareSubexpressions(SubexpressionTable* table) {
+    shared_expr_.reset();
+    shared_cells_.clear();
+    shared_external_cells_.clear();
+    if (table != nullptr && GetEvaluatedExpr().ReadsCells()) {
+        shared_expr_ = GetEvaluatedExpr().Share(*table, shared_cells_, shared_external_cells_);
+    }
+}
+
+void FormulaAST::ForgetSharedValues() const {
+    if (shared_expr_) {
+        shared_expr_->ForgetSharedValues();
+    }
+}
+
+void FormulaAST::BindCells(const BindableSheetInterface* sheet) {
+    bound_expr_.reset();
+    bound_sheet_ = sheet;
+    if (bound_sheet_ != nullptr && GetEvaluatedExpr().ReadsCells()) {
+        bound_expr_ = GetEvaluatedExpr().Bind(*bound_sheet_);
+    }
+}
+
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, CellList cells, ExternalCellList external_cells)
     : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
+    , cells_(std::move(cells))
+    , external_cells_(std::move(external_cells)) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
+
+SubexpressionTable::SubexpressionTable(const SheetInterface* sheet)
+    : sheet_(sheet) {
+}
+
+SubexpressionTable::~SubexpressionTable() = default;
+
+std::shared_ptr<const ASTImpl::SharedSubexpression> SubexpressionTable::Share(const ASTImpl::Expr& expr,
+                                                                              const Builder& build) {
+    std::ostringstream out;
+    expr.Print(out);
+    std::string key = out.str();
+    if (auto it = subexpressions_.find(key); it != subexpressions_.end()) {
+        for (const auto& weak_subexpression : it->second) {
+            auto subexpression = weak_subexpression.lock();
+            if (subexpression && subexpression->expr->IsShiftedCopyOf(expr, 0, 0)) {
+                return subexpression;
+            }
+        }
+    }
+    // counted by the current memory scope like the nodes
+    auto subexpression = std::allocate_shared<ASTImpl::SharedSubexpression>(
+        TrackingAllocator<ASTImpl::SharedSubexpression>());
+    subexpression->sheet = sheet_;
+    // shares its own subexpressions, which adds them to the table
+    subexpression->expr = build(subexpression->cells, subexpression->external_cells);
+    subexpressions_[std::move(key)].push_back(subexpression);
+    if (subexpressions_.size() > 2 * purged_size_) {
+        Purge();
+    }
+    return subexpression;
+}
+
+void SubexpressionTable::Clear() {
+    for (const auto& [key, subexpressions] : subexpressions_) {
+        for (const auto& weak_subexpression : subexpressions) {
+            if (auto subexpression = weak_subexpression.lock()) {
+                subexpression->value.reset();
+            }
+        }
+    }
+    subexpressions_.clear();
+    purged_size_ = 0;
+}
+
+void SubexpressionTable::Purge() {
+    for (auto it = subexpressions_.begin(); it != subexpressions_.end();) {
+        auto& subexpressions = it->second;
+        subexpressions.erase(std::remove_if(subexpressions.begin(), subexpressions.end(),
+                                            [](const auto& subexpression) {
+                                                return subexpression.expired();
+                                            }),
+                             subexpressions.end());
+        it = subexpressions.empty() ? subexpressions_.erase(it) : std::next(it);
+    }
+    purged_size_ = std::max<size_t>(subexpressions_.size(), 64);
+}
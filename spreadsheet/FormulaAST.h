@@ -3,15 +3,23 @@
 #include "FormulaLexer.h"
 #include "common.h"
 #include "cell.h"
+#include "formula.h"
+#include "memory_tracker.h"
 
 
 #include <forward_list>
 #include <functional>
+#include <memory>
+#include <optional>
 #include <stdexcept>
 #include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace ASTImpl {
 class Expr;
+struct SharedSubexpression;
 }
 
 class ParsingError : public std::runtime_error {
@@ -20,42 +28,132 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 public:
+    // Lists and nodes of the formula are counted by the memory scope
+    // current when the formula is parsed or cloned
+    using CellList = std::forward_list<Position, TrackingAllocator<Position>>;
+    using ExternalCellList = std::forward_list<ExternalCell, TrackingAllocator<ExternalCell>>;
+
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+                        CellList cells,
+                        ExternalCellList external_cells = {});
+    FormulaAST(FormulaAST&&);
+    FormulaAST& operator=(FormulaAST&&);
     ~FormulaAST();
 
     double Execute(const SheetInterface* sheet) const;
+
+    // Folds constant subexpressions and removes identity operations. The
+    // simplified expression is used for evaluation only, printing methods
+    // keep the expression as it was written.
+    void Simplify();
+
+    // Evaluates the formula and its copies moved down by 1, 2, ..., rows - 1
+    // rows at once, the values are returned in row order
+    std::vector<FormulaInterface::Value> ExecuteRows(const SheetInterface* sheet, size_t rows) const;
+    // True if the formula is the other one with references moved by the offset
+    bool IsShiftedCopyOf(const FormulaAST& other, int row_shift, int col_shift) const;
+
+    // Returns the error the formula always evaluates to, if any
+    std::optional<FormulaError> GetConstantError() const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
 
-    std::vector<Position>& GetCells() {
-        if (unique_sorted_cells_.empty()) {
-            std::set<Position> result(cells_.begin(), cells_.end());        
-            unique_sorted_cells_ = {result.begin(), result.end()};
-        }
-        
-        return unique_sorted_cells_;
-    }
-
-    const std::vector<Position>& GetCells() const {
+    // Returns valid referenced cells without duplicates in ascending order
+    const TrackedVector<Position>& GetCells() const {
         if (unique_sorted_cells_.empty()) {
-            std::set<Position> result(cells_.begin(), cells_.end());        
-            unique_sorted_cells_ = {result.begin(), result.end()};
+            std::set<Position> result;
+            for (Position cell : cells_) {
+                if (cell.IsValid()) {
+                    result.insert(cell);
+                }
+            }
+            // keeps the allocator the formula was created with
+            unique_sorted_cells_.assign(result.begin(), result.end());
         }        
         return unique_sorted_cells_;
     }
 
+    // Returns valid references to other sheets without duplicates in ascending order
+    std::vector<ExternalCell> GetExternalCells() const;
+
+    // Returns a copy with all references moved by the given offset,
+    // references that leave the table become invalid
+    FormulaAST Clone(int row_shift, int col_shift) const;
+
+    // Moves references in place, references to deleted cells become invalid.
+    // Shared subexpressions are no longer used if any reference moved.
+    FormulaInterface::HandlingResult HandleStructuralChange(const StructuralChange& change);
+    // The same for references to the given sheet
+    FormulaInterface::HandlingResult HandleExternalStructuralChange(std::string_view sheet,
+                                                                    const StructuralChange& change);
+
+    // Evaluates the subexpressions that read cells through the table,
+    // nullptr evaluates the formula alone
+    void ShareSubexpressions(SubexpressionTable* table);
+    void ForgetSharedValues() const;
+
+    // Resolves the referenced cells of the sheet once, so evaluating the
+    // formula reads them without looking them up. The handles are resolved
+    // again after the references move; nullptr reads cells by position.
+    void BindCells(const BindableSheetInterface* sheet);
+
 private:
+    // the simplified expression if there is one
+    const ASTImpl::Expr& GetEvaluatedExpr() const;
+
     std::unique_ptr<ASTImpl::Expr> root_expr_;
+    // nullptr if the expression cannot be simplified
+    std::unique_ptr<ASTImpl::Expr> simplified_expr_;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
-    std::forward_list<Position> cells_;
-    mutable std::vector<Position> unique_sorted_cells_;
+    CellList cells_;
+    mutable TrackedVector<Position> unique_sorted_cells_;
+    // references to other sheets, pointed to by ExternalCellExpr nodes
+    ExternalCellList external_cells_;
+
+    // the evaluated expression with its subexpressions shared through a
+    // table, nullptr if the formula is evaluated alone
+    std::unique_ptr<ASTImpl::Expr> shared_expr_;
+    // cells of the shared expression outside of the shared subexpressions
+    CellList shared_cells_;
+    ExternalCellList shared_external_cells_;
+
+    // the evaluated expression reading the cells of bound_sheet_ through
+    // handles, nullptr if the formula is not bound
+    std::unique_ptr<ASTImpl::Expr> bound_expr_;
+    const BindableSheetInterface* bound_sheet_ = nullptr;
+};
+
+// Subexpressions of the formulas of a sheet by their structure. Equal
+// subexpressions of different formulas are evaluated once until a cell
+// they read changes, which makes the formulas forget the values.
+class SubexpressionTable {
+public:
+    explicit SubexpressionTable(const SheetInterface* sheet);
+    ~SubexpressionTable();
+
+    // Builds the nodes of a new subexpression, the cells they point to are
+    // kept in the given lists
+    using Builder = std::function<std::unique_ptr<ASTImpl::Expr>(FormulaAST::CellList&,
+                                                                 FormulaAST::ExternalCellList&)>;
+    // Returns the subexpression equal to expr, it is built if there is none
+    std::shared_ptr<const ASTImpl::SharedSubexpression> Share(const ASTImpl::Expr& expr, const Builder& build);
+    // Forgets the subexpressions and the values of those still in use,
+    // e.g. after the cells they read moved
+    void Clear();
+
+private:
+    // Drops the subexpressions no formula uses any more
+    void Purge();
+
+    const SheetInterface* sheet_;
+    // by the printed expression, different numbers may print the same
+    std::unordered_map<std::string, std::vector<std::weak_ptr<ASTImpl::SharedSubexpression>>> subexpressions_;
+    // the number of keys after the last purge
+    size_t purged_size_ = 0;
 };
 
 FormulaAST ParseFormulaAST(std::istream& in);
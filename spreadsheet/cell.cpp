@@ -1,147 +1,440 @@
 #include "cell.h"
+#include "sheet.h"
 
+#include <atomic>
 #include <cassert>
 #include <iostream>
 #include <string>
 #include <optional>
-#include <deque>
+#include <unordered_set>
+#include <utility>
+
+namespace {
+// Orders the changes of values in all sheets, a formula has to be
+// recalculated if a cell it reads changed after its value was calculated
+std::atomic<uint64_t> last_revision = 0;
+}  // namespace
+
+Cell::Cell(Sheet* sheet, std::function<Cell*(Position)> cell_provider)
+    : cells_dependent_on_this_cell_(TrackingAllocator<Position>(
+          sheet->GetMemoryTracker().GetCounter(MemoryCategory::Dependencies)))
+    , referenced_cells_(cells_dependent_on_this_cell_.get_allocator())
+    , external_cells_(cells_dependent_on_this_cell_.get_allocator())
+    , sheet_(sheet)
+    , cell_provider_(std::move(cell_provider)) {
+}
 
 void Cell::Set(Position position, std::string text) {
     position_ = position;
+    sheet_->RecordPossibleChange(*this);
     
-    if (text.size() == 0) {
-        impl_ = std::make_unique<EmptyImpl>();
-
-    } else if (text.size() == 1) {
-        impl_ = std::make_unique<TextImpl>();
-        impl_->Set(position, text);
+    if (text.size() > 1 && text[0] == FORMULA_SIGN) {        
+        auto expression = text.substr(1);
+        std::shared_ptr<FormulaInterface> formula;
+        {
+            MemoryScope scope(sheet_->GetMemoryTracker(), MemoryCategory::Formulas);
+            formula = sheet_->CompilesFormulasLazily() ? ParseFormulaLazily(std::move(expression))
+                                                       : ParseFormula(std::move(expression));
+        }
+        SetFormula(position, std::move(formula));
+        return;
+    }
+    SetText(position, std::move(text));
+    changed_at_ = ++last_revision;
+    UpdateDependencies(position);
+    InvalidateCache();   
+}
 
-    } else if (text[0] == FORMULA_SIGN) {        
-        auto formula = ParseFormula(text.substr(1));
-        ThrowIfIncorrectFormula (formula);   
-        impl_ = std::make_unique<FormulaImpl>(sheet_, formula.release());
-        impl_->Set(position, text.substr(1)); 
+void Cell::SetText(Position position, std::string text) {
+    position_ = position;
+    MemoryTracker& memory = sheet_->GetMemoryTracker();
+    MemoryCounter* impl_counter = memory.GetCounter(MemoryCategory::CellImpls);
+    if (text.empty()) {
+        impl_ = MakeTracked<Impl, EmptyImpl>(impl_counter);
+    } else {
+        impl_ = MakeTracked<Impl, TextImpl>(impl_counter, memory.GetCounter(MemoryCategory::Texts));
+        impl_->Set(position, std::move(text));
+    }
+}
 
-    } else {        
-        impl_ = std::make_unique<TextImpl>();
-        impl_->Set(position, text);
+void Cell::SetFormula(Position position, std::shared_ptr<FormulaInterface> formula) {
+    position_ = position;
+    sheet_->RecordPossibleChange(*this);
+    ThrowIfIncorrectFormula (*formula);   
+    MemoryTracker& memory = sheet_->GetMemoryTracker();
+    if (SubexpressionTable* table = sheet_->GetSubexpressionTable()) {
+        MemoryScope scope(memory, MemoryCategory::Formulas);
+        formula->ShareSubexpressions(table);
     }
+    impl_ = MakeTracked<Impl, FormulaImpl>(memory.GetCounter(MemoryCategory::CellImpls), sheet_, std::move(formula),
+                                           memory.GetCounter(MemoryCategory::Caches));
     UpdateDependencies(position);
+    {
+        MemoryScope scope(memory, MemoryCategory::Formulas);
+        impl_->GetFormula()->BindCells(sheet_);
+    }
     InvalidateCache();   
 }
 
+void Cell::Restore(Position position, std::string text, const Value* value) {
+    changed_at_ = ++last_revision;
+    if (value == nullptr) {
+        SetText(position, std::move(text));
+        return;
+    }
+    position_ = position;
+    MemoryTracker& memory = sheet_->GetMemoryTracker();
+    std::shared_ptr<FormulaInterface> formula;
+    {
+        MemoryScope scope(memory, MemoryCategory::Formulas);
+        auto expression = text.substr(1);
+        formula = sheet_->CompilesFormulasLazily() ? ParseFormulaLazily(std::move(expression))
+                                                   : ParseFormula(std::move(expression));
+        if (SubexpressionTable* table = sheet_->GetSubexpressionTable()) {
+            formula->ShareSubexpressions(table);
+        }
+    }
+    auto referenced_cells = formula->GetReferencedCells();
+    referenced_cells_.insert(referenced_cells.begin(), referenced_cells.end());
+    auto external_cells = formula->GetExternalCells();
+    external_cells_.assign(std::make_move_iterator(external_cells.begin()),
+                           std::make_move_iterator(external_cells.end()));
+    impl_ = MakeTracked<Impl, FormulaImpl>(memory.GetCounter(MemoryCategory::CellImpls), sheet_, std::move(formula),
+                                           memory.GetCounter(MemoryCategory::Caches));
+    cached_value_ = *value;
+}
+
+const FormulaInterface* Cell::GetFormula() const {
+    return impl_->GetFormula().get();
+}
+
+std::shared_ptr<FormulaInterface> Cell::GetFormulaHandle() const {
+    return impl_->GetFormula();
+}
+
 std::vector<Position> Cell::GetReferencedCells() const {      
+    auto lock = sheet_->LockValues();
     return {referenced_cells_.begin(), referenced_cells_.end()};
 } 
 
 void Cell::Clear() {  
-    impl_->Set(position_, "");
-    InvalidateCache();
-    referenced_cells_.clear();
+    Set(position_, "");
+}
+
+void Cell::MarkStale() const {
+    stale_ = true;
+    if (const FormulaInterface* formula = GetFormula()) {
+        formula->ForgetSharedValues();
+    }
 }
 
 void Cell::InvalidateCache() {
+    sheet_->RecordPossibleChange(*this);
     cached_value_.reset();
-    std::deque<Position> cells_to_invalidate = {cells_dependent_on_this_cell_.begin(),
-                                                cells_dependent_on_this_cell_.end()};
-    std::set<Position> invalidated;
-    
-    while(cells_to_invalidate.size() != 0) {
-        Position current = cells_to_invalidate.back();
-        cells_to_invalidate.pop_back();
-        cell_provider_(current)->cached_value_.reset();        
-        for (Position pos : cell_provider_(current)->cells_dependent_on_this_cell_) {
-            if (invalidated.count(pos) == 0) {
-                cells_to_invalidate.push_front(pos);
-            }
-        }
-        invalidated.insert(current);
-    }    
+    InvalidateDependents();
+}
+
+void Cell::InvalidateDependents() {
+    sheet_->InvalidateDependents(*this);
 }
 
 Cell::Value Cell::GetValue() const { 
-    if (cached_value_) {
-        return cached_value_.value();
-    } else {
+    if (!impl_->IsFormula()) {
         return impl_->GetValue();
-    }    
+    }
+    auto lock = sheet_->LockValues();
+    if (NeedsEvaluation()) {
+        Evaluate(true);
+    }
+    return cached_value_.value();
+}
+
+std::optional<Cell::Value> Cell::GetKnownValue() const {
+    if (impl_ == nullptr) {
+        return Value{""};
+    }
+    if (impl_->IsFormula()) {
+        return cached_value_;
+    }
+    return impl_->GetValue();
+}
+
+bool Cell::NeedsEvaluation() const {
+    return impl_->IsFormula() && !(cached_value_ && (!stale_ || sheet_->ServesStaleValues()));
+}
+
+void Cell::Evaluate(bool evaluate_referenced_cells) const {
+    std::optional<EvaluationProfiler::Scope> scope;
+    EvaluationProfiler& profiler = sheet_->GetProfiler();
+    if (profiler.IsEnabled()) {
+        scope.emplace(profiler, position_);
+    }
+    if (evaluate_referenced_cells) {
+        EvaluateReferencedCells();
+    }
+    // an edit upstream was cut off before it reached this cell
+    if (cached_value_ && !ReferencedValuesChanged()) {
+        if (scope) {
+            scope->Discard();
+        }
+        stale_ = false;
+        verified_at_ = last_revision.load();
+        return;
+    }
+    CacheValue(impl_->GetValue());
+}
+
+bool Cell::ReferencedValuesChanged() const {
+    auto changed = [this](const Cell* cell) {
+        return cell == nullptr || cell->changed_at_ > verified_at_;
+    };
+    for (Position pos : referenced_cells_) {
+        if (changed(cell_provider_(pos))) {
+            return true;
+        }
+    }
+    for (const ExternalCell& external_cell : external_cells_) {
+        if (changed(sheet_->GetConcreteCell(external_cell))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Cell::CacheValue(Value value) const {
+    // cells reading this one keep their values if it calculates the same value
+    if (!cached_value_ || !(*cached_value_ == value)) {
+        cached_value_ = std::move(value);
+        changed_at_ = ++last_revision;
+    }
+    verified_at_ = last_revision.load();
+    stale_ = false;
+}
+
+// Evaluates the formulas the cell depends on, directly or not, so that each
+// formula comes after the formulas it reads. Then none of the evaluations
+// recurses into another one, however long the chain of references is.
+void Cell::EvaluateReferencedCells() const {
+    // a cell is evaluated when it is popped the second time, after the
+    // cells it refers to were evaluated
+    std::vector<std::pair<const Cell*, bool>> stack;
+    std::unordered_set<const Cell*> expanded;
+    auto push_referenced_cells = [&stack](const Cell& cell) {
+        auto push = [&stack](const Cell* referenced) {
+            if (referenced != nullptr && referenced->NeedsEvaluation()) {
+                stack.push_back({referenced, false});
+            }
+        };
+        for (Position pos : cell.referenced_cells_) {
+            push(cell.cell_provider_(pos));
+        }
+        for (const ExternalCell& external_cell : cell.external_cells_) {
+            push(cell.sheet_->GetConcreteCell(external_cell));
+        }
+    };
+
+    push_referenced_cells(*this);
+    while (!stack.empty()) {
+        auto [cell, references_evaluated] = stack.back();
+        if (references_evaluated) {
+            stack.pop_back();
+            if (cell->NeedsEvaluation()) {
+                cell->Evaluate(false);
+            }
+        } else if (!expanded.insert(cell).second) {
+            stack.pop_back();
+        } else {
+            stack.back().second = true;
+            push_referenced_cells(*cell);
+        }
+    }
+}
+
+void Cell::SetCalculatedValue(Value value) const {
+    CacheValue(std::move(value));
 }
 
 std::string Cell::GetText() const {
+    if (!impl_->IsFormula()) {
+        return impl_->GetText();
+    }
+    // the recalculation thread may be compiling and printing the formula
+    auto lock = sheet_->LockValues();
     return impl_->GetText();
     
 }
       
 void Cell::Impl::Set(Position pos, std::string text) {
-    text_ = text;
+    text_.assign(text.begin(), text.end());
 }
 
-bool Cell::HasCircDependenciesFromCell(Position p) const {
-    if (p == position_) return true;
-    for (auto position : cells_dependent_on_this_cell_) {
-        if (p == position ||
-            cell_provider_(position)->HasCircDependenciesFromCell(p)) {
-            return true;
-        } 
+bool Cell::HasCircDependencies(const FormulaInterface& formula) const {
+    const std::string& sheet = sheet_->GetName();
+    std::set<ExternalCell> referenced_cells;
+    for (Position pos : formula.GetReferencedCells()) {
+        referenced_cells.insert({sheet, pos});
+    }
+    for (ExternalCell& cell : formula.GetExternalCells()) {
+        referenced_cells.insert(std::move(cell));
     }
-    return false;
-}
 
-bool Cell::HasCircDependencies(std::vector<Position> cells) const {    
-    for (auto pos : cells) {
-        if (pos == position_ || HasCircDependenciesFromCell(pos)) return true;
+    // a referenced cell must not be reachable from this cell through the dependent cells
+    std::set<ExternalCell> visited;
+    std::vector<ExternalCell> cells_to_visit = {{sheet, position_}};
+    while (!cells_to_visit.empty() && !referenced_cells.empty()) {
+        ExternalCell current = std::move(cells_to_visit.back());
+        cells_to_visit.pop_back();
+        if (referenced_cells.count(current)) {
+            return true;
+        }
+        if (!visited.insert(current).second) {
+            continue;
+        }
+        for (ExternalCell& dependent : sheet_->GetDependentCells(current)) {
+            cells_to_visit.push_back(std::move(dependent));
+        }
     }
     return false;
 }
 
-void Cell::ThrowIfIncorrectFormula (std::unique_ptr<FormulaInterface>& formula) const {
+void Cell::ThrowIfIncorrectFormula (const FormulaInterface& formula) const {
     //If there are dependencies on other cells and they are cyclic, throw an exception
-    if (formula->GetReferencedCells().size() != 0) {        
-        if (HasCircDependencies(formula->GetReferencedCells())) {
-            throw CircularDependencyException("incorrect formula. Causes circular dependencies");        
-        }
-        //check the validity of the positions in the formula
-        for (auto position : formula->GetReferencedCells()) {
-            if (!position.IsValid()) throw FormulaException("incorrect formula");
-        }
+    if (HasCircDependencies(formula)) {
+        throw CircularDependencyException("incorrect formula. Causes circular dependencies");        
+    }
+    //check the validity of the positions in the formula
+    for (auto position : formula.GetReferencedCells()) {
+        if (!position.IsValid()) throw FormulaException("incorrect formula");
     }
 }
 
 void Cell::UpdateDependencies(Position position) {
     for (auto pos : referenced_cells_) {
-        cell_provider_(pos)->cells_dependent_on_this_cell_.erase(position);
+        if (Cell* cell = cell_provider_(pos)) {
+            cell->cells_dependent_on_this_cell_.erase(position);
+        } else {
+            sheet_->RemovePlaceholderDependent(pos, position);
+        }
     }
    
     auto referenced_cells = impl_->GetReferencedCells();
-    referenced_cells_ = {referenced_cells.begin(), referenced_cells.end()};
+    referenced_cells_.clear();
+    referenced_cells_.insert(referenced_cells.begin(), referenced_cells.end());
     
+    // empty positions are linked through placeholders, no cells are created
     for (auto pos : referenced_cells_) {
-        if (cell_provider_(pos) == nullptr) {
-            sheet_->SetCell(pos, "");
+        if (Cell* cell = cell_provider_(pos)) {
+            cell->cells_dependent_on_this_cell_.insert(position);
+        } else {
+            sheet_->AddPlaceholderDependent(pos, position);
+        }
+    }
+    UpdateExternalDependencies();
+}
+
+void Cell::UpdateExternalDependencies() {
+    for (const ExternalCell& cell : external_cells_) {
+        sheet_->RemoveExternalDependent(cell, position_);
+    }
+    auto external_cells = impl_->GetExternalCells();
+    external_cells_.assign(std::make_move_iterator(external_cells.begin()),
+                           std::make_move_iterator(external_cells.end()));
+    for (const ExternalCell& cell : external_cells_) {
+        sheet_->AddExternalDependent(cell, position_);
+    }
+}
+
+void Cell::DetachExternalCells() {
+    for (const ExternalCell& cell : external_cells_) {
+        sheet_->RemoveExternalDependent(cell, position_);
+    }
+    external_cells_.clear();
+}
+
+bool Cell::HandleStructuralChange(const StructuralChange& change) {
+    auto move_cells = [&change](const PositionSet& cells) {
+        // the change keeps the order of positions that are not deleted
+        PositionSet result(cells.get_allocator());
+        for (Position pos : cells) {
+            Position moved = change.Apply(pos);
+            if (moved.IsValid()) {
+                result.insert(result.end(), moved);
+            }
+        }
+        return result;
+    };
+
+    Position old_position = position_;
+    position_ = change.Apply(position_);
+    if (!(position_ == old_position)) {
+        for (const ExternalCell& cell : external_cells_) {
+            sheet_->RemoveExternalDependent(cell, old_position);
+            sheet_->AddExternalDependent(cell, position_);
         }
-        cell_provider_(pos)->cells_dependent_on_this_cell_.insert(position);
     }
+    referenced_cells_ = move_cells(referenced_cells_);
+    cells_dependent_on_this_cell_ = move_cells(cells_dependent_on_this_cell_);
+    MemoryScope scope(sheet_->GetMemoryTracker(), MemoryCategory::Formulas);
+    return impl_->HandleStructuralChange(change) == FormulaInterface::HandlingResult::ReferencesChanged;
+}
+
+bool Cell::HandleExternalStructuralChange(std::string_view sheet, const StructuralChange& change) {
+    FormulaInterface::HandlingResult result;
+    {
+        MemoryScope scope(sheet_->GetMemoryTracker(), MemoryCategory::Formulas);
+        result = impl_->HandleExternalStructuralChange(sheet, change);
+    }
+    if (result == FormulaInterface::HandlingResult::NothingChanged) {
+        return false;
+    }
+    UpdateExternalDependencies();
+    return result == FormulaInterface::HandlingResult::ReferencesChanged;
 }
 
 CellInterface::Value Cell::Impl::GetValue() const {
-    return text_;
+    return std::string(text_);
 }
 
 std::string Cell::Impl::GetText() const {
-    return text_;
+    return std::string(text_);
 }  
 
 CellInterface::Value Cell::TextImpl::GetValue() const {            
     if (text_[0] == ESCAPE_SIGN) {
-        return text_.substr(1);
+        return std::string(std::string_view(text_).substr(1));
     } else {
-        return text_;
+        return std::string(text_);
     }
 }     
 
-void Cell::FormulaImpl::Set(Position pos, std::string text) {
-    formula_ = ParseFormula(text);     
-    text_ = FORMULA_SIGN + formula_->GetExpression();
+Cell::FormulaImpl::FormulaImpl(SheetInterface* sheet, std::shared_ptr<FormulaInterface> formula,
+                               MemoryCounter* text_counter)
+    : table_(sheet), formula_(std::move(formula)), formula_text_(TrackingAllocator<char>(text_counter)) {
+}
+
+std::string Cell::FormulaImpl::GetText() const {
+    if (formula_text_.empty()) {
+        formula_text_ += FORMULA_SIGN;
+        formula_text_ += formula_->GetExpression();
+    }
+    return std::string(formula_text_);
+}
+
+FormulaInterface::HandlingResult Cell::FormulaImpl::HandleStructuralChange(const StructuralChange& change) {
+    auto result = formula_->HandleStructuralChange(change);
+    if (result != FormulaInterface::HandlingResult::NothingChanged) {
+        formula_text_.clear();
+    }
+    return result;
+}
+
+FormulaInterface::HandlingResult Cell::FormulaImpl::HandleExternalStructuralChange(
+        std::string_view sheet, const StructuralChange& change) {
+    auto result = formula_->HandleExternalStructuralChange(sheet, change);
+    if (result != FormulaInterface::HandlingResult::NothingChanged) {
+        formula_text_.clear();
+    }
+    return result;
 }
 
 std::vector<Position> Cell::FormulaImpl::GetReferencedCells() {
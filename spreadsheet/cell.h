@@ -2,42 +2,113 @@
 
 #include "common.h"
 #include "formula.h"
+#include "memory_tracker.h"
 
+#include <cstdint>
 #include <functional>
 #include <set>
 #include <optional>
 #include <memory>
+#include <utility>
 
-class Cell : public CellInterface {
+class Sheet;
+
+class Cell final : public CellInterface {
 public:
-    Cell(SheetInterface* sheet, std::function<Cell*(Position)> cell_provider) : sheet_(sheet), cell_provider_(cell_provider) {}
+    using PositionSet = std::set<Position, std::less<Position>, TrackingAllocator<Position>>;
+
+    Cell(Sheet* sheet, std::function<Cell*(Position)> cell_provider);
     ~Cell() = default;
 
     void Set(Position pos, std::string text);    
+    // Sets the text of a cell restored from a compressed tile, with the value
+    // of a formula. The cells a formula reads kept it as their dependent, so
+    // nothing is linked, bound or notified. Its revision was not kept, so the
+    // cell counts as changed for the formulas that check what they read.
+    void Restore(Position pos, std::string text, const Value* value);
+    // Sets an already compiled formula, e.g. a copy of another cell's formula
+    void SetFormula(Position pos, std::shared_ptr<FormulaInterface> formula);
     void Clear();
 
     Value GetValue() const override;
     std::string GetText() const override;   
     std::vector<Position> GetReferencedCells() const override;  
-    bool HasCircDependenciesFromCell(Position p) const;
-    bool HasCircDependencies(std::vector<Position> cells) const;    
+    // Returns nullptr unless the cell contains a formula
+    const FormulaInterface* GetFormula() const;
+    // Shares the compiled formula, e.g. to restore it later
+    std::shared_ptr<FormulaInterface> GetFormulaHandle() const;
+    Position GetPosition() const { return position_; }
+    // True if the cell would depend on itself with the given formula,
+    // possibly through cells of other sheets
+    bool HasCircDependencies(const FormulaInterface& formula) const;
+    bool IsReferenced() const { return !cells_dependent_on_this_cell_.empty(); }
+    const PositionSet& GetDependentCells() const { return cells_dependent_on_this_cell_; }
+    // Takes over the dependents of the placeholder the cell is created in place of
+    void SetDependentCells(PositionSet cells) { cells_dependent_on_this_cell_ = std::move(cells); }
+    // Gives the dependents to the placeholder left in place of the cell
+    PositionSet TakeDependentCells() {
+        return std::exchange(cells_dependent_on_this_cell_, PositionSet(cells_dependent_on_this_cell_.get_allocator()));
+    }
+    // Moves the cell and its links to other cells after rows or columns were
+    // inserted or deleted. Returns true if the value has to be recalculated.
+    bool HandleStructuralChange(const StructuralChange& change);
+    // Updates references to cells of another sheet after rows or columns
+    // were inserted or deleted there. Returns true if the value has to be
+    // recalculated.
+    bool HandleExternalStructuralChange(std::string_view sheet, const StructuralChange& change);
+    // Unlinks the cell from the cells of other sheets before it is destroyed
+    void DetachExternalCells();
     void InvalidateCache();
-    void ThrowIfIncorrectFormula (std::unique_ptr<FormulaInterface>& formula) const;    
+    // Marks the formulas depending on this cell as stale, in other sheets too
+    void InvalidateDependents();
+    // Caches a value calculated outside of the cell, e.g. for many rows at once
+    void SetCalculatedValue(Value value) const;
+    // Forces the next GetValue() to recalculate the formula, along with
+    // the subexpressions it shares
+    void MarkStale() const;
+    // The value readers last saw without calculating anything, nullopt for
+    // a formula that has not been calculated
+    std::optional<Value> GetKnownValue() const;
+    // True for a formula whose value has to be recalculated before it is returned
+    bool IsStale() const { return impl_->IsFormula() && (stale_ || !cached_value_); }
+    void ThrowIfIncorrectFormula (const FormulaInterface& formula) const;    
     
 private:
+    // Sets a text that is not a formula without notifying anything
+    void SetText(Position pos, std::string text);
+    // True for a formula whose value is not cached or is out of date
+    bool NeedsEvaluation() const;
+    // Calculates the value of the formula and caches it
+    void Evaluate(bool evaluate_referenced_cells) const;
+    // True if a cell the formula reads changed after the cached value was calculated
+    bool ReferencedValuesChanged() const;
+    void CacheValue(Value value) const;
+    void EvaluateReferencedCells() const;
     void UpdateDependencies(Position position);
+    void UpdateExternalDependencies();
     class Impl {
     public:
-        Impl() = default;
+        // texts longer than the string object are counted by the counter
+        explicit Impl(MemoryCounter* text_counter = nullptr) : text_(TrackingAllocator<char>(text_counter)) {}
         virtual ~Impl() = default;
         
         virtual void Set(Position pos, std::string text);
         virtual Value GetValue() const;
         virtual std::string GetText() const;
         virtual std::vector<Position> GetReferencedCells() { return {}; }
+        virtual std::vector<ExternalCell> GetExternalCells() const { return {}; }
+        virtual bool IsFormula() const { return false; }
+        virtual std::shared_ptr<FormulaInterface> GetFormula() const { return nullptr; }
+        virtual FormulaInterface::HandlingResult HandleStructuralChange(const StructuralChange& change) {
+            return FormulaInterface::HandlingResult::NothingChanged;
+        }
+        virtual FormulaInterface::HandlingResult HandleExternalStructuralChange(std::string_view sheet,
+                                                                                const StructuralChange& change) {
+            return FormulaInterface::HandlingResult::NothingChanged;
+        }
         
     protected:
-        std::string text_ = ""; 
+        TrackedString text_; 
     };
     
     class EmptyImpl : public Impl {    
@@ -45,25 +116,43 @@ private:
     
     class TextImpl : public Impl {
     public:        
+        using Impl::Impl;
         Value GetValue() const override;           
     };
     
     class FormulaImpl : public Impl {
     public:
-        FormulaImpl(SheetInterface* sheet, FormulaInterface* formula) : table_(sheet), formula_(formula) {}
-        void Set(Position pos, std::string text) override;
+        FormulaImpl(SheetInterface* sheet, std::shared_ptr<FormulaInterface> formula, MemoryCounter* text_counter);
         Value GetValue() const override; 
+        std::string GetText() const override;
         std::vector<Position> GetReferencedCells() override;
+        std::vector<ExternalCell> GetExternalCells() const override { return formula_->GetExternalCells(); }
+        bool IsFormula() const override { return true; }
+        std::shared_ptr<FormulaInterface> GetFormula() const override { return formula_; }
+        FormulaInterface::HandlingResult HandleStructuralChange(const StructuralChange& change) override;
+        FormulaInterface::HandlingResult HandleExternalStructuralChange(std::string_view sheet,
+                                                                        const StructuralChange& change) override;
     private:
         SheetInterface* table_;
-        std::unique_ptr<FormulaInterface> formula_;        
+        // shared with the undo history after the cell is overwritten
+        std::shared_ptr<FormulaInterface> formula_;        
+        // printed on the first request, a lazily compiled formula is not compiled before that
+        mutable TrackedString formula_text_;
     };
     
-    std::unique_ptr<Impl> impl_;
+    TrackedPtr<Impl> impl_;
     Position position_ {-1, -1};
-    std::set<Position> cells_dependent_on_this_cell_;
-    std::set<Position> referenced_cells_;
-    mutable std::optional<double> cached_value_;
-    SheetInterface* sheet_;
+    PositionSet cells_dependent_on_this_cell_;
+    PositionSet referenced_cells_;
+    // cells of other sheets the formula refers to
+    TrackedVector<ExternalCell> external_cells_;
+    mutable std::optional<Value> cached_value_;
+    // the cached value is out of date, it is still returned in the manual recalculation mode
+    mutable bool stale_ = false;
+    // the revision at which the value last changed
+    mutable uint64_t changed_at_ = 0;
+    // the revision at which the cached value was calculated or confirmed
+    mutable uint64_t verified_at_ = 0;
+    Sheet* sheet_;
     std::function<Cell*(Position)> cell_provider_;
 };
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <charconv>
+#include <chrono>
+#include <functional>
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -17,14 +21,45 @@ struct Position {
 
     bool IsValid() const;
     std::string ToString() const;
+    // Writes the A1 name of the position to [first, last) without allocating
+    // memory, like std::to_chars(). MAX_STRING_LENGTH characters are enough.
+    // Fails with std::errc::invalid_argument for an invalid position.
+    std::to_chars_result ToChars(char* first, char* last) const;
     void ThrowIfInvalid() const;
     static Position FromString(std::string_view str);
 
     static const int MAX_ROWS = 16384;
     static const int MAX_COLS = 16384;
+    static const int MAX_STRING_LENGTH = 17;
     static const Position NONE;
 };
 
+struct Range;
+
+// Insertion or deletion of whole rows or columns. Maps positions of
+// cells before the change to their positions after it.
+struct StructuralChange {
+    enum class Type {
+        InsertRows,
+        DeleteRows,
+        InsertColumns,
+        DeleteColumns,
+    };
+
+    Type type;
+    int first = 0;  // the first inserted or deleted row or column
+    int count = 0;
+
+    bool IsRowChange() const;
+    bool IsDeletion() const;
+    // Insertion for a deletion and vice versa
+    StructuralChange Inverse() const;
+    // Returns Position::NONE for a position that is deleted
+    Position Apply(Position pos) const;
+    // The positions that the change moves or deletes
+    Range GetMovedRange() const;
+};
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -32,6 +67,16 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// A rectangular area of cells
+struct Range {
+    Position top_left;
+    Size size;
+
+    // True if the range is not empty and lies within the table
+    bool IsValid() const;
+    void ThrowIfInvalid() const;
+};
+
 // Describes errors that may occur when calculating the formula.
 class FormulaError {
 public:
@@ -57,6 +102,68 @@ private:
 
 std::ostream& operator<<(std::ostream& output, FormulaError fe);
 
+// Evaluation statistics of a single formula cell collected while profiling is enabled.
+struct CellProfile {
+    Position position;
+    // the expression of the formula as returned by FormulaInterface::GetExpression()
+    std::string expression;
+    // number of times the formula was evaluated, reusing a cached value whose
+    // referenced cells did not change is not counted
+    size_t evaluations = 0;
+    // number of referenced cells read by the formula over all its evaluations
+    size_t referenced_reads = 0;
+    // time spent evaluating the formula. The out-of-date formulas it depends on
+    // are evaluated beforehand, deepest first, and this time includes them
+    // when the value of this cell was requested.
+    std::chrono::nanoseconds inclusive_time{0};
+    // time spent evaluating the formula itself, without the formulas it reads
+    std::chrono::nanoseconds exclusive_time{0};
+};
+
+// The shape of the graph of references between cells of a sheet,
+// references to other sheets are not included
+struct DependencyAnalysis {
+    // the formulas of the longest chain, each one reads the one before it
+    std::vector<Position> longest_chain;
+    // fan_in[n] is the number of formulas that read n cells
+    std::vector<size_t> fan_in;
+    // fan_out[n] is the number of cells that n formulas read
+    std::vector<size_t> fan_out;
+    // levels[n] is the number of formulas whose longest chain of formulas
+    // they read, directly or not, has n formulas. The formulas of a level
+    // can be calculated in parallel after the levels below it.
+    std::vector<size_t> levels;
+    // the level with the most formulas
+    size_t widest_level = 0;
+    // cells with the numbers of formulas that depend on them, directly or
+    // not, so that a change of the cell puts them out of date; most first
+    std::vector<std::pair<Position, size_t>> hubs;
+};
+
+// Memory allocated for a sheet in bytes, by the kind of data
+struct MemoryUsage {
+    // the table of pointers to cells, empty places included
+    size_t grid = 0;
+    // cell objects
+    size_t cells = 0;
+    // the text, formula or empty contents of cells
+    size_t cell_impls = 0;
+    // texts of text cells that do not fit into the string objects
+    size_t texts = 0;
+    // expression trees of formulas and their lists of referenced cells
+    size_t formulas = 0;
+    // links between formulas and the cells they refer to
+    size_t dependencies = 0;
+    // tiles of cells kept in the compressed encoding
+    size_t compressed_tiles = 0;
+    // cached results that do not fit into cell objects and printed formulas
+    size_t caches = 0;
+
+    size_t GetTotal() const {
+        return grid + cells + cell_impls + texts + formulas + dependencies + compressed_tiles + caches;
+    }
+};
+
 // An exception is thrown if an incorrect position is passed
 class InvalidPositionException : public std::out_of_range {
 public:
@@ -69,6 +176,19 @@ public:
     using std::runtime_error::runtime_error;
 };
 
+// An exception is thrown if inserting rows or columns would move cells
+// beyond Position::MAX_ROWS or Position::MAX_COLS
+class TableTooBigException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// An exception is thrown if the page file of a sheet cannot be written or read
+class PageFileException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
 // An exception thrown when trying to set a formula that leads to a cyclic dependency between cells
 class CircularDependencyException : public std::runtime_error {
 public:
@@ -98,6 +218,14 @@ public:
     virtual std::vector<Position> GetReferencedCells() const = 0;
 };
 
+// Defines when formulas are recalculated after the cells they depend on change.
+enum class RecalculationMode {
+    Lazy,             // by the first reader of an outdated value
+    EagerSync,        // inside SetCell() and ClearCell()
+    EagerBackground,  // by a background thread, readers that come first recalculate themselves
+    Manual,           // by Recalculate() only, outdated values are returned until then
+};
+
 inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
 
@@ -143,7 +271,208 @@ public:
     // as an empty string
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Writes the values of the cells of the range to values row by row, an
+    // empty cell gets an empty string. Only the cells of the range and the
+    // cells their formulas depend on are evaluated, so the cost depends on
+    // the size of the range rather than on the size of the table. values
+    // must have room for range.size.rows * range.size.cols elements.
+    virtual void GetValues(Range range, CellInterface::Value* values) const = 0;
+
+    // Prints the values of the cells of the range like PrintValues() prints
+    // the printable area
+    virtual void PrintValues(std::ostream& output, Range range) const = 0;
+
+    // Inserts count empty rows before the given one. Cells below move down
+    // and formulas referring to them are updated without being parsed again.
+    // Throws TableTooBigException if cells would move beyond the table.
+    virtual void InsertRows(int before, int count) = 0;
+    virtual void InsertColumns(int before, int count) = 0;
+
+    // Deletes count rows starting with the given one. Cells below move up,
+    // references to the deleted cells turn into #REF! errors.
+    virtual void DeleteRows(int first, int count) = 0;
+    virtual void DeleteColumns(int first, int count) = 0;
+
+    // Copies the cells of the source range so that its top left cell lands
+    // on the destination. References in copied formulas move by the same
+    // offset, those that move outside the table become #REF! errors. Empty
+    // source cells clear the destination cells. The ranges may overlap.
+    // If a copied formula would make a circular reference, a
+    // CircularDependencyException is thrown and no cell changes.
+    virtual void CopyRange(Range source, Position destination) = 0;
+
+    // Copies the first row of the range to all other rows of the range
+    // the way CopyRange() does.
+    virtual void FillDown(Range range) = 0;
+
+    // Reverts the last edit made by SetCell(), ClearCell(), CopyRange(),
+    // FillDown() or by inserting or deleting rows or columns. Returns false
+    // if there is nothing to undo. References from other sheets of a
+    // workbook to deleted cells stay #REF! errors.
+    virtual bool Undo() = 0;
+
+    // Repeats the last undone edit. Returns false if there is nothing to
+    // redo. Any other edit discards the edits that could be redone.
+    virtual bool Redo() = 0;
+
+    // Limits the approximate memory used by the undo and redo history, the
+    // oldest edits are forgotten first. 0 turns the history off. The
+    // default is 64 MiB.
+    virtual void SetUndoMemoryLimit(size_t bytes) = 0;
+
+    // Speeds up loading of large tables. While enabled, SetCell() checks the
+    // syntax of a formula and finds the cells it refers to, but builds the
+    // expression tree only when the formula is first calculated or its text
+    // is requested. Disabled by default.
+    virtual void SetLazyFormulaCompilation(bool enabled) = 0;
+
+    // Evaluates subexpressions that several formulas have in common, e.g.
+    // (A1+B1)/C1 in =(A1+B1)/C1*2 and =3-(A1+B1)/C1, once for all of them
+    // and keeps the value while the cells they read do not change. Costs
+    // memory for the shared copies of the subexpressions. Disabled by default.
+    virtual void SetSubexpressionSharing(bool enabled) = 0;
+
+    // Lets several threads call SetCell() at once while no other method is
+    // called. Texts and numbers of cells no formula reads are written in
+    // parallel by threads writing to different tiles of 64x64 cells.
+    // Formulas and cells that formulas read are written one at a time, so
+    // the dependencies and the check for circular references stay as they
+    // are. Sheets of a workbook always write one cell at a time. Disabled
+    // by default.
+    virtual void SetConcurrentWrites(bool enabled) = 0;
+
+    // Selects when formulas are recalculated, the default is RecalculationMode::Lazy.
+    // In the manual mode a formula that has never been calculated is
+    // calculated on the first read using the current values of its cells.
+    virtual void SetRecalculationMode(RecalculationMode mode) = 0;
+    virtual RecalculationMode GetRecalculationMode() const = 0;
+
+    // Recalculates all formulas whose values are out of date.
+    virtual void Recalculate() = 0;
+
+    // Called with the cells whose values changed, in ascending order
+    using ChangeListener = std::function<void(const std::vector<Position>& changed)>;
+
+    // Starts or stops tracking which values change. The cells an edit
+    // invalidated are compared with the values they had before it, so the
+    // cost is proportional to the edits and not to the sheet. Tracking does
+    // not evaluate formulas earlier than the recalculation mode does: the
+    // listener is called after each edit with the cells whose new values are
+    // known, and with the other cells once they are evaluated, i.e. after
+    // the next edit that follows a read in the lazy mode, after the
+    // background recalculation and after Recalculate(). Without a listener
+    // the changes are found when TakeChangedCells() is called, which
+    // evaluates the outdated formulas as a read would. In the manual mode
+    // dependent cells are reported after Recalculate(). Cells that only moved
+    // with inserted or deleted rows or columns are not reported.
+    virtual void SetChangeTracking(bool enabled, ChangeListener listener = nullptr) = 0;
+
+    // Returns the changed cells collected since the last call in ascending order
+    virtual std::vector<Position> TakeChangedCells() = 0;
+
+    // Turns collection of per-cell evaluation statistics on or off.
+    // Turning profiling on discards the statistics collected before.
+    virtual void SetProfilingEnabled(bool enabled) = 0;
+
+    // Returns statistics of at most top_n formula cells, the most expensive
+    // first. Cells are ranked by exclusive evaluation time.
+    virtual std::vector<CellProfile> GetProfile(size_t top_n) const = 0;
+
+    // Outputs GetProfile(top_n) as a table. Columns are separated by a tab
+    // character, times are printed in microseconds.
+    virtual void PrintProfile(std::ostream& output, size_t top_n) const = 0;
+
+    // Describes the dependency graph of the formulas: the longest chain of
+    // references, histograms of the numbers of cells formulas read and of
+    // formulas reading each cell, the levels that can be calculated in
+    // parallel and the top_n cells with the most dependent formulas.
+    virtual DependencyAnalysis AnalyzeDependencies(size_t top_n) const = 0;
+
+    // Returns the memory currently allocated for the sheet. The numbers are
+    // counted by the allocators of the sheet's data, not estimated. The
+    // undo history is not included.
+    virtual MemoryUsage GetMemoryUsage() const = 0;
+
+    // Saves memory on large tables that are rarely edited. Tiles of 64x64
+    // cells are compressed into a read-only encoding when they were not
+    // accessed by GetCell() or edits for idle_time, which is checked after
+    // edits. Formulas are kept as their texts with their values, so only
+    // tiles whose formulas are up to date and read back the same from their
+    // texts are compressed. If memory_limit is not 0, such tiles are also
+    // compressed after an edit while GetMemoryUsage() exceeds it, the least
+    // recently accessed first. Printing and GetValues() read compressed tiles
+    // as they are, any other access, including an edit of a cell a compressed
+    // formula refers to, expands the tile back. An idle time of
+    // milliseconds::max() without a memory limit turns the compression off,
+    // which is the default.
+    virtual void SetTileCompression(std::chrono::milliseconds idle_time, size_t memory_limit = 0) = 0;
+
+    // Compresses the tiles that are cold at the moment
+    virtual void CompressColdTiles() = 0;
+
+    // Keeps at most resident_bytes of compressed tiles in memory, the least
+    // recently used ones are written to the page file at the path and read
+    // back when they are printed or expanded. Formulas are paged with their
+    // texts and values, their compiled forms are dropped until the tile is
+    // expanded. The rows of the grid only keep places up to their last
+    // uncompressed cell. An empty path reads all tiles back and removes the
+    // file, which is the default. Throws PageFileException if the file
+    // cannot be created, written or read; a failure while compressing the
+    // tiles after an edit keeps them in memory instead.
+    virtual void SetPageFile(const std::string& path, size_t resident_bytes) = 0;
+
+    // Returns the values of the outputs in each scenario, where values[i][j]
+    // is the number that replaces inputs[j] in scenario i. Only the formulas
+    // of the sheet between the inputs and the outputs are evaluated, on
+    // copies of their values, and scenarios are evaluated in parallel. The
+    // sheet does not change. Cells of other sheets keep their values, even
+    // if they refer to the inputs. Throws std::invalid_argument if a
+    // scenario has a different number of values than there are inputs.
+    virtual std::vector<std::vector<CellInterface::Value>> Sweep(
+        const std::vector<Position>& inputs, const std::vector<std::vector<double>>& values,
+        const std::vector<Position>& outputs) const = 0;
+
+    // Finds a number for the input that makes the output equal to the
+    // target, starting from the current value of the input, the same way
+    // Sweep() evaluates scenarios. Returns nullopt if the search does not
+    // converge or the output is not a number.
+    virtual std::optional<double> GoalSeek(Position input, Position output, double target) const = 0;
+
+    // Returns the sheet of the same workbook with the given name, formulas
+    // use it to resolve references like Sheet2!A1. A table created by
+    // CreateSheet() does not belong to a workbook and always returns nullptr.
+    virtual const SheetInterface* FindSheet(std::string_view name) const = 0;
 };
 
 // Creates a ready-to-use empty table.
-std::unique_ptr<SheetInterface> CreateSheet();
\ No newline at end of file
+std::unique_ptr<SheetInterface> CreateSheet();
+
+// A set of named tables whose formulas may refer to each other's cells,
+// e.g. =Sheet2!A1*2. A reference to a sheet that does not exist evaluates
+// to #REF! until the sheet is added.
+class WorkbookInterface {
+public:
+    virtual ~WorkbookInterface() = default;
+
+    // Adds an empty table. The name consists of latin letters, digits and
+    // underscores and does not start with a digit. Throws
+    // std::invalid_argument if the name is invalid or already taken.
+    virtual SheetInterface* AddSheet(std::string name) = 0;
+
+    // Returns nullptr if there is no sheet with the given name
+    virtual SheetInterface* GetSheet(std::string_view name) = 0;
+    virtual const SheetInterface* GetSheet(std::string_view name) const = 0;
+
+    // Returns the names of all sheets in ascending order
+    virtual std::vector<std::string> GetSheetNames() const = 0;
+
+    // Recalculates outdated formulas of all sheets. Sheets that do not refer
+    // to each other's cells are recalculated in parallel, a sheet is
+    // recalculated after the sheets it refers to.
+    virtual void Recalculate() = 0;
+};
+
+// Creates an empty workbook that recalculates sheets on the given number of
+// threads, 0 means the number of hardware threads.
+std::unique_ptr<WorkbookInterface> CreateWorkbook(size_t threads = 0);
\ No newline at end of file
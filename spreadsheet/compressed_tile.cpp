@@ -0,0 +1,222 @@
+#include "compressed_tile.h"
+
+#include "bit_scan.h"
+#include "occupancy_index.h"
+
+#include <charconv>
+#include <cstring>
+#include <variant>
+
+namespace {
+constexpr int TILE_SIZE = OccupancyIndex::TILE_SIZE;
+constexpr int KIND_BITS = 2;
+// the XOR with the previous number is zero
+constexpr uint8_t SAME_NUMBER = 0x80;
+// long enough for any double printed in the shortest form
+constexpr size_t MAX_NUMBER_LENGTH = 32;
+
+// True if the text is the shortest form of the number, so the number
+// gives the text back
+bool ParseShortestNumber(std::string_view text, double& value) {
+    const char* last = text.data() + text.size();
+    auto [end, error] = std::from_chars(text.data(), last, value);
+    if (text.empty() || error != std::errc{} || end != last) {
+        return false;
+    }
+    char buffer[MAX_NUMBER_LENGTH];
+    auto result = std::to_chars(buffer, buffer + MAX_NUMBER_LENGTH, value);
+    return std::string_view(buffer, result.ptr - buffer) == text;
+}
+
+uint64_t ToBits(double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+double FromBits(uint64_t bits) {
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+}  // namespace
+
+CompressedTile::CompressedTile(MemoryCounter* counter)
+    : data_(TrackingAllocator<uint8_t>(counter))
+    , dictionary_(TrackingAllocator<char>(counter))
+    , dictionary_ends_(TrackingAllocator<uint32_t>(counter)) {
+}
+
+CompressedTile::CompressedTile(const std::vector<CellData>& cells, MemoryCounter* counter)
+    : CompressedTile(counter) {
+    count_ = cells.size();
+    std::unordered_map<std::string_view, uint32_t> indexes;
+    int previous_index = -1;
+    uint64_t previous_bits = 0;
+    for (const auto& [offset, text, value] : cells) {
+        int index = offset.row * TILE_SIZE + offset.col;
+        uint64_t distance = index - previous_index - 1;
+        previous_index = index;
+
+        double number;
+        if (value) {
+            // the text, then 0 and the number or the error category plus 1
+            WriteVarint(distance << KIND_BITS | Formula);
+            WriteText(text, indexes);
+            if (const double* result = std::get_if<double>(&*value)) {
+                WriteVarint(0);
+                WriteNumber(ToBits(*result), previous_bits);
+            } else {
+                WriteVarint(static_cast<uint64_t>(std::get<FormulaError>(*value).GetCategory()) + 1);
+            }
+        } else if (text.empty()) {
+            WriteVarint(distance << KIND_BITS | Empty);
+        } else if (ParseShortestNumber(text, number)) {
+            WriteVarint(distance << KIND_BITS | Number);
+            WriteNumber(ToBits(number), previous_bits);
+        } else {
+            WriteVarint(distance << KIND_BITS | Text);
+            WriteText(text, indexes);
+        }
+    }
+    data_.shrink_to_fit();
+    dictionary_.shrink_to_fit();
+    dictionary_ends_.shrink_to_fit();
+}
+
+void CompressedTile::ForEach(
+        const std::function<void(Position, std::string_view, const CellInterface::Value*)>& visit) const {
+    size_t offset = 0;
+    int index = -1;
+    uint64_t previous_bits = 0;
+    char buffer[MAX_NUMBER_LENGTH];
+    for (size_t i = 0; i < count_; ++i) {
+        uint64_t header = ReadVarint(offset);
+        index += static_cast<int>(header >> KIND_BITS) + 1;
+        Position position{index / TILE_SIZE, index % TILE_SIZE};
+        switch (static_cast<Kind>(header & ((1 << KIND_BITS) - 1))) {
+            case Empty:
+                visit(position, {}, nullptr);
+                break;
+            case Number: {
+                double number = FromBits(ReadNumber(offset, previous_bits));
+                auto result = std::to_chars(buffer, buffer + MAX_NUMBER_LENGTH, number);
+                visit(position, std::string_view(buffer, result.ptr - buffer), nullptr);
+                break;
+            }
+            case Text:
+                visit(position, ReadText(offset), nullptr);
+                break;
+            case Formula: {
+                std::string_view text = ReadText(offset);
+                uint64_t error = ReadVarint(offset);
+                CellInterface::Value value = error == 0
+                    ? CellInterface::Value(FromBits(ReadNumber(offset, previous_bits)))
+                    : CellInterface::Value(FormulaError(static_cast<FormulaError::Category>(error - 1)));
+                visit(position, text, &value);
+                break;
+            }
+        }
+    }
+}
+
+size_t CompressedTile::GetMemorySize() const {
+    return data_.capacity() + dictionary_.capacity() + dictionary_ends_.capacity() * sizeof(uint32_t);
+}
+
+// The count and the sizes of the three arrays are followed by the arrays
+std::string CompressedTile::Serialize() const {
+    const uint64_t header[] = {count_, data_.size(), dictionary_.size(), dictionary_ends_.size()};
+    std::string result;
+    result.reserve(sizeof(header) + data_.size() + dictionary_.size() + dictionary_ends_.size() * sizeof(uint32_t));
+    result.append(reinterpret_cast<const char*>(header), sizeof(header));
+    result.append(reinterpret_cast<const char*>(data_.data()), data_.size());
+    result.append(dictionary_.data(), dictionary_.size());
+    result.append(reinterpret_cast<const char*>(dictionary_ends_.data()), dictionary_ends_.size() * sizeof(uint32_t));
+    return result;
+}
+
+CompressedTile CompressedTile::Deserialize(std::string_view data, MemoryCounter* counter) {
+    uint64_t header[4];
+    std::memcpy(header, data.data(), sizeof(header));
+    data.remove_prefix(sizeof(header));
+    CompressedTile tile(counter);
+    tile.count_ = header[0];
+    auto bytes = reinterpret_cast<const uint8_t*>(data.data());
+    tile.data_.assign(bytes, bytes + header[1]);
+    data.remove_prefix(header[1]);
+    tile.dictionary_.assign(data.data(), header[2]);
+    data.remove_prefix(header[2]);
+    tile.dictionary_ends_.resize(header[3]);
+    if (header[3] != 0) {
+        std::memcpy(tile.dictionary_ends_.data(), data.data(), header[3] * sizeof(uint32_t));
+    }
+    return tile;
+}
+
+void CompressedTile::WriteText(std::string_view text, std::unordered_map<std::string_view, uint32_t>& indexes) {
+    auto [it, inserted] = indexes.emplace(text, static_cast<uint32_t>(dictionary_ends_.size()));
+    if (inserted) {
+        dictionary_ += text;
+        dictionary_ends_.push_back(dictionary_.size());
+    }
+    WriteVarint(it->second);
+}
+
+std::string_view CompressedTile::ReadText(size_t& offset) const {
+    uint64_t text = ReadVarint(offset);
+    uint32_t begin = text == 0 ? 0 : dictionary_ends_[text - 1];
+    return std::string_view(dictionary_).substr(begin, dictionary_ends_[text] - begin);
+}
+
+void CompressedTile::WriteVarint(uint64_t value) {
+    while (value >= 0x80) {
+        data_.push_back(static_cast<uint8_t>(value) | 0x80);
+        value >>= 7;
+    }
+    data_.push_back(static_cast<uint8_t>(value));
+}
+
+uint64_t CompressedTile::ReadVarint(size_t& offset) const {
+    uint64_t value = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t byte = data_[offset++];
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return value;
+        }
+    }
+}
+
+// A byte with the numbers of leading and trailing zero bytes of the XOR is
+// followed by its other bytes. Close numbers share the sign, the exponent
+// and the high bits of the mantissa, round ones have zero low bits.
+void CompressedTile::WriteNumber(uint64_t bits, uint64_t& previous_bits) {
+    uint64_t difference = bits ^ previous_bits;
+    previous_bits = bits;
+    if (difference == 0) {
+        data_.push_back(SAME_NUMBER);
+        return;
+    }
+    int leading = (63 - FindLastBit(difference)) / 8;
+    int trailing = CountTrailingZeros(difference) / 8;
+    data_.push_back(static_cast<uint8_t>(leading << 4 | trailing));
+    for (int byte = trailing; byte < 8 - leading; ++byte) {
+        data_.push_back(static_cast<uint8_t>(difference >> (byte * 8)));
+    }
+}
+
+uint64_t CompressedTile::ReadNumber(size_t& offset, uint64_t& previous_bits) const {
+    uint8_t control = data_[offset++];
+    if (control == SAME_NUMBER) {
+        return previous_bits;
+    }
+    int leading = control >> 4;
+    int trailing = control & 0xf;
+    uint64_t difference = 0;
+    for (int byte = trailing; byte < 8 - leading; ++byte) {
+        difference |= static_cast<uint64_t>(data_[offset++]) << (byte * 8);
+    }
+    previous_bits ^= difference;
+    return previous_bits;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "common.h"
+#include "memory_tracker.h"
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Read-only encoding of the texts of a tile of cells. Cells are stored in
+// row-major order, each one as the distance from the previous cell and the
+// kind of its text. Texts that are numbers printed in the shortest form are
+// stored as the XOR with the previous number without its zero bytes, other
+// texts as indexes into a dictionary of the distinct texts of the tile.
+// Formulas are stored as texts followed by their values, numbers in the
+// same XOR sequence as the texts.
+class CompressedTile {
+public:
+    struct CellData {
+        // from the top left cell of the tile
+        Position offset;
+        std::string text;
+        // the value of a formula, nullopt for a text
+        std::optional<CellInterface::Value> value;
+    };
+
+    // Takes the cells in row-major order, the memory is counted by the counter
+    CompressedTile(const std::vector<CellData>& cells, MemoryCounter* counter);
+
+    // Calls visit(offset, text, value) for each cell in row-major order, the
+    // value is nullptr unless the cell is a formula
+    void ForEach(const std::function<void(Position, std::string_view, const CellInterface::Value*)>& visit) const;
+    size_t GetCount() const { return count_; }
+    // Bytes allocated for the tile
+    size_t GetMemorySize() const;
+
+    // Returns the bytes Deserialize() restores the tile from
+    std::string Serialize() const;
+    static CompressedTile Deserialize(std::string_view data, MemoryCounter* counter);
+
+private:
+    explicit CompressedTile(MemoryCounter* counter);
+
+    enum Kind : uint8_t {
+        Empty,
+        Number,
+        Text,
+        Formula,
+    };
+
+    void WriteText(std::string_view text, std::unordered_map<std::string_view, uint32_t>& indexes);
+    std::string_view ReadText(size_t& offset) const;
+    void WriteVarint(uint64_t value);
+    uint64_t ReadVarint(size_t& offset) const;
+    void WriteNumber(uint64_t bits, uint64_t& previous_bits);
+    uint64_t ReadNumber(size_t& offset, uint64_t& previous_bits) const;
+
+    TrackedVector<uint8_t> data_;
+    // the distinct texts one after another
+    TrackedString dictionary_;
+    // where each text of the dictionary ends
+    TrackedVector<uint32_t> dictionary_ends_;
+    size_t count_ = 0;
+};
@@ -0,0 +1,103 @@
+#include "edit_history.h"
+
+#include <utility>
+
+void EditHistory::SetMemoryLimit(size_t bytes) {
+    memory_limit_ = bytes;
+    ShrinkToLimit();
+}
+
+void EditHistory::Begin() {
+    if (memory_limit_ > 0) {
+        record_.emplace();
+    }
+}
+
+void EditHistory::Add(Step step) {
+    if (record_) {
+        record_->push_back(std::move(step));
+    }
+}
+
+void EditHistory::Truncate(size_t steps) {
+    if (record_ && record_->size() > steps) {
+        record_->resize(steps);
+    }
+}
+
+void EditHistory::Commit() {
+    if (!record_) {
+        return;
+    }
+    Record record = std::move(*record_);
+    record_.reset();
+    Replay replay = std::exchange(replay_, Replay::None);
+    if (record.empty()) {
+        return;
+    }
+
+    size_t memory = GetMemoryUsage(record);
+    memory_ += memory;
+    if (replay == Replay::Undo) {
+        redo_.push_back({std::move(record), memory});
+    } else {
+        // a new edit makes the undone ones impossible to redo
+        if (replay == Replay::None) {
+            for (const Entry& entry : redo_) {
+                memory_ -= entry.memory;
+            }
+            redo_.clear();
+        }
+        undo_.push_back({std::move(record), memory});
+    }
+    ShrinkToLimit();
+}
+
+std::optional<EditHistory::Record> EditHistory::StartUndo() {
+    if (undo_.empty()) {
+        return std::nullopt;
+    }
+    Entry entry = std::move(undo_.back());
+    undo_.pop_back();
+    memory_ -= entry.memory;
+    replay_ = Replay::Undo;
+    return std::move(entry.record);
+}
+
+std::optional<EditHistory::Record> EditHistory::StartRedo() {
+    if (redo_.empty()) {
+        return std::nullopt;
+    }
+    Entry entry = std::move(redo_.back());
+    redo_.pop_back();
+    memory_ -= entry.memory;
+    replay_ = Replay::Redo;
+    return std::move(entry.record);
+}
+
+// Approximate, a formula is counted by the length of its expression
+size_t EditHistory::GetMemoryUsage(const Record& record) {
+    size_t result = sizeof(Entry) + record.capacity() * sizeof(Step);
+    for (const Step& step : record) {
+        if (const auto* cell = std::get_if<CellSnapshot>(&step)) {
+            result += cell->text.capacity();
+            if (cell->formula) {
+                result += cell->formula->GetExpression().size();
+            }
+        }
+    }
+    return result;
+}
+
+// The oldest edits to undo are forgotten first, then the edits that would
+// be redone last
+void EditHistory::ShrinkToLimit() {
+    while (memory_ > memory_limit_ && !undo_.empty()) {
+        memory_ -= undo_.front().memory;
+        undo_.pop_front();
+    }
+    while (memory_ > memory_limit_ && !redo_.empty()) {
+        memory_ -= redo_.front().memory;
+        redo_.pop_front();
+    }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <deque>
+#include <memory>
+#include <optional>
+#include <variant>
+#include <vector>
+
+// Undo and redo stacks of a sheet. An edit is recorded as the steps that
+// changed the sheet: previous contents of cells and structural changes.
+// Undoing an edit replays its steps backwards, and the replay is recorded
+// as the edit that redoes it.
+class EditHistory {
+public:
+    // The content of a cell before a step
+    struct CellSnapshot {
+        Position position;
+        bool existed = false;
+        std::string text;  // unused for a formula
+        // the compiled formula the cell owned, restored without parsing
+        std::shared_ptr<FormulaInterface> formula;
+    };
+    // The previous content of the cells comes before a structural change
+    // in a record, so cells are restored after the change is reverted
+    using Step = std::variant<CellSnapshot, StructuralChange>;
+    using Record = std::vector<Step>;
+
+    // 0 turns the history off and forgets recorded edits
+    void SetMemoryLimit(size_t bytes);
+    bool IsRecording() const { return record_.has_value(); }
+    // False if the history is off
+    bool IsEnabled() const { return memory_limit_ > 0; }
+
+    // Steps added between Begin() and Commit() form one edit
+    void Begin();
+    void Add(Step step);
+    void Commit();
+    // The number of steps of the edit being recorded
+    size_t GetStepCount() const { return record_ ? record_->size() : 0; }
+    // Forgets the steps recorded after the edit had the given number of them,
+    // e.g. of a part of the edit that was rolled back
+    void Truncate(size_t steps);
+
+    // Returns the last edit to undo or redo, the next recorded edit goes to
+    // the opposite stack
+    std::optional<Record> StartUndo();
+    std::optional<Record> StartRedo();
+
+private:
+    enum class Replay { None, Undo, Redo };
+
+    struct Entry {
+        Record record;
+        size_t memory;
+    };
+
+    static size_t GetMemoryUsage(const Record& record);
+    void ShrinkToLimit();
+
+    std::deque<Entry> undo_;
+    std::deque<Entry> redo_;  // the next edit to redo is at the back
+    std::optional<Record> record_;
+    Replay replay_ = Replay::None;
+    size_t memory_ = 0;
+    size_t memory_limit_ = 64 << 20;
+};
@@ -1,17 +1,49 @@
 #include "formula.h"
 
 #include "FormulaAST.h"
+#include "memory_tracker.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <cmath>
+#include <cstdlib>
 #include <sstream>
 #include <functional>
+#include <tuple>
 
 using namespace std::literals;
 
+FormulaError::Category FormulaError::GetCategory() const {
+    return category_;
+}
+
+std::string_view FormulaError::ToString() const {
+    switch (category_) {
+        case Category::Ref:
+            return "#REF!"sv;
+        case Category::Value:
+            return "#VALUE!"sv;
+        case Category::Arithmetic:
+            return "#ARITHM!"sv;
+    }
+    return ""sv;
+}
+
 std::ostream& operator<<(std::ostream& output, FormulaError fe) {
-    return output << "#ARITHM!";
+    return output << fe.ToString();
+}
+
+bool ExternalCell::operator==(const ExternalCell& rhs) const {
+    return position == rhs.position && sheet == rhs.sheet;
+}
+
+bool ExternalCell::operator<(const ExternalCell& rhs) const {
+    return std::tie(sheet, position) < std::tie(rhs.sheet, rhs.position);
+}
+
+std::string ExternalCell::ToString() const {
+    return sheet + '!' + position.ToString();
 }
 
 namespace {
@@ -22,8 +54,22 @@ public:
     } catch (const FormulaException& exc) {
         throw exc;
     }
+
+    explicit Formula(FormulaAST ast)
+        : ast_(std::move(ast)) {
+    }
+
+    static void* operator new(size_t size) {
+        return AllocateTracked(size);
+    }
+    static void operator delete(void* p, size_t size) noexcept {
+        DeallocateTracked(p, size);
+    }
     
     Value Evaluate(const SheetInterface& sheet) const override {
+        if (auto error = ast_.GetConstantError()) {
+            return *error;
+        }
         Value value;
         try {
            value = ast_.Execute(&sheet);
@@ -39,12 +85,324 @@ public:
     }
     
     std::vector<Position> GetReferencedCells() const override {
-        return ast_.GetCells();
+        const auto& cells = ast_.GetCells();
+        return {cells.begin(), cells.end()};
     };
 
+    HandlingResult HandleStructuralChange(const StructuralChange& change) override {
+        return ast_.HandleStructuralChange(change);
+    }
+
+    std::vector<ExternalCell> GetExternalCells() const override {
+        return ast_.GetExternalCells();
+    }
+
+    HandlingResult HandleExternalStructuralChange(std::string_view sheet,
+                                                  const StructuralChange& change) override {
+        return ast_.HandleExternalStructuralChange(sheet, change);
+    }
+
+    std::unique_ptr<FormulaInterface> Clone(int row_shift, int col_shift) const override {
+        return std::make_unique<Formula>(ast_.Clone(row_shift, col_shift));
+    }
+
+    bool IsShiftedCopyOf(const FormulaInterface& other, int row_shift, int col_shift) const override;
+
+    std::vector<Value> EvaluateRows(const SheetInterface& sheet, int rows) const override {
+        if (auto error = ast_.GetConstantError()) {
+            return std::vector<Value>(rows, *error);
+        }
+        return ast_.ExecuteRows(&sheet, rows);
+    }
+
+    void ShareSubexpressions(SubexpressionTable* table) override {
+        ast_.ShareSubexpressions(table);
+    }
+
+    void ForgetSharedValues() const override {
+        ast_.ForgetSharedValues();
+    }
+
+    void BindCells(const BindableSheetInterface* sheet) override {
+        ast_.BindCells(sheet);
+    }
+
+    const FormulaAST& GetAST() const {
+        return ast_;
+    }
+
 private:
     FormulaAST ast_;
 };
+
+// Recognizes the language of Formula.g4 without building a tree: an operand
+// is a number, a cell or an expression in parentheses, optionally preceded
+// by unary signs, and operands alternate with binary operators
+class FormulaScanner {
+public:
+    explicit FormulaScanner(std::string_view expression)
+        : expression_(expression) {
+    }
+
+    // Throws FormulaException if the expression is not a valid formula
+    void Scan() {
+        bool expect_operand = true;
+        int depth = 0;
+        while (pos_ < expression_.size()) {
+            char c = expression_[pos_];
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+                ++pos_;
+            } else if (expect_operand && (c == '+' || c == '-')) {
+                ++pos_;
+            } else if (expect_operand && c == '(') {
+                ++depth;
+                ++pos_;
+            } else if (expect_operand && (IsDigit(c) || c == '.')) {
+                ScanNumber();
+                expect_operand = false;
+            } else if (expect_operand && (std::isalpha(static_cast<unsigned char>(c)) || c == '_')) {
+                ScanCell();
+                expect_operand = false;
+            } else if (!expect_operand && (c == '+' || c == '-' || c == '*' || c == '/')) {
+                expect_operand = true;
+                ++pos_;
+            } else if (!expect_operand && c == ')' && depth > 0) {
+                --depth;
+                ++pos_;
+            } else {
+                Fail();
+            }
+        }
+        if (expect_operand || depth != 0) {
+            Fail();
+        }
+    }
+
+    std::vector<Position> MoveCells() {
+        return Unique(std::move(cells_));
+    }
+
+    std::vector<ExternalCell> MoveExternalCells() {
+        return Unique(std::move(external_cells_));
+    }
+
+private:
+    static bool IsDigit(char c) {
+        return std::isdigit(static_cast<unsigned char>(c));
+    }
+
+    template <typename T>
+    static std::vector<T> Unique(std::vector<T> items) {
+        std::sort(items.begin(), items.end());
+        items.erase(std::unique(items.begin(), items.end()), items.end());
+        return items;
+    }
+
+    [[noreturn]] void Fail() const {
+        throw FormulaException("formula exception");
+    }
+
+    size_t SkipDigits(size_t pos) const {
+        while (pos < expression_.size() && IsDigit(expression_[pos])) {
+            ++pos;
+        }
+        return pos;
+    }
+
+    void ScanNumber() {
+        size_t start = pos_;
+        size_t end = SkipDigits(pos_);
+        bool has_integer_part = end > start;
+        if (end < expression_.size() && expression_[end] == '.') {
+            size_t fraction_end = SkipDigits(end + 1);
+            if (fraction_end == end + 1) {
+                Fail();
+            }
+            end = fraction_end;
+        } else if (!has_integer_part) {
+            Fail();
+        }
+        if (end < expression_.size() && (expression_[end] == 'e' || expression_[end] == 'E')) {
+            size_t exponent = end + 1;
+            if (exponent < expression_.size() && (expression_[exponent] == '+' || expression_[exponent] == '-')) {
+                ++exponent;
+            }
+            size_t exponent_end = SkipDigits(exponent);
+            if (exponent_end == exponent) {
+                Fail();
+            }
+            end = exponent_end;
+        }
+        double value = std::strtod(std::string(expression_.substr(start, end - start)).c_str(), nullptr);
+        if (!std::isfinite(value)) {
+            Fail();
+        }
+        pos_ = end;
+    }
+
+    void ScanCell() {
+        auto is_name_char = [](char c) {
+            return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+        };
+        size_t name_end = pos_;
+        while (name_end < expression_.size() && is_name_char(expression_[name_end])) {
+            ++name_end;
+        }
+        std::string_view sheet;
+        size_t start = pos_;
+        if (name_end < expression_.size() && expression_[name_end] == '!') {
+            sheet = expression_.substr(pos_, name_end - pos_);
+            start = name_end + 1;
+        }
+
+        size_t end = start;
+        while (end < expression_.size() && std::isupper(static_cast<unsigned char>(expression_[end]))) {
+            ++end;
+        }
+        size_t digits_start = end;
+        end = SkipDigits(end);
+        if (digits_start == start || end == digits_start) {
+            Fail();
+        }
+        Position cell = Position::FromString(expression_.substr(start, end - start));
+        if (!cell.IsValid()) {
+            Fail();
+        }
+        if (sheet.empty()) {
+            cells_.push_back(cell);
+        } else {
+            external_cells_.push_back({std::string(sheet), cell});
+        }
+        pos_ = end;
+    }
+
+    std::string_view expression_;
+    size_t pos_ = 0;
+    std::vector<Position> cells_;
+    std::vector<ExternalCell> external_cells_;
+};
+
+// Keeps the text of a checked formula and the cells it refers to, the
+// expression tree is built on the first evaluation or when the expression
+// is requested. The tree is counted where the formula itself is.
+class LazyFormula : public FormulaInterface {
+public:
+    LazyFormula(const std::string& expression, const std::vector<Position>& cells,
+                const std::vector<ExternalCell>& external_cells)
+        : counter_(MemoryScope::GetCurrentCounter())
+        , expression_(expression.begin(), expression.end())
+        , cells_(cells.begin(), cells.end())
+        , external_cells_(external_cells.begin(), external_cells.end()) {
+    }
+
+    static void* operator new(size_t size) {
+        return AllocateTracked(size);
+    }
+    static void operator delete(void* p, size_t size) noexcept {
+        DeallocateTracked(p, size);
+    }
+
+    Value Evaluate(const SheetInterface& sheet) const override {
+        return GetCompiled().Evaluate(sheet);
+    }
+
+    std::string GetExpression() const override {
+        return GetCompiled().GetExpression();
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        if (compiled_) {
+            return compiled_->GetReferencedCells();
+        }
+        return {cells_.begin(), cells_.end()};
+    }
+
+    std::vector<ExternalCell> GetExternalCells() const override {
+        if (compiled_) {
+            return compiled_->GetExternalCells();
+        }
+        return {external_cells_.begin(), external_cells_.end()};
+    }
+
+    HandlingResult HandleStructuralChange(const StructuralChange& change) override {
+        return GetCompiled().HandleStructuralChange(change);
+    }
+
+    HandlingResult HandleExternalStructuralChange(std::string_view sheet,
+                                                  const StructuralChange& change) override {
+        return GetCompiled().HandleExternalStructuralChange(sheet, change);
+    }
+
+    std::unique_ptr<FormulaInterface> Clone(int row_shift, int col_shift) const override {
+        return GetCompiled().Clone(row_shift, col_shift);
+    }
+
+    bool IsShiftedCopyOf(const FormulaInterface& other, int row_shift, int col_shift) const override {
+        return GetCompiled().IsShiftedCopyOf(other, row_shift, col_shift);
+    }
+
+    std::vector<Value> EvaluateRows(const SheetInterface& sheet, int rows) const override {
+        return GetCompiled().EvaluateRows(sheet, rows);
+    }
+
+    // the subexpressions are shared when the formula is compiled
+    void ShareSubexpressions(SubexpressionTable* table) override {
+        table_ = table;
+        if (compiled_) {
+            compiled_->ShareSubexpressions(table);
+        }
+    }
+
+    // a formula not compiled yet shares nothing
+    void ForgetSharedValues() const override {
+        if (compiled_) {
+            compiled_->ForgetSharedValues();
+        }
+    }
+
+    // and the cells are bound then too
+    void BindCells(const BindableSheetInterface* sheet) override {
+        bound_sheet_ = sheet;
+        if (compiled_) {
+            compiled_->BindCells(sheet);
+        }
+    }
+
+    Formula& GetCompiled() const {
+        if (!compiled_) {
+            MemoryScope scope(counter_);
+            compiled_ = std::make_unique<Formula>(std::string(expression_));
+            if (table_) {
+                compiled_->ShareSubexpressions(table_);
+            }
+            if (bound_sheet_) {
+                compiled_->BindCells(bound_sheet_);
+            }
+            // swapped with empty containers, so the memory is released
+            TrackedString().swap(expression_);
+            TrackedVector<Position>().swap(cells_);
+            TrackedVector<ExternalCell>().swap(external_cells_);
+        }
+        return *compiled_;
+    }
+
+private:
+    MemoryCounter* counter_;
+    mutable TrackedString expression_;
+    mutable TrackedVector<Position> cells_;
+    mutable TrackedVector<ExternalCell> external_cells_;
+    mutable std::unique_ptr<Formula> compiled_;
+    SubexpressionTable* table_ = nullptr;
+    const BindableSheetInterface* bound_sheet_ = nullptr;
+};
+
+bool Formula::IsShiftedCopyOf(const FormulaInterface& other, int row_shift, int col_shift) const {
+    const Formula* formula = dynamic_cast<const Formula*>(&other);
+    if (auto* lazy = dynamic_cast<const LazyFormula*>(&other)) {
+        formula = &lazy->GetCompiled();
+    }
+    return formula && ast_.IsShiftedCopyOf(formula->GetAST(), row_shift, col_shift);
+}
 }  // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
@@ -54,4 +412,12 @@ std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     catch(...) {
         throw FormulaException("formula exception");
     }    
+}
+
+std::unique_ptr<FormulaInterface> ParseFormulaLazily(std::string expression) {
+    FormulaScanner scanner(expression);
+    scanner.Scan();
+    auto cells = scanner.MoveCells();
+    auto external_cells = scanner.MoveExternalCells();
+    return std::make_unique<LazyFormula>(expression, cells, external_cells);
 }
\ No newline at end of file
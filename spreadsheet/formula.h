@@ -3,12 +3,37 @@
 #include "common.h"
 
 #include <memory>
+#include <string_view>
 #include <vector>
 
+class Cell;
+class SubexpressionTable;
+
+// Reference to a cell of another sheet of the workbook, written as Sheet2!A1
+struct ExternalCell {
+    std::string sheet;
+    Position position;
+
+    bool operator==(const ExternalCell& rhs) const;
+    bool operator<(const ExternalCell& rhs) const;
+    std::string ToString() const;
+};
+
+// A sheet whose formulas may read its cells through handles resolved once
+// rather than by position on every evaluation
+class BindableSheetInterface : public SheetInterface {
+public:
+    // nullptr if there is no cell at the position
+    virtual const Cell* FindBoundCell(Position pos) const = 0;
+    // False while the cells have to be read by position
+    virtual bool AllowsBoundReads() const = 0;
+};
+
 // Formula that allows for calculating and updating an arithmetic expression.
 // Supported features:
 // * Simple binary operations and numbers, parentheses: 1+2*3, 2.5*(2+3.5/7)
 // * Cell values as variables: A1+B2*C3
+// * Cells of other sheets of the workbook: Sheet2!A1*2
 // Cells specified in the formula can be either formulas or text. If it's 
 // text that represents a number, it is treated as a number. An empty 
 // cell or a cell with empty text is treated as the number zero.
@@ -16,6 +41,12 @@ class FormulaInterface {
 public:
     using Value = std::variant<double, FormulaError>;
 
+    enum class HandlingResult {
+        NothingChanged,         // no references were affected
+        ReferencesRenamedOnly,  // referenced cells moved, the value stays the same
+        ReferencesChanged,      // some referenced cells were deleted, the value has to be recalculated
+    };
+
     virtual ~FormulaInterface() = default;
 
     // Returns the computed value of the formula for the given sheet or an error.
@@ -32,8 +63,53 @@ public:
     // of the formula. The list is sorted in ascending order and does not
     // contain duplicate cells.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Updates references after rows or columns were inserted or deleted.
+    // References to deleted cells are printed and evaluated as #REF! errors
+    // and are not returned by GetReferencedCells().
+    virtual HandlingResult HandleStructuralChange(const StructuralChange& change) = 0;
+
+    // Returns valid references to cells of other sheets, sorted and without
+    // duplicates. They are not included in GetReferencedCells().
+    virtual std::vector<ExternalCell> GetExternalCells() const = 0;
+
+    // Updates references to cells of the given sheet after rows or columns
+    // were inserted or deleted there.
+    virtual HandlingResult HandleExternalStructuralChange(std::string_view sheet,
+                                                          const StructuralChange& change) = 0;
+
+    // Returns a copy of the formula with all references moved by the given
+    // offset, as when a cell is copied to another place. References that
+    // move outside the table become #REF! errors. The copy is made without
+    // parsing the expression again.
+    virtual std::unique_ptr<FormulaInterface> Clone(int row_shift, int col_shift) const = 0;
+
+    // True if the formula is the other one copied with the given offset,
+    // i.e. equal to other.Clone(row_shift, col_shift).
+    virtual bool IsShiftedCopyOf(const FormulaInterface& other, int row_shift, int col_shift) const = 0;
+
+    // Returns the values of the formula and of its copies moved down by
+    // 1, 2, ..., rows - 1 rows, as if they were evaluated one by one. The
+    // rows are evaluated together, which is faster for long filled columns.
+    virtual std::vector<Value> EvaluateRows(const SheetInterface& sheet, int rows) const = 0;
+
+    // Evaluates the subexpressions the formula has in common with other
+    // formulas of the table once for all of them, nullptr stops sharing
+    virtual void ShareSubexpressions(SubexpressionTable* table) = 0;
+    // Drops the values of the shared subexpressions, so they are evaluated
+    // anew; called when a cell the formula reads changes
+    virtual void ForgetSharedValues() const = 0;
+
+    // Makes the formula read the cells of the sheet through handles resolved
+    // once rather than by position on every evaluation, nullptr unbinds it
+    virtual void BindCells(const BindableSheetInterface* sheet) = 0;
 };
 
 // Parses the given expression and returns a formula object.
 // Throws FormulaException if the formula is syntactically incorrect.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Checks the syntax and finds the referenced cells without building the
+// expression tree. The tree is built when the formula is first evaluated
+// or its expression is requested. Throws FormulaException like ParseFormula().
+std::unique_ptr<FormulaInterface> ParseFormulaLazily(std::string expression);
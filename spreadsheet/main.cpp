@@ -1,8 +1,18 @@
+#include <atomic>
+#include <cmath>
+#include <filesystem>
+#include <iterator>
 #include <limits>
+#include <map>
+#include <random>
+#include <thread>
 
 #include "common.h"
 #include "formula.h"
+#include "occupancy_index.h"
+#include "server.h"
 #include "test_runner_p.h"
+#include "thread_pool.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -73,6 +83,29 @@ void TestStringToPositionInvalid() {
     ASSERT(!Position::FromString("XFE16384").IsValid());
     ASSERT(!Position::FromString("A1234567890123456789").IsValid());
     ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
+    ASSERT(!Position::FromString("A1 ").IsValid());
+    ASSERT(!Position::FromString("\xC1" "1").IsValid());
+}
+
+void TestPositionCodec() {
+    char buffer[Position::MAX_STRING_LENGTH];
+    auto result = Position{0, 702}.ToChars(buffer, buffer + 3);
+    ASSERT(result.ec == std::errc::value_too_large);
+    result = Position::NONE.ToChars(std::begin(buffer), std::end(buffer));
+    ASSERT(result.ec == std::errc::invalid_argument && result.ptr == buffer);
+
+    // every column with rows of every length
+    std::vector<Position> positions;
+    for (int row : {0, 8, 9, 98, 99, 998, 999, 9998, 9999, Position::MAX_ROWS - 1}) {
+        for (int col = 0; col < Position::MAX_COLS; ++col) {
+            positions.push_back({row, col});
+        }
+    }
+    for (Position pos : positions) {
+        result = pos.ToChars(std::begin(buffer), std::end(buffer));
+        ASSERT(result.ec == std::errc{});
+        ASSERT_EQUAL(Position::FromString({buffer, static_cast<size_t>(result.ptr - buffer)}), pos);
+    }
 }
 
 void TestEmpty() {
@@ -200,6 +233,36 @@ void TestFormulaReferencedCells() {
     ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
 }
 
+void TestFormulaSimplification() {
+    auto sheet = CreateSheet();
+    auto evaluate = [&](std::string expr) {
+        return ParseFormula(std::move(expr))->Evaluate(*sheet);
+    };
+    sheet->SetCell("A1"_pos, "5");
+
+    auto formula = ParseFormula("2*3+A1*1");
+    ASSERT_EQUAL(formula->GetExpression(), "2*3+A1*1");
+    ASSERT_EQUAL(std::get<double>(formula->Evaluate(*sheet)), 11);
+    ASSERT_EQUAL(ParseFormula("(1+2)/1*A1-0")->GetExpression(), "(1+2)/1*A1-0");
+    ASSERT_EQUAL(std::get<double>(evaluate("--A1/1")), 5);
+    ASSERT_EQUAL(std::get<double>(evaluate("+(1*A1)-(4-2*2)")), 5);
+
+    ASSERT_EQUAL(std::get<FormulaError>(evaluate("A1/(2-2)")),
+                 FormulaError(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(std::get<FormulaError>(evaluate("A1+1/0")),
+                 FormulaError(FormulaError::Category::Arithmetic));
+
+    // identities that hold in IEEE arithmetic only
+    sheet->SetCell("A2"_pos, "=-A3");
+    ASSERT(!std::signbit(std::get<double>(evaluate("A2+0"))));
+    ASSERT(std::signbit(std::get<double>(evaluate("A2-0"))));
+
+    // removing an identity keeps the errors of the operand
+    sheet->SetCell("B1"_pos, "text");
+    ASSERT_EQUAL(std::get<FormulaError>(evaluate("B1*1")),
+                 FormulaError(FormulaError::Category::Value));
+}
+
 void TestErrorValue() {
     auto sheet = CreateSheet();
     sheet->SetCell("E2"_pos, "A1");
@@ -318,7 +381,8 @@ void TestCellReferences() {
     ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
 
     sheet->SetCell("B2"_pos, "=B1");
-    ASSERT(sheet->GetCell("B1"_pos)->GetReferencedCells().empty());
+    // an empty referenced cell is not created
+    ASSERT(sheet->GetCell("B1"_pos) == nullptr);
     ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"B1"_pos});
 
     sheet->SetCell("A2"_pos, "");
@@ -367,6 +431,1333 @@ void TestCellCircularReferences() {
     
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
+
+void TestEvaluationProfile() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "=A1+1");
+    sheet->SetCell("A3"_pos, "=A2 + A1");
+
+    sheet->GetCell("A3"_pos)->GetValue();
+    ASSERT(sheet->GetProfile(10).empty());
+
+    sheet->SetProfilingEnabled(true);
+    sheet->SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(), CellInterface::Value(3.0));
+    sheet->SetProfilingEnabled(false);
+
+    auto profile = sheet->GetProfile(10);
+    ASSERT_EQUAL(profile.size(), 2u);
+    ASSERT_EQUAL(sheet->GetProfile(1).size(), 1u);
+    for (const CellProfile& cell : profile) {
+        ASSERT_EQUAL(cell.evaluations, 1u);
+        ASSERT(cell.exclusive_time <= cell.inclusive_time);
+        if (cell.position == "A3"_pos) {
+            ASSERT_EQUAL(cell.expression, "A2+A1");
+            ASSERT_EQUAL(cell.referenced_reads, 2u);
+        } else {
+            ASSERT_EQUAL(cell.position, "A2"_pos);
+            ASSERT_EQUAL(cell.expression, "A1+1");
+            ASSERT_EQUAL(cell.referenced_reads, 1u);
+        }
+    }
+
+    std::ostringstream report;
+    sheet->PrintProfile(report, 10);
+    ASSERT(report.str().find("A2+A1\n") != std::string::npos);
+}
+
+void TestRecalculationModes() {
+    auto sheet = CreateSheet();
+    auto value = [&](Position pos) {
+        return sheet->GetCell(pos)->GetValue();
+    };
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "=A1+1");
+    sheet->SetCell("A3"_pos, "=A2*A2");
+    ASSERT_EQUAL(value("A3"_pos), CellInterface::Value(4.0));
+
+    sheet->SetRecalculationMode(RecalculationMode::Manual);
+    sheet->SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(value("A3"_pos), CellInterface::Value(4.0));
+    sheet->SetCell("B1"_pos, "=A2");
+    ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(2.0));
+    sheet->Recalculate();
+    ASSERT_EQUAL(value("A3"_pos), CellInterface::Value(9.0));
+    ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(3.0));
+
+    sheet->SetRecalculationMode(RecalculationMode::EagerSync);
+    sheet->SetProfilingEnabled(true);
+    sheet->SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(sheet->GetProfile(10).size(), 3u);
+    sheet->SetProfilingEnabled(false);
+    ASSERT_EQUAL(value("A3"_pos), CellInterface::Value(16.0));
+
+    sheet->ClearCell("A1"_pos);
+    ASSERT_EQUAL(value("A3"_pos), CellInterface::Value(1.0));
+
+    sheet->SetRecalculationMode(RecalculationMode::EagerBackground);
+    for (int i = 1; i < 100; ++i) {
+        sheet->SetCell(Position{i, 3}, "=D" + std::to_string(i) + "+1");
+    }
+    sheet->SetCell("D1"_pos, "1");
+    ASSERT_EQUAL(value("D100"_pos), CellInterface::Value(100.0));
+    sheet->SetCell("D1"_pos, "=A3");
+    sheet->SetRecalculationMode(RecalculationMode::Lazy);
+    ASSERT_EQUAL(value("D100"_pos), CellInterface::Value(100.0));
+    sheet->SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(value("D100"_pos), CellInterface::Value(103.0));
+}
+
+void TestInsertDeleteRowsAndColumns() {
+    auto sheet = CreateSheet();
+    auto text = [&](Position pos) {
+        return sheet->GetCell(pos)->GetText();
+    };
+    auto value = [&](Position pos) {
+        return sheet->GetCell(pos)->GetValue();
+    };
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "2");
+    sheet->SetCell("B1"_pos, "=A1+A2");
+    sheet->SetCell("B3"_pos, "=B1*2");
+    ASSERT_EQUAL(value("B3"_pos), CellInterface::Value(6.0));
+
+    sheet->InsertRows(1, 2);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 2}));
+    ASSERT_EQUAL(text("A4"_pos), "2");
+    ASSERT_EQUAL(text("B1"_pos), "=A1+A4");
+    ASSERT_EQUAL(text("B5"_pos), "=B1*2");
+    ASSERT_EQUAL(sheet->GetCell("B5"_pos)->GetReferencedCells(), std::vector{"B1"_pos});
+    ASSERT(sheet->GetCell("A2"_pos) == nullptr);
+    sheet->SetCell("A4"_pos, "3");
+    ASSERT_EQUAL(value("B5"_pos), CellInterface::Value(8.0));
+
+    sheet->InsertColumns(0, 1);
+    ASSERT_EQUAL(text("C1"_pos), "=B1+B4");
+    ASSERT_EQUAL(text("C5"_pos), "=C1*2");
+    ASSERT_EQUAL(value("C5"_pos), CellInterface::Value(8.0));
+
+    sheet->DeleteColumns(0, 1);
+    sheet->DeleteRows(1, 2);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{3, 2}));
+    ASSERT_EQUAL(text("B1"_pos), "=A1+A2");
+    ASSERT_EQUAL(text("B3"_pos), "=B1*2");
+
+    sheet->DeleteRows(1, 1);
+    ASSERT_EQUAL(text("B1"_pos), "=A1+#REF!");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
+    ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT_EQUAL(value("B2"_pos), CellInterface::Value(FormulaError::Category::Ref));
+
+    std::ostringstream values;
+    sheet->PrintValues(values);
+    ASSERT_EQUAL(values.str(), "1\t#REF!\n\t#REF!\n");
+
+    sheet->DeleteColumns(0, 1);
+    ASSERT_EQUAL(text("A1"_pos), "=#REF!+#REF!");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 1}));
+
+    sheet->SetCell(Position{Position::MAX_ROWS - 1, 0}, "end");
+    try {
+        sheet->InsertRows(0, 1);
+        ASSERT(false);
+    } catch (const TableTooBigException&) {
+    }
+}
+
+void TestCopyRangeAndFillDown() {
+    auto sheet = CreateSheet();
+    auto text = [&](Position pos) {
+        return sheet->GetCell(pos)->GetText();
+    };
+    auto value = [&](Position pos) {
+        return sheet->GetCell(pos)->GetValue();
+    };
+    for (int i = 0; i < 5; ++i) {
+        sheet->SetCell(Position{i, 0}, std::to_string(i + 1));
+    }
+    sheet->SetCell("B1"_pos, "=A1*2");
+    sheet->SetCell("C1"_pos, "'=text");
+
+    sheet->FillDown(Range{"B1"_pos, {5, 2}});
+    ASSERT_EQUAL(text("B5"_pos), "=A5*2");
+    ASSERT_EQUAL(sheet->GetCell("B5"_pos)->GetReferencedCells(), std::vector{"A5"_pos});
+    ASSERT_EQUAL(value("B5"_pos), CellInterface::Value(10.0));
+    ASSERT_EQUAL(text("C5"_pos), "'=text");
+    sheet->SetCell("A5"_pos, "6");
+    ASSERT_EQUAL(value("B5"_pos), CellInterface::Value(12.0));
+
+    sheet->CopyRange(Range{"A1"_pos, {2, 2}}, "D7"_pos);
+    ASSERT_EQUAL(text("D7"_pos), "1");
+    ASSERT_EQUAL(text("E8"_pos), "=D8*2");
+    ASSERT_EQUAL(value("E8"_pos), CellInterface::Value(4.0));
+
+    // references that leave the table
+    sheet->CopyRange(Range{"B1"_pos, {1, 1}}, "A2"_pos);
+    ASSERT_EQUAL(text("A2"_pos), "=#REF!*2");
+    ASSERT_EQUAL(value("B2"_pos), CellInterface::Value(FormulaError::Category::Ref));
+
+    // overlapping ranges and empty source cells
+    sheet->CopyRange(Range{"D7"_pos, {3, 2}}, "D8"_pos);
+    ASSERT_EQUAL(text("D8"_pos), "1");
+    ASSERT_EQUAL(text("E9"_pos), "=D9*2");
+    ASSERT(sheet->GetCell("D10"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{9, 5}));
+
+    try {
+        sheet->CopyRange(Range{"A1"_pos, {2, 2}}, Position{Position::MAX_ROWS - 1, 0});
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+
+    // a paste that fails changes nothing
+    sheet->SetCell("M1"_pos, "=N1");
+    sheet->SetCell("M2"_pos, "4");
+    sheet->SetCell("O1"_pos, "=M2*10");
+    ASSERT_EQUAL(value("O1"_pos), CellInterface::Value(40.0));
+    sheet->SetCell("N3"_pos, "=M3");
+    try {
+        sheet->FillDown(Range{"M1"_pos, {4, 1}});
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(text("M2"_pos), "4");
+    ASSERT(sheet->GetCell("M3"_pos) == nullptr);
+    ASSERT_EQUAL(value("O1"_pos), CellInterface::Value(40.0));
+    // the last edit is still the one before the paste
+    ASSERT(sheet->Undo());
+    ASSERT(sheet->GetCell("N3"_pos) == nullptr);
+    ASSERT_EQUAL(text("M2"_pos), "4");
+}
+void TestWorkbook() {
+    auto workbook = CreateWorkbook(2);
+    auto* sales = workbook->AddSheet("Sales");
+    auto* report = workbook->AddSheet("Report");
+    auto value = [](SheetInterface* sheet, Position pos) {
+        return sheet->GetCell(pos)->GetValue();
+    };
+
+    sales->SetCell("A1"_pos, "10");
+    report->SetCell("A1"_pos, "=Sales!A1*2+Costs!B2");
+    ASSERT_EQUAL(report->GetCell("A1"_pos)->GetText(), "=Sales!A1*2+Costs!B2");
+    ASSERT(report->GetCell("A1"_pos)->GetReferencedCells().empty());
+    ASSERT_EQUAL(value(report, "A1"_pos), CellInterface::Value(FormulaError::Category::Ref));
+
+    auto* costs = workbook->AddSheet("Costs");
+    ASSERT_EQUAL(value(report, "A1"_pos), CellInterface::Value(20.0));
+    costs->SetCell("B2"_pos, "=Sales!A1");
+    sales->SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(value(report, "A1"_pos), CellInterface::Value(15.0));
+    ASSERT_EQUAL(workbook->GetSheetNames(), (std::vector<std::string>{"Costs", "Report", "Sales"}));
+
+    // cycles through other sheets
+    try {
+        sales->SetCell("A1"_pos, "=Report!A1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        sales->SetCell("B1"_pos, "=Sales!B1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        workbook->AddSheet("2nd");
+        ASSERT(false);
+    } catch (const std::invalid_argument&) {
+    }
+
+    // references follow inserted and deleted rows
+    sales->InsertRows(0, 2);
+    ASSERT_EQUAL(report->GetCell("A1"_pos)->GetText(), "=Sales!A3*2+Costs!B2");
+    ASSERT_EQUAL(costs->GetCell("B2"_pos)->GetText(), "=Sales!A3");
+    sales->DeleteRows(2, 1);
+    ASSERT_EQUAL(value(report, "A1"_pos), CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT_EQUAL(costs->GetCell("B2"_pos)->GetText(), "=#REF!");
+
+    // independent sheets are recalculated in parallel
+    std::vector<SheetInterface*> sheets;
+    for (int i = 0; i < 4; ++i) {
+        auto* sheet = workbook->AddSheet("Part" + std::to_string(i));
+        sheet->SetRecalculationMode(RecalculationMode::Manual);
+        sheet->SetCell("A1"_pos, "1");
+        for (int row = 1; row < 100; ++row) {
+            sheet->SetCell(Position{row, 0}, "=A" + std::to_string(row) + "+1");
+        }
+        sheets.push_back(sheet);
+    }
+    report->SetRecalculationMode(RecalculationMode::Manual);
+    report->SetCell("B1"_pos, "=Part0!A100+Part3!A100");
+    ASSERT_EQUAL(value(report, "B1"_pos), CellInterface::Value(200.0));
+    for (auto* sheet : sheets) {
+        sheet->SetCell("A1"_pos, "2");
+    }
+    ASSERT_EQUAL(value(report, "B1"_pos), CellInterface::Value(200.0));
+    workbook->Recalculate();
+    ASSERT_EQUAL(value(sheets[1], "A100"_pos), CellInterface::Value(101.0));
+    ASSERT_EQUAL(value(report, "B1"_pos), CellInterface::Value(202.0));
+
+    // sheets recalculated in parallel read a profiled sheet, the reads of
+    // their formulas are not accounted to its cells
+    sheets[1]->SetCell("B1"_pos, "=Part0!A100");
+    sheets[2]->SetCell("B1"_pos, "=Part0!A100");
+    sheets[0]->SetProfilingEnabled(true);
+    sheets[0]->SetCell("A1"_pos, "3");
+    workbook->Recalculate();
+    ASSERT_EQUAL(value(sheets[2], "B1"_pos), CellInterface::Value(102.0));
+    sheets[0]->SetProfilingEnabled(false);
+    auto profile = sheets[0]->GetProfile(200);
+    ASSERT_EQUAL(profile.size(), 99u);
+    for (const CellProfile& cell : profile) {
+        ASSERT_EQUAL(cell.referenced_reads, 1u);
+    }
+}
+void TestUndoRedo() {
+    auto sheet = CreateSheet();
+    auto texts = [&] {
+        std::ostringstream out;
+        sheet->PrintTexts(out);
+        return out.str();
+    };
+    auto value = [&](Position pos) {
+        return sheet->GetCell(pos)->GetValue();
+    };
+    ASSERT(!sheet->Undo());
+
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "=A1+1");
+    sheet->SetCell("A3"_pos, "=A2*10");
+    std::string initial = texts();
+    sheet->SetCell("A1"_pos, "5");
+    sheet->ClearCell("A2"_pos);
+    ASSERT_EQUAL(value("A3"_pos), CellInterface::Value(0.0));
+
+    ASSERT(sheet->Undo());
+    ASSERT_EQUAL(value("A3"_pos), CellInterface::Value(60.0));
+    ASSERT(sheet->Undo());
+    ASSERT_EQUAL(texts(), initial);
+    ASSERT_EQUAL(value("A3"_pos), CellInterface::Value(20.0));
+    ASSERT(sheet->Redo());
+    ASSERT_EQUAL(value("A3"_pos), CellInterface::Value(60.0));
+
+    // a failed edit is not recorded, a new edit discards the redo stack
+    try {
+        sheet->SetCell("A1"_pos, "=A3");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    sheet->SetCell("B1"_pos, "x");
+    ASSERT(!sheet->Redo());
+
+    // a copy is undone as one edit
+    sheet->FillDown(Range{"A2"_pos, {3, 1}});
+    ASSERT_EQUAL(sheet->GetCell("A4"_pos)->GetText(), "=A3+1");
+    ASSERT(sheet->Undo());
+    ASSERT_EQUAL(sheet->GetCell("A4"_pos), nullptr);
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetText(), "=A2*10");
+
+    // deleted cells and references to them come back
+    std::string before_delete = texts();
+    sheet->DeleteRows(1, 1);
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetText(), "=#REF!*10");
+    ASSERT(sheet->Undo());
+    ASSERT_EQUAL(texts(), before_delete);
+    ASSERT_EQUAL(value("A3"_pos), CellInterface::Value(60.0));
+    sheet->SetCell("A1"_pos, "7");
+    ASSERT_EQUAL(value("A3"_pos), CellInterface::Value(80.0));
+    ASSERT(sheet->Undo());
+    ASSERT(sheet->Redo());
+    ASSERT(sheet->Undo());
+    ASSERT(sheet->Redo());
+    ASSERT_EQUAL(value("A3"_pos), CellInterface::Value(80.0));
+    sheet->InsertColumns(0, 2);
+    ASSERT_EQUAL(sheet->GetCell("C3"_pos)->GetText(), "=C2*10");
+    ASSERT(sheet->Undo());
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetText(), "=A2*10");
+
+    // the oldest edits are forgotten first
+    sheet->SetUndoMemoryLimit(1024);
+    for (int i = 0; i < 100; ++i) {
+        sheet->SetCell("C1"_pos, std::to_string(i));
+    }
+    int undone = 0;
+    while (sheet->Undo()) {
+        ++undone;
+    }
+    ASSERT(undone > 0 && undone < 100);
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetText(), std::to_string(99 - undone));
+    sheet->SetUndoMemoryLimit(0);
+    sheet->SetCell("C1"_pos, "off");
+    ASSERT(!sheet->Undo());
+}
+void TestLazyFormulaCompilation() {
+    // the syntax check of a lazy formula accepts the same formulas as the parser
+    for (std::string expression : {"1+2*3", "-(+A1)/ .5e-3", "((B2))", "Sheet_2!C3*2", "1.5E+2-ZZ10",
+                                   "", "1+", "(1", "1)", "()", "A1B2", "a1", "1.", "1e", "A0", "1e999",
+                                   "Sheet!", "1 2", "*1", "A1!", "X!1"}) {
+        bool parsed = true;
+        try {
+            ParseFormula(expression);
+        } catch (const FormulaException&) {
+            parsed = false;
+        }
+        bool scanned = true;
+        try {
+            ParseFormulaLazily(expression);
+        } catch (const FormulaException&) {
+            scanned = false;
+        }
+        ASSERT_EQUAL(scanned, parsed);
+    }
+    auto formula = ParseFormulaLazily("B2+A1*B2+Other!A1");
+    ASSERT_EQUAL(formula->GetReferencedCells(), (std::vector{"A1"_pos, "B2"_pos}));
+    ASSERT_EQUAL(formula->GetExternalCells().size(), 1u);
+
+    auto sheet = CreateSheet();
+    sheet->SetLazyFormulaCompilation(true);
+    sheet->SetCell("A1"_pos, "=1 + 2");
+    sheet->SetCell("A2"_pos, "=A1*(2)");
+    try {
+        sheet->SetCell("A1"_pos, "=A2");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        sheet->SetCell("A3"_pos, "=A1+");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "=1+2");
+    sheet->SetCell("A1"_pos, "=4");
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(), CellInterface::Value(8.0));
+    sheet->SetCell("B1"_pos, "=A2");
+    sheet->InsertRows(0, 1);
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetText(), "=A3");
+
+    // readers print formulas the recalculation thread is compiling
+    auto background = CreateSheet();
+    background->SetLazyFormulaCompilation(true);
+    background->SetRecalculationMode(RecalculationMode::EagerBackground);
+    background->SetCell("A1"_pos, "1");
+    for (int row = 1; row < 500; ++row) {
+        background->SetCell({row, 0}, "=A" + std::to_string(row) + "+1");
+    }
+    for (int row = 1; row < 500; ++row) {
+        ASSERT_EQUAL(background->GetCell({row, 0})->GetText(), "=A" + std::to_string(row) + "+1");
+    }
+    ASSERT_EQUAL(background->GetCell("A500"_pos)->GetValue(), CellInterface::Value(500.0));
+}
+void TestRowBatchEvaluation() {
+    auto formula = ParseFormula("A1/(A1-5)*-B1");
+    ASSERT(ParseFormula("A3/(A3-5)*-B3")->IsShiftedCopyOf(*formula, 2, 0));
+    ASSERT(!ParseFormula("A3/(A3-5)*-B2")->IsShiftedCopyOf(*formula, 2, 0));
+    ASSERT(!ParseFormula("A3/(A3-5)*+B3")->IsShiftedCopyOf(*formula, 2, 0));
+
+    auto sheet = CreateSheet();
+    sheet->SetRecalculationMode(RecalculationMode::Manual);
+    for (int i = 0; i < 20; ++i) {
+        sheet->SetCell(Position{i, 0}, std::to_string(i));
+    }
+    sheet->SetCell("A8"_pos, "x");
+    sheet->SetCell("B1"_pos, "=A1/(A1-5)");
+    sheet->FillDown({"B1"_pos, {20, 1}});
+    sheet->SetCell("C1"_pos, "=B1");
+    sheet->SetCell("C2"_pos, "=C1+B2");
+    sheet->FillDown({"C2"_pos, {19, 1}});
+    sheet->Recalculate();
+
+    auto rows = formula->EvaluateRows(*sheet, 10);
+    ASSERT_EQUAL(rows.size(), 10u);
+    for (int i = 0; i < 10; ++i) {
+        ASSERT(rows[i] == formula->Clone(i, 0)->Evaluate(*sheet));
+    }
+
+    for (int i = 0; i < 20; ++i) {
+        auto value = sheet->GetCell(Position{i, 1})->GetValue();
+        if (i == 5) {
+            ASSERT_EQUAL(value, CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+        } else if (i == 7) {
+            ASSERT_EQUAL(value, CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+        } else {
+            ASSERT_EQUAL(value, CellInterface::Value(i / (i - 5.0)));
+        }
+    }
+    ASSERT_EQUAL(sheet->GetCell("C5"_pos)->GetValue(), CellInterface::Value(-0.25 - 2.0 / 3 - 1.5 - 4.0));
+    ASSERT_EQUAL(sheet->GetCell("C20"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+
+    sheet->SetCell("A6"_pos, "4");
+    sheet->SetCell("A8"_pos, "7");
+    sheet->Recalculate();
+    ASSERT_EQUAL(sheet->GetCell("B6"_pos)->GetValue(), CellInterface::Value(-4.0));
+    ASSERT_EQUAL(sheet->GetCell("B8"_pos)->GetValue(), CellInterface::Value(3.5));
+    double total = 0;
+    for (int i = 0; i < 20; ++i) {
+        total += std::get<double>(sheet->GetCell(Position{i, 1})->GetValue());
+    }
+    ASSERT_EQUAL(sheet->GetCell("C20"_pos)->GetValue(), CellInterface::Value(total));
+
+    // not finite operands give the same results in a batch as one by one
+    auto special = CreateSheet();
+    std::vector<std::pair<std::string, std::string>> operands{
+        {"nan", "1"}, {"inf", "1"}, {"-inf", "0"}, {"2", "0"}, {"0", "0"}, {"nan", "0"}, {"inf", "inf"}, {"3", "nan"}};
+    for (int i = 0; i < static_cast<int>(operands.size()); ++i) {
+        special->SetCell(Position{i, 0}, operands[i].first);
+        special->SetCell(Position{i, 1}, operands[i].second);
+    }
+    auto same = [](const FormulaInterface::Value& lhs, const FormulaInterface::Value& rhs) {
+        if (std::holds_alternative<double>(lhs) && std::holds_alternative<double>(rhs)
+            && std::isnan(std::get<double>(lhs)) && std::isnan(std::get<double>(rhs))) {
+            return true;
+        }
+        return lhs == rhs;
+    };
+    for (const char* text : {"A1+B1", "A1-B1", "A1*B1", "A1/B1", "-A1/B1"}) {
+        auto batched = ParseFormula(text);
+        auto rows = batched->EvaluateRows(*special, operands.size());
+        for (size_t i = 0; i < operands.size(); ++i) {
+            ASSERT(same(rows[i], batched->Clone(static_cast<int>(i), 0)->Evaluate(*special)));
+        }
+    }
+    ASSERT(std::isnan(std::get<double>(ParseFormula("A1+B1")->EvaluateRows(*special, 1)[0])));
+}
+void TestOccupancyIndex() {
+    OccupancyIndex index;
+    ASSERT_EQUAL(index.GetBoundingSize(), (Size{0, 0}));
+    std::vector<Position> cells{"B2"_pos, "BM2"_pos, "A70"_pos, "XFD16384"_pos, "C200"_pos, "CC200"_pos};
+    for (Position pos : cells) {
+        ASSERT(index.Insert(pos));
+    }
+    ASSERT(!index.Insert("B2"_pos));
+    ASSERT_EQUAL(index.GetCount(), cells.size());
+    ASSERT_EQUAL(index.GetBoundingSize(), (Size{Position::MAX_ROWS, Position::MAX_COLS}));
+
+    std::vector<Position> visited;
+    index.ForEach({{0, 0}, {Position::MAX_ROWS, Position::MAX_COLS}}, [&](Position pos) {
+        visited.push_back(pos);
+    });
+    std::sort(cells.begin(), cells.end());
+    ASSERT_EQUAL(visited, cells);
+    visited.clear();
+    index.ForEach({"B2"_pos, {199, 64}}, [&](Position pos) {
+        visited.push_back(pos);
+    });
+    ASSERT_EQUAL(visited, (std::vector{"B2"_pos, "BM2"_pos, "C200"_pos}));
+
+    ASSERT(index.Erase("XFD16384"_pos));
+    ASSERT(!index.Erase("XFD16384"_pos));
+    ASSERT_EQUAL(index.GetBoundingSize(), (Size{200, 81}));
+    ASSERT(index.Erase("CC200"_pos));
+    ASSERT(index.Erase("C200"_pos));
+    ASSERT_EQUAL(index.GetBoundingSize(), (Size{70, 65}));
+    ASSERT(index.Contains("A70"_pos) && !index.Contains("A69"_pos));
+
+    // only the cells from the first changed line on move
+    index.HandleStructuralChange({StructuralChange::Type::InsertRows, 2, 100});
+    ASSERT(index.Contains("B2"_pos) && index.Contains("BM2"_pos) && index.Contains("A170"_pos));
+    ASSERT_EQUAL(index.GetBoundingSize(), (Size{170, 65}));
+    index.HandleStructuralChange({StructuralChange::Type::DeleteColumns, 1, 2});
+    ASSERT(index.Contains("BK2"_pos) && !index.Contains("B2"_pos) && index.Contains("A170"_pos));
+    ASSERT_EQUAL(index.GetCount(), 2u);
+    ASSERT_EQUAL(index.GetBoundingSize(), (Size{170, 63}));
+
+    auto sheet = CreateSheet();
+    sheet->SetCell("C3"_pos, "x");
+    sheet->SetCell("C3"_pos, "y");
+    sheet->SetCell("A1"_pos, "=C3");
+    sheet->SetCell("ZZ5000"_pos, "far");
+    sheet->ClearCell("ZZ5000"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{3, 3}));
+    std::ostringstream texts;
+    sheet->PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "=C3\t\t\n\t\t\n\t\ty\n");
+    // the formula refers to the cleared cell through a placeholder
+    sheet->ClearCell("C3"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+    sheet->ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+}
+void TestViewport() {
+    auto sheet = CreateSheet();
+    for (int i = 0; i < 1000; ++i) {
+        sheet->SetCell(Position{i, 0}, std::to_string(i));
+        sheet->SetCell(Position{i, 1}, "=A" + std::to_string(i + 1) + "*2");
+    }
+    sheet->SetCell("D501"_pos, "=B501+B1000");
+    sheet->SetCell("C502"_pos, "text");
+    sheet->SetProfilingEnabled(true);
+
+    Range viewport{"B500"_pos, {3, 3}};
+    std::vector<CellInterface::Value> values(9);
+    sheet->GetValues(viewport, values.data());
+    ASSERT_EQUAL(values, (std::vector<CellInterface::Value>{998.0, "", "", 1000.0, "", 2998.0, 1002.0, "text", ""}));
+    std::set<Position> evaluated;
+    for (const CellProfile& profile : sheet->GetProfile(100)) {
+        evaluated.insert(profile.position);
+    }
+    ASSERT_EQUAL(evaluated, (std::set{"B500"_pos, "B501"_pos, "D501"_pos, "B502"_pos, "B1000"_pos}));
+
+    std::ostringstream output;
+    sheet->PrintValues(output, viewport);
+    ASSERT_EQUAL(output.str(), "998\t\t\n1000\t\t2998\n1002\ttext\t\n");
+    try {
+        sheet->GetValues({"A1"_pos, {0, 1}}, values.data());
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+}
+void TestChangeTracking() {
+    auto sheet = CreateSheet();
+    sheet->SetChangeTracking(true);
+    sheet->SetCell("A1"_pos, "5");
+    sheet->SetCell("B1"_pos, "=A1*2");
+    sheet->SetCell("C1"_pos, "=B1-B1");
+    sheet->SetCell("D1"_pos, "text");
+    ASSERT_EQUAL(sheet->TakeChangedCells(), (std::vector{"A1"_pos, "B1"_pos, "C1"_pos, "D1"_pos}));
+    ASSERT(sheet->TakeChangedCells().empty());
+
+    // the text changes but the formula referring to it calculates the same value
+    sheet->SetCell("A1"_pos, "5.0");
+    ASSERT_EQUAL(sheet->TakeChangedCells(), std::vector{"A1"_pos});
+    sheet->SetCell("D1"_pos, "text");
+    ASSERT(sheet->TakeChangedCells().empty());
+    // the edit does not evaluate the formulas, taking the changes does
+    sheet->SetProfilingEnabled(true);
+    sheet->SetCell("A1"_pos, "6");
+    ASSERT(sheet->GetProfile(10).empty());
+    ASSERT_EQUAL(sheet->TakeChangedCells(), (std::vector{"A1"_pos, "B1"_pos}));
+    ASSERT_EQUAL(sheet->GetProfile(10).size(), 2u);
+    sheet->SetProfilingEnabled(false);
+
+    std::vector<std::vector<Position>> reports;
+    sheet->SetChangeTracking(true, [&reports](const std::vector<Position>& changed) {
+        reports.push_back(changed);
+    });
+    sheet->CopyRange({"A1"_pos, {1, 2}}, "A2"_pos);
+    sheet->ClearCell("D1"_pos);
+    // the lazy mode does not evaluate the new formula until it is read
+    ASSERT_EQUAL(reports, (std::vector<std::vector<Position>>{{"A2"_pos}, {"D1"_pos}}));
+    sheet->Recalculate();
+    ASSERT_EQUAL(reports.back(), std::vector{"B2"_pos});
+    ASSERT(sheet->TakeChangedCells().empty());
+
+    // the eager mode reports dependent cells with the edit
+    reports.clear();
+    sheet->SetRecalculationMode(RecalculationMode::EagerSync);
+    sheet->SetCell("A2"_pos, "1");
+    ASSERT_EQUAL(reports, (std::vector<std::vector<Position>>{{"A2"_pos, "B2"_pos}}));
+
+    // in the manual mode dependent cells change on recalculation
+    reports.clear();
+    sheet->SetRecalculationMode(RecalculationMode::Manual);
+    sheet->SetCell("A1"_pos, "7");
+    sheet->Recalculate();
+    ASSERT_EQUAL(reports, (std::vector<std::vector<Position>>{{"A1"_pos}, {"B1"_pos}}));
+
+    sheet->SetChangeTracking(false);
+    sheet->SetCell("A1"_pos, "8");
+    sheet->Recalculate();
+    ASSERT_EQUAL(reports.size(), 2u);
+}
+void TestEarlyCutoff() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "5");
+    sheet->SetCell("A2"_pos, "1");
+    sheet->SetCell("B1"_pos, "=A1*2");
+    sheet->SetCell("C1"_pos, "=B1+1");
+    sheet->SetCell("D1"_pos, "=C1*3+A2");
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(34.0));
+
+    auto evaluated_cells = [&sheet] {
+        std::map<Position, size_t> result;
+        for (const CellProfile& profile : sheet->GetProfile(100)) {
+            result[profile.position] = profile.evaluations;
+        }
+        return result;
+    };
+    sheet->SetProfilingEnabled(true);
+    // B1 calculates the same value, so C1 and D1 keep theirs
+    sheet->SetCell("A1"_pos, "5.0");
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(34.0));
+    ASSERT_EQUAL(evaluated_cells(), (std::map<Position, size_t>{{"B1"_pos, 1}}));
+
+    // a cell that changed is recalculated even if others did not
+    sheet->SetCell("A2"_pos, "2");
+    sheet->SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(35.0));
+    ASSERT_EQUAL(evaluated_cells(), (std::map<Position, size_t>{{"B1"_pos, 2}, {"D1"_pos, 1}}));
+
+    sheet->SetRecalculationMode(RecalculationMode::EagerSync);
+    sheet->SetCell("A1"_pos, "6");
+    ASSERT_EQUAL(evaluated_cells(), (std::map<Position, size_t>{{"B1"_pos, 3}, {"C1"_pos, 1}, {"D1"_pos, 2}}));
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(41.0));
+    sheet->SetCell("A1"_pos, "=3*2");
+    ASSERT_EQUAL(evaluated_cells(), (std::map<Position, size_t>{{"A1"_pos, 1}, {"B1"_pos, 4}, {"C1"_pos, 1},
+                                                                {"D1"_pos, 2}}));
+}
+void TestTileCompression() {
+    auto sheet = CreateSheet();
+    const std::vector<std::string> texts = {"north", "south", "0.1", "-3.5", "5.0", "1e+300", "'=A1", "=", "x"};
+    for (int i = 0; i < 200; ++i) {
+        sheet->SetCell(Position{i, 0}, std::to_string(i * 10));
+        sheet->SetCell(Position{i, 1}, texts[i % texts.size()]);
+        sheet->SetCell(Position{i, 70}, std::to_string(i % 3));
+    }
+    // a formula and the cell it refers to in another tile
+    sheet->SetCell("A300"_pos, "=BS1+1");
+    std::ostringstream texts_before;
+    std::ostringstream values_before;
+    sheet->PrintTexts(texts_before);
+    sheet->PrintValues(values_before);
+    MemoryUsage usage = sheet->GetMemoryUsage();
+
+    sheet->SetTileCompression(std::chrono::milliseconds(0));
+    sheet->CompressColdTiles();
+    MemoryUsage compressed = sheet->GetMemoryUsage();
+    ASSERT(compressed.compressed_tiles > 0);
+    // the grid of pointers stays as it was
+    ASSERT((compressed.GetTotal() - compressed.grid) * 5 < usage.GetTotal() - usage.grid);
+    std::ostringstream texts_after;
+    std::ostringstream values_after;
+    sheet->PrintTexts(texts_after);
+    sheet->PrintValues(values_after);
+    ASSERT_EQUAL(texts_after.str(), texts_before.str());
+    ASSERT_EQUAL(values_after.str(), values_before.str());
+    std::vector<CellInterface::Value> values(2);
+    sheet->GetValues({"B7"_pos, {2, 1}}, values.data());
+    ASSERT_EQUAL(values, (std::vector<CellInterface::Value>{"=A1", "="}));
+
+    // reading a cell expands its tile
+    ASSERT_EQUAL(sheet->GetCell("B6"_pos)->GetText(), "1e+300");
+    ASSERT(sheet->GetMemoryUsage().compressed_tiles < compressed.compressed_tiles);
+    sheet->SetCell("A150"_pos, "changed");
+    ASSERT_EQUAL(sheet->GetCell("A150"_pos)->GetValue(), CellInterface::Value("changed"));
+    ASSERT_EQUAL(sheet->GetCell("BS1"_pos)->GetText(), "0");
+    ASSERT_EQUAL(sheet->GetCell("A300"_pos)->GetValue(), CellInterface::Value(1.0));
+
+    // tiles are compressed after edits while the memory exceeds the limit
+    size_t compressed_tiles = sheet->GetMemoryUsage().compressed_tiles;
+    sheet->SetTileCompression(std::chrono::hours(1), compressed.GetTotal() / 2);
+    sheet->SetCell("C1"_pos, "edit");
+    ASSERT(sheet->GetMemoryUsage().compressed_tiles > compressed_tiles);
+
+    sheet->InsertRows(0, 1);
+    ASSERT_EQUAL(sheet->GetCell("A151"_pos)->GetText(), "changed");
+    ASSERT_EQUAL(sheet->GetCell("B5"_pos)->GetText(), "-3.5");
+    ASSERT_EQUAL(sheet->GetCell("A301"_pos)->GetText(), "=BS2+1");
+
+    // concurrent readers expand the same tiles
+    sheet->SetTileCompression(std::chrono::milliseconds(0));
+    sheet->CompressColdTiles();
+    std::ostringstream all_values;
+    sheet->PrintValues(all_values);
+    const SheetInterface& compressed_sheet = *sheet;
+    std::vector<std::thread> readers;
+    for (int reader = 0; reader < 3; ++reader) {
+        readers.emplace_back([&compressed_sheet, &all_values, reader] {
+            if (reader == 0) {
+                std::ostringstream values;
+                compressed_sheet.PrintValues(values);
+                ASSERT_EQUAL(values.str(), all_values.str());
+                return;
+            }
+            for (int row = 1; row < 150; ++row) {
+                ASSERT_EQUAL(compressed_sheet.GetCell(Position{row, 0})->GetText(), std::to_string((row - 1) * 10));
+            }
+        });
+    }
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+
+    // inserted and deleted lines expand only the tiles they move
+    sheet->CompressColdTiles();
+    sheet->SetTileCompression(std::chrono::hours(1));
+    size_t all_tiles = sheet->GetMemoryUsage().compressed_tiles;
+    sheet->InsertRows(200, 2);
+    size_t upper_tiles = sheet->GetMemoryUsage().compressed_tiles;
+    ASSERT(upper_tiles > 0 && upper_tiles < all_tiles);
+    sheet->DeleteColumns(69, 1);
+    size_t left_tiles = sheet->GetMemoryUsage().compressed_tiles;
+    ASSERT(left_tiles > 0 && left_tiles < upper_tiles);
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetText(), "north");
+    ASSERT_EQUAL(sheet->GetCell("BR3"_pos)->GetText(), "1");
+    ASSERT_EQUAL(sheet->GetCell("A203"_pos)->GetText(), "1990");
+    ASSERT_EQUAL(sheet->GetCell("A303"_pos)->GetText(), "=BR2+1");
+
+    // tiles of formulas without values are not checked on every edit while
+    // nothing can be compressed, a tile of texts still is compressed later
+    auto formulas = CreateSheet();
+    formulas->SetTileCompression(std::chrono::hours(1), 1);
+    for (int row = 0; row < 500; ++row) {
+        formulas->SetCell(Position{row, 0}, "=B" + std::to_string(row + 1) + "+1");
+    }
+    ASSERT_EQUAL(formulas->GetMemoryUsage().compressed_tiles, 0u);
+    for (int row = 0; row < 2000 && formulas->GetMemoryUsage().compressed_tiles == 0; ++row) {
+        formulas->SetCell(Position{row, 200}, "text");
+    }
+    ASSERT(formulas->GetMemoryUsage().compressed_tiles > 0);
+    ASSERT_EQUAL(formulas->GetCell("A500"_pos)->GetValue(), CellInterface::Value(1.0));
+}
+void TestPageFile() {
+    auto sheet = CreateSheet();
+    // a column of 16 tiles
+    for (int row = 0; row < 16 * 64; ++row) {
+        sheet->SetCell(Position{row, row % 3}, std::to_string(row * 10));
+    }
+    sheet->SetCell("E1"_pos, "=A1+1");
+    // a formula in each tile reads a cell of the tile below
+    for (int row = 0; row < 15 * 64; row += 64) {
+        sheet->SetCell(Position{row, 3}, "=" + Position{row + 64, (row + 64) % 3}.ToString() + "+1");
+    }
+    std::ostringstream texts_before;
+    sheet->PrintTexts(texts_before);
+    std::ostringstream values_before;
+    sheet->PrintValues(values_before);
+    DependencyAnalysis analysis = sheet->AnalyzeDependencies(3);
+    size_t grid = sheet->GetMemoryUsage().grid;
+    sheet->SetTileCompression(std::chrono::milliseconds(0));
+    sheet->CompressColdTiles();
+    size_t compressed_tiles = sheet->GetMemoryUsage().compressed_tiles;
+    // the rows of the compressed tiles no longer hold places for the cells
+    ASSERT(sheet->GetMemoryUsage().grid * 4 < grid * 3);
+
+    const std::string path = (std::filesystem::temp_directory_path()
+        / ("spreadsheet_test_" + std::to_string(std::random_device{}()) + ".pages")).string();
+    sheet->SetPageFile(path, compressed_tiles / 8);
+    ASSERT(std::filesystem::file_size(path) > 0);
+    ASSERT(sheet->GetMemoryUsage().compressed_tiles * 4 < compressed_tiles);
+    std::ostringstream texts_after;
+    sheet->PrintTexts(texts_after);
+    ASSERT_EQUAL(texts_after.str(), texts_before.str());
+    ASSERT(sheet->GetMemoryUsage().compressed_tiles * 4 < compressed_tiles);
+
+    // formulas are paged with their values, which are printed as they are
+    ASSERT_EQUAL(sheet->GetMemoryUsage().formulas, 0u);
+    std::ostringstream values_after;
+    sheet->PrintValues(values_after);
+    ASSERT_EQUAL(values_after.str(), values_before.str());
+    ASSERT_EQUAL(sheet->GetMemoryUsage().formulas, 0u);
+    // the analysis expands the tiles of linked cells
+    DependencyAnalysis paged_analysis = sheet->AnalyzeDependencies(3);
+    ASSERT_EQUAL(paged_analysis.longest_chain, analysis.longest_chain);
+    ASSERT_EQUAL(paged_analysis.fan_in, analysis.fan_in);
+    ASSERT_EQUAL(paged_analysis.fan_out, analysis.fan_out);
+    ASSERT_EQUAL(paged_analysis.levels, analysis.levels);
+    sheet->CompressColdTiles();
+    ASSERT_EQUAL(sheet->GetMemoryUsage().formulas, 0u);
+
+    // an expanded formula and the cells it reads are linked again
+    ASSERT_EQUAL(sheet->GetCell("D65"_pos)->GetValue(), CellInterface::Value(1281.0));
+    sheet->SetCell("C129"_pos, "5");
+    ASSERT_EQUAL(sheet->GetCell("D65"_pos)->GetValue(), CellInterface::Value(6.0));
+    sheet->SetCell("B257"_pos, "7");
+    ASSERT_EQUAL(sheet->GetCell("D193"_pos)->GetValue(), CellInterface::Value(8.0));
+    // a compressed formula above inserted rows refers to the moved cell
+    sheet->InsertRows(448, 1);
+    ASSERT_EQUAL(sheet->GetCell("D385"_pos)->GetText(), "=B450+1");
+    ASSERT_EQUAL(sheet->GetCell("D385"_pos)->GetValue(), CellInterface::Value(4481.0));
+    sheet->CompressColdTiles();
+    sheet->DeleteRows(448, 1);
+    ASSERT_EQUAL(sheet->GetCell("D385"_pos)->GetText(), "=B449+1");
+
+    // cells are read through the same interface
+    ASSERT_EQUAL(sheet->GetCell(Position{700, 1})->GetText(), "7000");
+    ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(1.0));
+    sheet->SetCell(Position{900, 0}, "=B800+1");
+    ASSERT_EQUAL(sheet->GetCell(Position{900, 0})->GetValue(), CellInterface::Value(7991.0));
+    std::vector<CellInterface::Value> values(3);
+    sheet->GetValues({Position{300, 0}, {1, 3}}, values.data());
+    ASSERT_EQUAL(values, (std::vector<CellInterface::Value>{"3000", "", ""}));
+
+    std::ostringstream texts_paged;
+    sheet->PrintTexts(texts_paged);
+    sheet->SetPageFile("", 0);
+    ASSERT(!std::filesystem::exists(path));
+    std::ostringstream texts_in_memory;
+    sheet->PrintTexts(texts_in_memory);
+    ASSERT_EQUAL(texts_in_memory.str(), texts_paged.str());
+    ASSERT_EQUAL(sheet->GetCell(Position{1000, 1})->GetText(), "10000");
+
+    try {
+        sheet->SetPageFile((std::filesystem::temp_directory_path() / "missing" / "sheet.pages").string(), 0);
+        ASSERT(false);
+    } catch (const PageFileException&) {
+    }
+
+    // a formula that its text does not give back keeps the tile as it is
+    auto precise = CreateSheet();
+    precise->SetCell("A1"_pos, "=B1*0.123456789");
+    ASSERT_EQUAL(precise->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+    precise->SetTileCompression(std::chrono::milliseconds(0));
+    precise->CompressColdTiles();
+    ASSERT_EQUAL(precise->GetMemoryUsage().compressed_tiles, 0u);
+}
+void TestWhatIf() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+    sheet->SetCell("A2"_pos, "100");
+    sheet->SetCell("B1"_pos, "=A1*A2");
+    sheet->SetCell("C1"_pos, "=A2/4");
+    sheet->SetCell("B2"_pos, "=B1+C1");
+    sheet->SetCell("D1"_pos, "text");
+    sheet->SetCell("B3"_pos, "=B2+D1");
+    sheet->SetCell("E1"_pos, "=A1*A1");
+    std::ostringstream values_before;
+    sheet->PrintValues(values_before);
+
+    std::vector<std::vector<double>> values;
+    for (int i = 0; i < 1000; ++i) {
+        values.push_back({static_cast<double>(i)});
+    }
+    auto result = sheet->Sweep({"A1"_pos}, values, {"B2"_pos, "C1"_pos, "A1"_pos, "B3"_pos});
+    ASSERT_EQUAL(result.size(), values.size());
+    for (int i = 0; i < 1000; ++i) {
+        ASSERT_EQUAL(result[i], (std::vector<CellInterface::Value>{i * 100.0 + 25, 25.0, static_cast<double>(i),
+                                                                    FormulaError(FormulaError::Category::Value)}));
+    }
+    result = sheet->Sweep({"A1"_pos, "A2"_pos}, {{1, 4}, {3, 8}}, {"B2"_pos});
+    ASSERT_EQUAL(result, (std::vector<std::vector<CellInterface::Value>>{{5.0}, {26.0}}));
+
+    auto input = sheet->GoalSeek("A1"_pos, "B2"_pos, 525);
+    ASSERT(input && std::abs(*input - 5) < 1e-6);
+    input = sheet->GoalSeek("A1"_pos, "E1"_pos, 2);
+    ASSERT(input && std::abs(*input - std::sqrt(2.0)) < 1e-6);
+    ASSERT(!sheet->GoalSeek("A1"_pos, "D1"_pos, 1));
+    try {
+        sheet->Sweep({"A1"_pos}, {{1, 2}}, {"B2"_pos});
+        ASSERT(false);
+    } catch (const std::invalid_argument&) {
+    }
+
+    // the sheet does not change
+    std::ostringstream values_after;
+    sheet->PrintValues(values_after);
+    ASSERT_EQUAL(values_after.str(), values_before.str());
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(225.0));
+
+    // cells of other sheets are read as they are
+    auto workbook = CreateWorkbook(2);
+    SheetInterface* rates = workbook->AddSheet("Rates");
+    SheetInterface* loans = workbook->AddSheet("Loans");
+    rates->SetCell("A1"_pos, "0.5");
+    loans->SetCell("B1"_pos, "=A1*Rates!A1");
+    result = loans->Sweep({"A1"_pos}, {{10}, {20}, {30}}, {"B1"_pos});
+    ASSERT_EQUAL(result, (std::vector<std::vector<CellInterface::Value>>{{5.0}, {10.0}, {15.0}}));
+}
+void TestServer() {
+    SpreadsheetServer server(1);
+    const char commands[] =
+        "set A1 2\n"
+        "set B1 =A1*3\n"
+        "get B1\n"
+        "batch 2\n"
+        "set A1 5\n"
+        "get B1\n"
+        "set Rates!A1 =Sheet1!B1+1\n"
+        "range Rates!A1:B2\n"
+        "print\n"
+        "get Missing!A1\n"
+        "set A1 =A1\n"
+        "unknown\n"
+        "binary\n"
+        "\x06\0\0\0get A1"
+        "\x08\0\0\0clear A1"
+        "\x04\0\0\0quit"
+        "\x06\0\0\0get A1";
+    const char responses[] =
+        "ok\n"
+        "ok\n"
+        "ok 6\n"
+        "ok\n"
+        "ok 15\n"
+        "ok\n"
+        "ok 2\n16\t\n\t\n"
+        "ok 1\n5\t15\n"
+        "error no sheet Missing\n"
+        "error incorrect formula. Causes circular dependencies\n"
+        "error unknown command unknown\n"
+        "ok\n"
+        "\x04\0\0\0ok 5"
+        "\x02\0\0\0ok";
+    // the frames hold zero bytes
+    std::istringstream input(std::string(commands, sizeof(commands) - 1));
+    std::ostringstream output;
+    server.Serve(input, output);
+    ASSERT_EQUAL(output.str(), std::string(responses, sizeof(responses) - 1));
+    ASSERT_EQUAL(server.Execute("get A1"), "ok ");
+
+    // a frame over the limit ends the connection without reading it
+    const char oversized[] =
+        "binary\n"
+        "\xff\xff\xff\xffset A1 1"
+        "\x06\0\0\0get A1";
+    const std::string refused = "error frame of 4294967295 bytes is too large";
+    input.clear();
+    input.str(std::string(oversized, sizeof(oversized) - 1));
+    output.str("");
+    server.Serve(input, output);
+    ASSERT_EQUAL(output.str(), std::string("ok\n") + static_cast<char>(refused.size()) + std::string(3, '\0') + refused);
+    ASSERT_EQUAL(server.Execute("get A1"), "ok ");
+
+    // a range over the limit is refused before its values are read
+    ASSERT_EQUAL(server.Execute("range A1:BM16384"), "error range of 1064960 cells is too large");
+    ASSERT_EQUAL(server.Execute("range A1:A2"), "ok 2\n\n");
+}
+void TestSubexpressionSharing() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+    sheet->SetCell("B1"_pos, "4");
+    sheet->SetCell("C1"_pos, "3");
+    sheet->SetSubexpressionSharing(true);
+    for (int row = 1; row <= 20; ++row) {
+        sheet->SetCell({row, 3}, "=(A1 + B1) / C1 * " + std::to_string(row));
+    }
+    sheet->SetCell("E1"_pos, "=1-(A1+B1)/C1");
+    auto check = [&](double shared) {
+        for (int row = 1; row <= 20; ++row) {
+            ASSERT_EQUAL(sheet->GetCell({row, 3})->GetValue(), CellInterface::Value(shared * row));
+        }
+    };
+
+    // the cells read by all formulas while they are checked, profiled
+    // formulas read the cells by position, so every read is counted
+    auto count_reads = [&](double shared, double e1) {
+        sheet->SetProfilingEnabled(true);
+        check(shared);
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(e1));
+        size_t evaluations = 0;
+        size_t reads = 0;
+        for (const CellProfile& profile : sheet->GetProfile(100)) {
+            evaluations += profile.evaluations;
+            reads += profile.referenced_reads;
+        }
+        sheet->SetProfilingEnabled(false);
+        ASSERT_EQUAL(evaluations, 21u);
+        return reads;
+    };
+
+    // the shared subexpression reads its cells once for all formulas
+    ASSERT_EQUAL(count_reads(2, -1), 3u);
+    // and once again after they changed, 63 reads without the sharing
+    sheet->SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(count_reads(3, -2), 3u);
+    sheet->SetSubexpressionSharing(false);
+    sheet->SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(count_reads(2, -1), 63u);
+    sheet->SetSubexpressionSharing(true);
+    sheet->SetCell("A1"_pos, "5");
+    check(3);
+    sheet->SetCell("C1"_pos, "0");
+    ASSERT_EQUAL(sheet->GetCell("D5"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+    sheet->SetCell("C1"_pos, "=A1-2");
+    check(3);
+    sheet->InsertRows(0, 1);
+    ASSERT_EQUAL(sheet->GetCell("D4"_pos)->GetText(), "=(A2+B2)/C2*2");
+    sheet->SetCell("B2"_pos, "13");
+    ASSERT_EQUAL(sheet->GetCell("D4"_pos)->GetValue(), CellInterface::Value(12.0));
+    ASSERT_EQUAL(sheet->GetCell("E2"_pos)->GetValue(), CellInterface::Value(-5.0));
+    ASSERT(sheet->Undo());
+    ASSERT(sheet->Undo());
+    check(3);
+    sheet->SetSubexpressionSharing(false);
+    sheet->SetCell("B1"_pos, "1");
+    check(2);
+}
+void TestConcurrentWrites() {
+    auto sheet = CreateSheet();
+    sheet->SetConcurrentWrites(true);
+    constexpr int threads = 4;
+    constexpr int rows = 200;
+    // each thread fills a block of columns of its own tiles, the first
+    // column of the block sums the next two
+    std::vector<std::thread> writers;
+    for (int block = 0; block < threads; ++block) {
+        writers.emplace_back([&sheet, block] {
+            int first_col = block * OccupancyIndex::TILE_SIZE;
+            for (int row = 0; row < rows; ++row) {
+                for (int col = 1; col < 8; ++col) {
+                    sheet->SetCell({row, first_col + col}, std::to_string(row * col));
+                }
+                sheet->SetCell({row, first_col},
+                               "=" + Position{row, first_col + 1}.ToString() + "+" + Position{row, first_col + 2}.ToString());
+                // the cell is read by the formula now
+                sheet->SetCell({row, first_col + 1}, std::to_string(row * 3));
+            }
+        });
+    }
+    // a circular reference is found whichever of the two formulas comes second
+    std::atomic<int> circular_references = 0;
+    auto write_formulas = [&](const std::string& column, const std::string& other_column) {
+        for (int row = 1; row <= 50; ++row) {
+            try {
+                sheet->SetCell(Position::FromString(column + std::to_string(row)), "=" + other_column + std::to_string(row));
+            } catch (const CircularDependencyException&) {
+                ++circular_references;
+            }
+        }
+    };
+    writers.emplace_back(write_formulas, "ZZ", "ZY");
+    writers.emplace_back(write_formulas, "ZY", "ZZ");
+    for (std::thread& writer : writers) {
+        writer.join();
+    }
+
+    ASSERT_EQUAL(circular_references.load(), 50);
+    // the formula that came second is not written, so ZZ may stay empty
+    int printed_cols = Position::FromString("ZY1").col + 1;
+    for (int row = 1; row <= 50; ++row) {
+        if (sheet->GetCell(Position::FromString("ZZ" + std::to_string(row)))) {
+            printed_cols = Position::FromString("ZZ1").col + 1;
+        }
+    }
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{rows, printed_cols}));
+    for (int block = 0; block < threads; ++block) {
+        int first_col = block * OccupancyIndex::TILE_SIZE;
+        for (int row = 0; row < rows; ++row) {
+            ASSERT_EQUAL(sheet->GetCell({row, first_col})->GetValue(), CellInterface::Value(row * 5.0));
+            ASSERT_EQUAL(sheet->GetCell({row, first_col + 7})->GetText(), std::to_string(row * 7));
+        }
+    }
+    // each write is an edit of its own
+    ASSERT(sheet->Undo());
+    sheet->SetConcurrentWrites(false);
+    sheet->SetCell("ZX1"_pos, "=ZZ1*2");
+    sheet->SetCell("ZZ1"_pos, "5");
+    ASSERT_EQUAL(sheet->GetCell("ZX1"_pos)->GetValue(), CellInterface::Value(10.0));
+}
+void TestDependencyAnalysis() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("B1"_pos, "=A1");
+    sheet->SetCell("B2"_pos, "=B1+1");
+    sheet->SetCell("B3"_pos, "=B2+1");
+    for (int row = 0; row < 4; ++row) {
+        sheet->SetCell({row, 2}, "=A1*" + std::to_string(row));
+    }
+    sheet->SetCell("D1"_pos, "=B3+C1");
+    sheet->SetCell("E1"_pos, "text");
+
+    DependencyAnalysis analysis = sheet->AnalyzeDependencies(2);
+    ASSERT_EQUAL(analysis.longest_chain, (std::vector{"B1"_pos, "B2"_pos, "B3"_pos, "D1"_pos}));
+    ASSERT_EQUAL(analysis.fan_in, (std::vector<size_t>{0, 7, 1}));
+    ASSERT_EQUAL(analysis.fan_out, (std::vector<size_t>{5, 4, 0, 0, 0, 1}));
+    ASSERT_EQUAL(analysis.levels, (std::vector<size_t>{5, 1, 1, 1}));
+    ASSERT_EQUAL(analysis.widest_level, 0u);
+    ASSERT_EQUAL(analysis.hubs.size(), 2u);
+    ASSERT_EQUAL(analysis.hubs[0].first, "A1"_pos);
+    ASSERT_EQUAL(analysis.hubs[0].second, 8u);
+    ASSERT_EQUAL(analysis.hubs[1].first, "B1"_pos);
+    ASSERT_EQUAL(analysis.hubs[1].second, 3u);
+
+    // a long chain, whose cells are all candidates for the hubs
+    for (int row = 10; row < 2000; ++row) {
+        sheet->SetCell({row, 0}, "=A" + std::to_string(row) + "+1");
+    }
+    analysis = sheet->AnalyzeDependencies(3);
+    ASSERT_EQUAL(analysis.longest_chain.size(), 1990u);
+    ASSERT_EQUAL(analysis.hubs[0].first, "A10"_pos);
+    ASSERT_EQUAL(analysis.hubs[0].second, 1990u);
+    ASSERT_EQUAL(analysis.hubs[2].first, "A12"_pos);
+    ASSERT_EQUAL(analysis.hubs[2].second, 1988u);
+    ASSERT(CreateSheet()->AnalyzeDependencies(5).hubs.empty());
+}
+void TestBoundCellReads() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+    sheet->SetCell("A2"_pos, "3");
+    sheet->SetCell("B1"_pos, "=A1*A2+C5");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.0));
+    // the handles follow edits of the cells, the referenced empty cell included
+    sheet->SetCell("A2"_pos, "=A1+2");
+    sheet->SetCell("C5"_pos, "1");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(9.0));
+    sheet->ClearCell("C5"_pos);
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(8.0));
+
+    // and the cells when they move
+    sheet->InsertRows(0, 2);
+    sheet->SetCell("A3"_pos, "3");
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(), CellInterface::Value(15.0));
+    sheet->DeleteRows(3, 1);
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+    ASSERT(sheet->Undo());
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(), CellInterface::Value(15.0));
+    sheet->SetCell("A3"_pos, "4");
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(), CellInterface::Value(24.0));
+
+    // what-if scenarios replace the cells the formulas are bound to
+    auto result = sheet->Sweep({"A3"_pos}, {{1}, {5}}, {"B3"_pos});
+    ASSERT_EQUAL(result, (std::vector<std::vector<CellInterface::Value>>{{3.0}, {35.0}}));
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(), CellInterface::Value(24.0));
+
+    // lazily compiled formulas are bound when compiled
+    sheet->SetLazyFormulaCompilation(true);
+    sheet->SetCell("D1"_pos, "=B3-A3");
+    sheet->SetCell("A3"_pos, "1");
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(2.0));
+}
+void TestReferencedEmptyCells() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=B1+ZZ10000");
+    // the referenced cells are not created
+    ASSERT(sheet->GetCell("B1"_pos) == nullptr && sheet->GetCell("ZZ10000"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    // until they are written
+    sheet->SetCell("B1"_pos, "5");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(5.0));
+    try {
+        sheet->SetCell("ZZ10000"_pos, "=A1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT(sheet->GetCell("ZZ10000"_pos) == nullptr);
+    sheet->ClearCell("B1"_pos);
+    ASSERT(sheet->GetCell("B1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+    ASSERT(sheet->Undo());
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(5.0));
+
+    // the references move with the rows outside of the printable area
+    sheet->InsertRows(100, 2);
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "=B1+ZZ10002");
+    sheet->SetCell("ZZ10002"_pos, "1");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT(sheet->Undo());
+    ASSERT(sheet->GetCell("ZZ10002"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 2}));
+    sheet->DeleteRows(10001, 1);
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+    ASSERT(sheet->Undo());
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "=B1+ZZ10002");
+
+    // a formula moves away from the empty cell it refers to
+    sheet->SetCell("C20"_pos, "=C2*2");
+    sheet->InsertRows(10, 5);
+    try {
+        sheet->SetCell("C2"_pos, "=C25");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    sheet->SetCell("C2"_pos, "4");
+    ASSERT_EQUAL(sheet->GetCell("C25"_pos)->GetValue(), CellInterface::Value(8.0));
+    sheet->ClearCell("C2"_pos);
+    sheet->DeleteRows(5, 5);
+    try {
+        sheet->SetCell("C2"_pos, "=C20");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    sheet->SetCell("C2"_pos, "3");
+    ASSERT_EQUAL(sheet->GetCell("C20"_pos)->GetValue(), CellInterface::Value(6.0));
+    sheet->ClearCell("C20"_pos);
+    sheet->ClearCell("C2"_pos);
+
+    // a what-if input may be an empty cell
+    auto result = sheet->Sweep({"ZZ10002"_pos}, {{2}}, {"A1"_pos});
+    ASSERT_EQUAL(result, (std::vector<std::vector<CellInterface::Value>>{{7.0}}));
+}
+void TestThreadPoolBatches() {
+    ThreadPool pool(2);
+    std::atomic<bool> first_started = false;
+    std::atomic<bool> second_finished = false;
+    std::thread first([&] {
+        // fails only after the second batch, which must not wait for it
+        try {
+            pool.Run({[&] {
+                first_started = true;
+                while (!second_finished) {
+                    std::this_thread::yield();
+                }
+                throw std::runtime_error("first");
+            }});
+            ASSERT(false);
+        } catch (const std::runtime_error& e) {
+            ASSERT_EQUAL(std::string(e.what()), "first");
+        }
+    });
+    while (!first_started) {
+        std::this_thread::yield();
+    }
+    int runs = 0;
+    pool.Run({[&] {
+        ++runs;
+    }});
+    ASSERT_EQUAL(runs, 1);
+    second_finished = true;
+    first.join();
+}
+void TestMemoryUsage() {
+    auto sheet = CreateSheet();
+    ASSERT_EQUAL(sheet->GetMemoryUsage().GetTotal(), 0u);
+
+    sheet->SetCell("A1"_pos, "short");
+    MemoryUsage usage = sheet->GetMemoryUsage();
+    ASSERT(usage.grid > 0 && usage.cells > 0 && usage.cell_impls > 0);
+    ASSERT_EQUAL(usage.texts, 0u);
+
+    const std::string long_text(1000, 'x');
+    sheet->SetCell("C3"_pos, long_text);
+    usage = sheet->GetMemoryUsage();
+    ASSERT(usage.texts > long_text.size());
+    // the grid holds the empty cells of the printable area too
+    ASSERT(usage.grid >= 9 * sizeof(void*));
+
+    sheet->SetCell("B1"_pos, "=A1+C3*(A1-C3)/2+A1+C3");
+    usage = sheet->GetMemoryUsage();
+    ASSERT(usage.formulas > 0 && usage.dependencies > 0);
+    ASSERT_EQUAL(usage.caches, 0u);
+    sheet->GetCell("B1"_pos)->GetText();
+    ASSERT(sheet->GetMemoryUsage().caches > 0);
+    ASSERT_EQUAL(sheet->GetMemoryUsage().GetTotal(),
+                 usage.grid + usage.cells + usage.cell_impls + usage.texts + usage.formulas
+                     + usage.dependencies + sheet->GetMemoryUsage().caches);
+
+    // without the undo history nothing refers to the cleared cells
+    sheet->SetUndoMemoryLimit(0);
+    sheet->ClearCell("B1"_pos);
+    sheet->ClearCell("C3"_pos);
+    sheet->ClearCell("A1"_pos);
+    usage = sheet->GetMemoryUsage();
+    ASSERT_EQUAL(usage.cells + usage.cell_impls + usage.texts + usage.formulas + usage.dependencies
+                     + usage.caches, 0u);
+}
+void TestDeepDependencyChain() {
+    // a chain of 100000 cells, each one refers to the previous one
+    const int length = 100000;
+    auto link = [](int i) {
+        return Position{i / 10, i % 10};
+    };
+    auto sheet = CreateSheet();
+    sheet->SetCell(link(0), "1");
+    for (int i = 1; i < length; ++i) {
+        sheet->SetCell(link(i), "=" + link(i - 1).ToString() + "+1");
+    }
+    ASSERT_EQUAL(sheet->GetCell(link(length - 1))->GetValue(), CellInterface::Value(double(length)));
+    sheet->SetCell(link(0), "2");
+    ASSERT_EQUAL(sheet->GetCell(link(length - 1))->GetValue(), CellInterface::Value(length + 1.0));
+    // the cells of the chain were cached on the way
+    sheet->SetProfilingEnabled(true);
+    ASSERT_EQUAL(sheet->GetCell(link(length / 2))->GetValue(), CellInterface::Value(length / 2 + 2.0));
+    ASSERT(sheet->GetProfile(1).empty());
+    sheet->SetProfilingEnabled(false);
+
+    // a chain that goes back and forth between two sheets
+    auto workbook = CreateWorkbook(1);
+    SheetInterface* first = workbook->AddSheet("First");
+    SheetInterface* second = workbook->AddSheet("Second");
+    first->SetCell(link(0), "1");
+    for (int i = 1; i < length / 2; ++i) {
+        second->SetCell(link(i), "=First!" + link(i - 1).ToString() + "+1");
+        first->SetCell(link(i), "=Second!" + link(i).ToString() + "*1");
+    }
+    ASSERT_EQUAL(first->GetCell(link(length / 2 - 1))->GetValue(), CellInterface::Value(double(length / 2)));
+}
 }  // namespace
 
 int main() {
@@ -374,6 +1765,7 @@ int main() {
     RUN_TEST(tr, TestPositionAndStringConversion);
     RUN_TEST(tr, TestPositionToStringInvalid);
     RUN_TEST(tr, TestStringToPositionInvalid);
+    RUN_TEST(tr, TestPositionCodec);
     RUN_TEST(tr, TestEmpty);
     RUN_TEST(tr, TestInvalidPosition);
     RUN_TEST(tr, TestSetCellPlainText);
@@ -382,6 +1774,7 @@ int main() {
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
     RUN_TEST(tr, TestFormulaReferencedCells);
+    RUN_TEST(tr, TestFormulaSimplification);
     RUN_TEST(tr, TestErrorValue);
     RUN_TEST(tr, TestErrorArithmetic);
     RUN_TEST(tr, TestEmptyCellTreatedAsZero);
@@ -390,4 +1783,28 @@ int main() {
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestEvaluationProfile);
+    RUN_TEST(tr, TestRecalculationModes);
+    RUN_TEST(tr, TestInsertDeleteRowsAndColumns);
+    RUN_TEST(tr, TestCopyRangeAndFillDown);
+    RUN_TEST(tr, TestWorkbook);
+    RUN_TEST(tr, TestUndoRedo);
+    RUN_TEST(tr, TestLazyFormulaCompilation);
+    RUN_TEST(tr, TestRowBatchEvaluation);
+    RUN_TEST(tr, TestOccupancyIndex);
+    RUN_TEST(tr, TestViewport);
+    RUN_TEST(tr, TestDeepDependencyChain);
+    RUN_TEST(tr, TestMemoryUsage);
+    RUN_TEST(tr, TestChangeTracking);
+    RUN_TEST(tr, TestEarlyCutoff);
+    RUN_TEST(tr, TestTileCompression);
+    RUN_TEST(tr, TestPageFile);
+    RUN_TEST(tr, TestWhatIf);
+    RUN_TEST(tr, TestServer);
+    RUN_TEST(tr, TestSubexpressionSharing);
+    RUN_TEST(tr, TestConcurrentWrites);
+    RUN_TEST(tr, TestDependencyAnalysis);
+    RUN_TEST(tr, TestBoundCellReads);
+    RUN_TEST(tr, TestReferencedEmptyCells);
+    RUN_TEST(tr, TestThreadPoolBatches);
 }
@@ -0,0 +1,57 @@
+#include "memory_tracker.h"
+
+namespace {
+thread_local MemoryCounter* current_counter = nullptr;
+
+// Room in front of an object for its counter, the object stays aligned
+constexpr size_t HEADER_SIZE = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+static_assert(sizeof(MemoryCounter*) <= HEADER_SIZE);
+}  // namespace
+
+MemoryUsage MemoryTracker::GetUsage() const {
+    auto get = [this](MemoryCategory category) {
+        return counters_[static_cast<int>(category)].Get();
+    };
+    MemoryUsage usage;
+    usage.grid = get(MemoryCategory::Grid);
+    usage.cells = get(MemoryCategory::Cells);
+    usage.cell_impls = get(MemoryCategory::CellImpls);
+    usage.texts = get(MemoryCategory::Texts);
+    usage.formulas = get(MemoryCategory::Formulas);
+    usage.dependencies = get(MemoryCategory::Dependencies);
+    usage.compressed_tiles = get(MemoryCategory::CompressedTiles);
+    usage.caches = get(MemoryCategory::Caches);
+    return usage;
+}
+
+MemoryScope::MemoryScope(MemoryCounter* counter)
+    : previous_(current_counter) {
+    current_counter = counter;
+}
+
+MemoryScope::~MemoryScope() {
+    current_counter = previous_;
+}
+
+MemoryCounter* MemoryScope::GetCurrentCounter() {
+    return current_counter;
+}
+
+void* AllocateTracked(size_t size) {
+    MemoryCounter* counter = current_counter;
+    auto* memory = static_cast<std::byte*>(::operator new(HEADER_SIZE + size));
+    *reinterpret_cast<MemoryCounter**>(memory) = counter;
+    if (counter != nullptr) {
+        counter->Add(HEADER_SIZE + size);
+    }
+    return memory + HEADER_SIZE;
+}
+
+void DeallocateTracked(void* p, size_t size) noexcept {
+    std::byte* memory = static_cast<std::byte*>(p) - HEADER_SIZE;
+    MemoryCounter* counter = *reinterpret_cast<MemoryCounter**>(memory);
+    if (counter != nullptr) {
+        counter->Remove(HEADER_SIZE + size);
+    }
+    ::operator delete(memory);
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Bytes allocated for one kind of data
+class MemoryCounter {
+public:
+    void Add(size_t bytes) { bytes_.fetch_add(bytes, std::memory_order_relaxed); }
+    void Remove(size_t bytes) { bytes_.fetch_sub(bytes, std::memory_order_relaxed); }
+    size_t Get() const { return bytes_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<size_t> bytes_ = 0;
+};
+
+// Kinds of data of a sheet whose memory is tracked
+enum class MemoryCategory {
+    Grid,
+    Cells,
+    CellImpls,
+    Texts,
+    Formulas,
+    Dependencies,
+    CompressedTiles,
+    Caches,
+};
+
+// Counts the memory allocated by the containers and objects of a sheet. It
+// must outlive everything allocated with its counters.
+class MemoryTracker {
+public:
+    MemoryCounter* GetCounter(MemoryCategory category) { return &counters_[static_cast<int>(category)]; }
+    MemoryUsage GetUsage() const;
+
+private:
+    MemoryCounter counters_[static_cast<int>(MemoryCategory::Caches) + 1];
+};
+
+// Makes the counter current for the thread for the lifetime of the object.
+// Allocators created meanwhile and objects with the tracked operator new
+// count their memory there. Formulas do not know their sheet, so their
+// memory is counted this way.
+class MemoryScope {
+public:
+    explicit MemoryScope(MemoryCounter* counter);
+    MemoryScope(MemoryTracker& tracker, MemoryCategory category)
+        : MemoryScope(tracker.GetCounter(category)) {
+    }
+    ~MemoryScope();
+
+    MemoryScope(const MemoryScope&) = delete;
+    MemoryScope& operator=(const MemoryScope&) = delete;
+
+    // nullptr outside of any scope
+    static MemoryCounter* GetCurrentCounter();
+
+private:
+    MemoryCounter* previous_;
+};
+
+// Allocator that counts the allocated bytes. By default it takes the
+// counter of the current MemoryScope, if there is one. Moved containers
+// take the counter along, so their nodes are never copied on a move.
+template <typename T>
+class TrackingAllocator {
+public:
+    using value_type = T;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    TrackingAllocator() noexcept
+        : counter_(MemoryScope::GetCurrentCounter()) {
+    }
+    explicit TrackingAllocator(MemoryCounter* counter) noexcept
+        : counter_(counter) {
+    }
+    template <typename U>
+    TrackingAllocator(const TrackingAllocator<U>& other) noexcept
+        : counter_(other.GetCounter()) {
+    }
+
+    T* allocate(size_t n) {
+        T* result = std::allocator<T>().allocate(n);
+        if (counter_ != nullptr) {
+            counter_->Add(n * sizeof(T));
+        }
+        return result;
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        std::allocator<T>().deallocate(p, n);
+        if (counter_ != nullptr) {
+            counter_->Remove(n * sizeof(T));
+        }
+    }
+
+    MemoryCounter* GetCounter() const noexcept { return counter_; }
+
+    template <typename U>
+    bool operator==(const TrackingAllocator<U>& other) const noexcept { return counter_ == other.GetCounter(); }
+    template <typename U>
+    bool operator!=(const TrackingAllocator<U>& other) const noexcept { return counter_ != other.GetCounter(); }
+
+private:
+    MemoryCounter* counter_;
+};
+
+template <typename T>
+using TrackedVector = std::vector<T, TrackingAllocator<T>>;
+using TrackedString = std::basic_string<char, std::char_traits<char>, TrackingAllocator<char>>;
+
+// Allocates memory counted by the counter of the current MemoryScope. The
+// counter is kept in front of the object, so the memory can be released
+// outside of the scope. For operator new and delete of polymorphic classes.
+void* AllocateTracked(size_t size);
+void DeallocateTracked(void* p, size_t size) noexcept;
+
+// Destroys an object made by MakeTracked() and releases its memory
+template <typename T>
+class TrackingDeleter {
+public:
+    TrackingDeleter() = default;
+    TrackingDeleter(MemoryCounter* counter, size_t size)
+        : counter_(counter)
+        , size_(size) {
+    }
+
+    void operator()(T* p) const {
+        p->~T();
+        TrackingAllocator<std::byte>(counter_).deallocate(reinterpret_cast<std::byte*>(p), size_);
+    }
+
+private:
+    MemoryCounter* counter_ = nullptr;
+    size_t size_ = 0;
+};
+
+template <typename T>
+using TrackedPtr = std::unique_ptr<T, TrackingDeleter<T>>;
+
+// Creates an object of type U whose memory is counted by the counter,
+// T has to have a virtual destructor if it is a base of U
+template <typename T, typename U = T, typename... Args>
+TrackedPtr<T> MakeTracked(MemoryCounter* counter, Args&&... args) {
+    static_assert(alignof(U) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+    TrackingAllocator<std::byte> allocator(counter);
+    std::byte* memory = allocator.allocate(sizeof(U));
+    try {
+        U* object = new (memory) U(std::forward<Args>(args)...);
+        return TrackedPtr<T>(object, TrackingDeleter<T>(counter, sizeof(U)));
+    } catch (...) {
+        allocator.deallocate(memory, sizeof(U));
+        throw;
+    }
+}
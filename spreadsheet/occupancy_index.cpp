@@ -0,0 +1,150 @@
+#include "occupancy_index.h"
+
+#include <iterator>
+
+bool OccupancyIndex::Insert(Position pos) {
+    int tile_row_index = pos.row >> TILE_BITS;
+    int tile_index = pos.col >> TILE_BITS;
+    if (tile_row_index >= static_cast<int>(tile_rows_.size())) {
+        tile_rows_.resize(tile_row_index + 1);
+    }
+    TileRow& tile_row = tile_rows_[tile_row_index];
+    if (tile_index >= static_cast<int>(tile_row.tiles.size())) {
+        tile_row.tiles.resize(tile_index + 1);
+    }
+    auto& tile = tile_row.tiles[tile_index];
+    if (!tile) {
+        tile = std::make_unique<Tile>();
+        tile_row.occupied[tile_index / WORD_BITS] |= uint64_t{1} << (tile_index % WORD_BITS);
+    }
+
+    uint64_t& word = tile->rows[pos.row & (TILE_SIZE - 1)];
+    uint64_t bit = uint64_t{1} << (pos.col & (TILE_SIZE - 1));
+    if (word & bit) {
+        return false;
+    }
+    word |= bit;
+    ++tile->count;
+    ++count_;
+    rows_.Add(pos.row);
+    cols_.Add(pos.col);
+    return true;
+}
+
+bool OccupancyIndex::Erase(Position pos) {
+    if (!Contains(pos)) {
+        return false;
+    }
+    int tile_index = pos.col >> TILE_BITS;
+    TileRow& tile_row = tile_rows_[pos.row >> TILE_BITS];
+    auto& tile = tile_row.tiles[tile_index];
+    tile->rows[pos.row & (TILE_SIZE - 1)] &= ~(uint64_t{1} << (pos.col & (TILE_SIZE - 1)));
+    if (--tile->count == 0) {
+        tile.reset();
+        tile_row.occupied[tile_index / WORD_BITS] &= ~(uint64_t{1} << (tile_index % WORD_BITS));
+    }
+    --count_;
+    rows_.Remove(pos.row);
+    cols_.Remove(pos.col);
+    return true;
+}
+
+bool OccupancyIndex::Contains(Position pos) const {
+    if (!pos.IsValid()) {
+        return false;
+    }
+    int tile_row_index = pos.row >> TILE_BITS;
+    int tile_index = pos.col >> TILE_BITS;
+    if (tile_row_index >= static_cast<int>(tile_rows_.size())) {
+        return false;
+    }
+    const TileRow& tile_row = tile_rows_[tile_row_index];
+    if (tile_index >= static_cast<int>(tile_row.tiles.size()) || !tile_row.tiles[tile_index]) {
+        return false;
+    }
+    uint64_t word = tile_row.tiles[tile_index]->rows[pos.row & (TILE_SIZE - 1)];
+    return (word >> (pos.col & (TILE_SIZE - 1))) & 1;
+}
+
+void OccupancyIndex::Clear() {
+    tile_rows_.clear();
+    rows_.Clear();
+    cols_.Clear();
+    count_ = 0;
+}
+
+void OccupancyIndex::HandleStructuralChange(const StructuralChange& change) {
+    std::vector<Position> moved;
+    ForEach(change.GetMovedRange(), [&](Position pos) {
+        moved.push_back(pos);
+    });
+    for (Position pos : moved) {
+        Erase(pos);
+    }
+    for (Position pos : moved) {
+        if (Position new_pos = change.Apply(pos); new_pos.IsValid()) {
+            Insert(new_pos);
+        }
+    }
+}
+
+Size OccupancyIndex::GetBoundingSize() const {
+    return {rows_.GetLast() + 1, cols_.GetLast() + 1};
+}
+
+uint64_t OccupancyIndex::GetColumnMask(int tile, int first_col, int end_col) {
+    int first = std::max(first_col - (tile << TILE_BITS), 0);
+    int end = std::min(end_col - (tile << TILE_BITS), TILE_SIZE);
+    uint64_t below_end = end == WORD_BITS ? ~uint64_t{0} : (uint64_t{1} << end) - 1;
+    return below_end & ~((uint64_t{1} << first) - 1);
+}
+
+int OccupancyIndex::TileRow::FindTile(int first) const {
+    for (int word = first / WORD_BITS; word < TILES_PER_ROW / WORD_BITS; ++word) {
+        uint64_t bits = occupied[word];
+        if (word == first / WORD_BITS) {
+            bits &= ~uint64_t{0} << (first % WORD_BITS);
+        }
+        if (bits != 0) {
+            return word * WORD_BITS + CountTrailingZeros(bits);
+        }
+    }
+    return TILES_PER_ROW;
+}
+
+void OccupancyIndex::LineCounter::Add(int line) {
+    if (line >= static_cast<int>(counts_.size())) {
+        counts_.resize(line + 1);
+    }
+    if (counts_[line]++ == 0) {
+        lines_[line / WORD_BITS] |= uint64_t{1} << (line % WORD_BITS);
+        words_[line / WORD_BITS / WORD_BITS] |= uint64_t{1} << (line / WORD_BITS % WORD_BITS);
+    }
+}
+
+void OccupancyIndex::LineCounter::Remove(int line) {
+    if (--counts_[line] > 0) {
+        return;
+    }
+    uint64_t& word = lines_[line / WORD_BITS];
+    word &= ~(uint64_t{1} << (line % WORD_BITS));
+    if (word == 0) {
+        words_[line / WORD_BITS / WORD_BITS] &= ~(uint64_t{1} << (line / WORD_BITS % WORD_BITS));
+    }
+}
+
+int OccupancyIndex::LineCounter::GetLast() const {
+    for (int i = WORDS / WORD_BITS - 1; i >= 0; --i) {
+        if (words_[i] != 0) {
+            int word = i * WORD_BITS + FindLastBit(words_[i]);
+            return word * WORD_BITS + FindLastBit(lines_[word]);
+        }
+    }
+    return -1;
+}
+
+void OccupancyIndex::LineCounter::Clear() {
+    counts_.clear();
+    std::fill(std::begin(lines_), std::end(lines_), 0);
+    std::fill(std::begin(words_), std::end(words_), 0);
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "bit_scan.h"
+#include "common.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Tracks which cells of a sheet are occupied. The table is split into tiles
+// of 64x64 cells: a bit per tile tells whether the tile has any occupied
+// cells and a bit per cell of such a tile whether the cell is occupied. So
+// the iteration skips empty tiles at once and empty cells a word at a time.
+class OccupancyIndex {
+public:
+    static constexpr int TILE_BITS = 6;
+    static constexpr int TILE_SIZE = 1 << TILE_BITS;
+
+    // Returns false if the cell was occupied already
+    bool Insert(Position pos);
+    // Returns false if the cell was not occupied
+    bool Erase(Position pos);
+    bool Contains(Position pos) const;
+    void Clear();
+    // Moves the occupied cells the change moves and erases the deleted ones,
+    // the cells before the changed rows or columns are not visited
+    void HandleStructuralChange(const StructuralChange& change);
+    size_t GetCount() const { return count_; }
+
+    // Returns the size of the smallest area starting at A1 that contains all
+    // occupied cells, {0, 0} if there are none
+    Size GetBoundingSize() const;
+
+    // Calls visit(Position) for each occupied cell of the range, row by row.
+    // The index must not be changed by visit().
+    template <typename Visitor>
+    void ForEach(Range range, Visitor visit) const;
+
+    // Calls visit(Position) with the top left cell of each tile that has
+    // occupied cells, row by row
+    template <typename Visitor>
+    void ForEachTile(Visitor visit) const;
+
+private:
+    static constexpr int TILES_PER_ROW = Position::MAX_COLS / TILE_SIZE;
+    static constexpr int WORD_BITS = 64;
+
+    struct Tile {
+        // bit j of rows[i] is the cell in the row i and the column j of the tile
+        uint64_t rows[TILE_SIZE] = {};
+        int count = 0;
+    };
+
+    // Tiles of TILE_SIZE consecutive rows of the table
+    struct TileRow {
+        uint64_t occupied[TILES_PER_ROW / WORD_BITS] = {};
+        std::vector<std::unique_ptr<Tile>> tiles;
+
+        // Returns the first occupied tile starting with the given one or TILES_PER_ROW
+        int FindTile(int first) const;
+    };
+
+    // Counts the occupied cells of each row or column and finds the last
+    // non-empty line by a search over two levels of bits
+    class LineCounter {
+    public:
+        void Add(int line);
+        void Remove(int line);
+        // Returns -1 if all lines are empty
+        int GetLast() const;
+        void Clear();
+
+    private:
+        static constexpr int MAX_LINES = std::max(Position::MAX_ROWS, Position::MAX_COLS);
+        static constexpr int WORDS = MAX_LINES / WORD_BITS;
+
+        std::vector<int> counts_;
+        uint64_t lines_[WORDS] = {};
+        uint64_t words_[WORDS / WORD_BITS] = {};
+    };
+
+    // Bits of the tile columns that lie in [first_col, end_col) of the table
+    static uint64_t GetColumnMask(int tile, int first_col, int end_col);
+
+    std::vector<TileRow> tile_rows_;
+    LineCounter rows_;
+    LineCounter cols_;
+    size_t count_ = 0;
+};
+
+template <typename Visitor>
+void OccupancyIndex::ForEach(Range range, Visitor visit) const {
+    int first_col = std::max(range.top_left.col, 0);
+    int end_col = std::min(range.top_left.col + range.size.cols, TILES_PER_ROW * TILE_SIZE);
+    int end_row = std::min(range.top_left.row + range.size.rows, static_cast<int>(tile_rows_.size()) * TILE_SIZE);
+    if (first_col >= end_col) {
+        return;
+    }
+    int first_tile = first_col >> TILE_BITS;
+    int last_tile = (end_col - 1) >> TILE_BITS;
+    for (int row = std::max(range.top_left.row, 0); row < end_row; ++row) {
+        const TileRow& tile_row = tile_rows_[row >> TILE_BITS];
+        int tile = tile_row.FindTile(first_tile);
+        if (tile == TILES_PER_ROW) {
+            // no occupied tiles, skip to the next row of tiles
+            row |= TILE_SIZE - 1;
+            continue;
+        }
+        for (; tile <= last_tile; tile = tile_row.FindTile(tile + 1)) {
+            uint64_t bits = tile_row.tiles[tile]->rows[row & (TILE_SIZE - 1)] & GetColumnMask(tile, first_col, end_col);
+            while (bits != 0) {
+                int bit = CountTrailingZeros(bits);
+                bits &= bits - 1;
+                visit(Position{row, (tile << TILE_BITS) + bit});
+            }
+        }
+    }
+}
+
+template <typename Visitor>
+void OccupancyIndex::ForEachTile(Visitor visit) const {
+    for (size_t i = 0; i < tile_rows_.size(); ++i) {
+        const TileRow& tile_row = tile_rows_[i];
+        for (int tile = tile_row.FindTile(0); tile < TILES_PER_ROW; tile = tile_row.FindTile(tile + 1)) {
+            visit(Position{static_cast<int>(i) << TILE_BITS, tile << TILE_BITS});
+        }
+    }
+}
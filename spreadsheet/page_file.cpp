@@ -0,0 +1,69 @@
+#include "page_file.h"
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstdio>
+
+PageFile::PageFile(std::string path)
+    : path_(std::move(path))
+    , file_(path_, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc) {
+    if (!file_) {
+        throw PageFileException("cannot create the page file " + path_);
+    }
+}
+
+PageFile::~PageFile() {
+    file_.close();
+    std::remove(path_.c_str());
+}
+
+PageFile::Pages PageFile::Write(std::string_view data) {
+    Pages pages;
+    pages.reserve((data.size() + PAGE_SIZE - 1) / PAGE_SIZE);
+    for (size_t offset = 0; offset < data.size(); offset += PAGE_SIZE) {
+        uint32_t page = AllocatePage();
+        pages.push_back(page);
+        Seek(page);
+        file_.write(data.data() + offset, std::min(PAGE_SIZE, data.size() - offset));
+    }
+    if (!file_) {
+        Free(pages);
+        file_.clear();
+        throw PageFileException("cannot write the page file " + path_);
+    }
+    return pages;
+}
+
+std::string PageFile::Read(const Pages& pages, size_t size) {
+    std::string data(size, '\0');
+    for (size_t i = 0; i < pages.size(); ++i) {
+        Seek(pages[i]);
+        size_t offset = i * PAGE_SIZE;
+        file_.read(data.data() + offset, std::min(PAGE_SIZE, size - offset));
+    }
+    if (!file_) {
+        file_.clear();
+        throw PageFileException("cannot read the page file " + path_);
+    }
+    return data;
+}
+
+void PageFile::Free(const Pages& pages) {
+    free_pages_.insert(free_pages_.end(), pages.begin(), pages.end());
+}
+
+uint32_t PageFile::AllocatePage() {
+    if (free_pages_.empty()) {
+        return page_count_++;
+    }
+    uint32_t page = free_pages_.back();
+    free_pages_.pop_back();
+    return page;
+}
+
+void PageFile::Seek(uint32_t page) {
+    std::streamoff offset = static_cast<std::streamoff>(page) * PAGE_SIZE;
+    file_.seekp(offset);
+    file_.seekg(offset);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A temporary file of fixed-size pages. Data is written to free pages and
+// read back by the list of its pages, freed pages are reused. The file is
+// removed when the object is destroyed. Throws PageFileException if the
+// file cannot be created, written or read.
+class PageFile {
+public:
+    static constexpr size_t PAGE_SIZE = 4096;
+    using Pages = std::vector<uint32_t>;
+
+    explicit PageFile(std::string path);
+    ~PageFile();
+
+    PageFile(const PageFile&) = delete;
+    PageFile& operator=(const PageFile&) = delete;
+
+    Pages Write(std::string_view data);
+    // The size is the size of the written data
+    std::string Read(const Pages& pages, size_t size);
+    void Free(const Pages& pages);
+
+    size_t GetPageCount() const { return page_count_; }
+
+private:
+    uint32_t AllocatePage();
+    void Seek(uint32_t page);
+
+    std::string path_;
+    std::fstream file_;
+    uint32_t page_count_ = 0;
+    std::vector<uint32_t> free_pages_;
+};
@@ -0,0 +1,32 @@
+#include "common.h"
+
+#include <chrono>
+#include <iostream>
+#include <iterator>
+#include <string_view>
+#include <vector>
+
+// Measures the round trip of positions through ToChars and FromString
+int main() {
+    // every column with rows of every length
+    std::vector<Position> positions;
+    for (int row : {0, 8, 9, 98, 99, 998, 999, 9998, 9999, Position::MAX_ROWS - 1}) {
+        for (int col = 0; col < Position::MAX_COLS; ++col) {
+            positions.push_back({row, col});
+        }
+    }
+
+    char buffer[Position::MAX_STRING_LENGTH];
+    int mismatches = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (Position pos : positions) {
+        auto result = pos.ToChars(std::begin(buffer), std::end(buffer));
+        mismatches += !(Position::FromString({buffer, static_cast<size_t>(result.ptr - buffer)}) == pos);
+    }
+    auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start);
+    if (mismatches != 0) {
+        std::cerr << mismatches << " positions did not survive the round trip" << std::endl;
+        return 1;
+    }
+    std::cout << "Position codec: " << elapsed.count() / positions.size() << " ns per round trip" << std::endl;
+}
@@ -0,0 +1,70 @@
+#include "profiler.h"
+
+#include <algorithm>
+
+void EvaluationProfiler::SetEnabled(bool enabled) {
+    std::lock_guard lock(mutex_);
+    if (enabled && !enabled_) {
+        profiles_.clear();
+    }
+    enabled_ = enabled;
+}
+
+void EvaluationProfiler::CountReferenceRead() {
+    std::lock_guard lock(mutex_);
+    auto frames = frames_.find(std::this_thread::get_id());
+    if (frames != frames_.end()) {
+        ++profiles_[frames->second.back().position].referenced_reads;
+    }
+}
+
+void EvaluationProfiler::BeginEvaluation(Position pos) {
+    std::lock_guard lock(mutex_);
+    frames_[std::this_thread::get_id()].push_back({pos, Clock::now()});
+}
+
+void EvaluationProfiler::EndEvaluation() {
+    std::lock_guard lock(mutex_);
+    auto frames = frames_.find(std::this_thread::get_id());
+    Frame frame = frames->second.back();
+    frames->second.pop_back();
+
+    auto inclusive = Clock::now() - frame.start;
+    CellProfile& profile = profiles_[frame.position];
+    profile.position = frame.position;
+    ++profile.evaluations;
+    profile.inclusive_time += std::chrono::duration_cast<std::chrono::nanoseconds>(inclusive);
+    profile.exclusive_time += std::chrono::duration_cast<std::chrono::nanoseconds>(inclusive - frame.nested);
+
+    if (!frames->second.empty()) {
+        frames->second.back().nested += inclusive;
+    } else {
+        frames_.erase(frames);
+    }
+}
+
+void EvaluationProfiler::DiscardEvaluation() {
+    std::lock_guard lock(mutex_);
+    auto frames = frames_.find(std::this_thread::get_id());
+    Frame frame = frames->second.back();
+    frames->second.pop_back();
+    // the nested evaluations are not the work of the enclosing one either
+    if (!frames->second.empty()) {
+        frames->second.back().nested += Clock::now() - frame.start;
+    } else {
+        frames_.erase(frames);
+    }
+}
+
+std::vector<CellProfile> EvaluationProfiler::GetProfiles() const {
+    std::lock_guard lock(mutex_);
+    std::vector<CellProfile> result;
+    result.reserve(profiles_.size());
+    for (const auto& [pos, profile] : profiles_) {
+        result.push_back(profile);
+    }
+    std::stable_sort(result.begin(), result.end(), [](const CellProfile& lhs, const CellProfile& rhs) {
+        return lhs.exclusive_time > rhs.exclusive_time;
+    });
+    return result;
+}
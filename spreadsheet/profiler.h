@@ -0,0 +1,73 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Collects evaluation statistics of formula cells. Evaluations nest when a
+// formula reads another formula cell, so the profiler keeps a stack of the
+// active evaluations to tell inclusive time from exclusive time.
+class EvaluationProfiler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Measures one formula evaluation for the lifetime of the object
+    class Scope {
+    public:
+        Scope(EvaluationProfiler& profiler, Position pos) : profiler_(profiler) {
+            profiler_.BeginEvaluation(pos);
+        }
+        ~Scope() {
+            if (active_) {
+                profiler_.EndEvaluation();
+            }
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        // Ends the measurement without counting an evaluation, e.g. when
+        // the cached value turned out to be up to date
+        void Discard() {
+            profiler_.DiscardEvaluation();
+            active_ = false;
+        }
+
+    private:
+        EvaluationProfiler& profiler_;
+        bool active_ = true;
+    };
+
+    void SetEnabled(bool enabled);
+    bool IsEnabled() const { return enabled_; }
+
+    // Accounts a read of a referenced cell to the innermost active evaluation
+    // of the calling thread
+    void CountReferenceRead();
+
+    // Returns statistics sorted by exclusive time, expressions are left empty
+    std::vector<CellProfile> GetProfiles() const;
+
+private:
+    struct Frame {
+        Position position;
+        Clock::time_point start;
+        Clock::duration nested{0};
+    };
+
+    void BeginEvaluation(Position pos);
+    void EndEvaluation();
+    void DiscardEvaluation();
+
+    std::atomic<bool> enabled_ = false;
+    // the sheets of a workbook are evaluated in parallel and read each other
+    mutable std::mutex mutex_;
+    // the active evaluations of each thread
+    std::map<std::thread::id, std::vector<Frame>> frames_;
+    std::map<Position, CellProfile> profiles_;
+};
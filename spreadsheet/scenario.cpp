@@ -0,0 +1,47 @@
+#include "scenario.h"
+
+#include <functional>
+#include <sstream>
+
+namespace {
+thread_local const Scenario* current_scenario = nullptr;
+}  // namespace
+
+size_t Scenario::Add(const Sheet* sheet, Position pos, CellInterface::Value value) {
+    auto [it, inserted] = indexes_.emplace(Key{sheet, pos}, cells_.size());
+    if (inserted) {
+        cells_.emplace_back(std::move(value));
+    }
+    return it->second;
+}
+
+const CellInterface* Scenario::Find(const Sheet* sheet, Position pos) const {
+    auto it = indexes_.find({sheet, pos});
+    return it == indexes_.end() ? nullptr : &cells_[it->second];
+}
+
+Scenario::Scope::Scope(const Scenario& scenario)
+    : previous_(current_scenario) {
+    current_scenario = &scenario;
+}
+
+Scenario::Scope::~Scope() {
+    current_scenario = previous_;
+}
+
+const Scenario* Scenario::GetCurrent() {
+    return current_scenario;
+}
+
+std::string Scenario::ValueCell::GetText() const {
+    std::ostringstream text;
+    std::visit([&text](const auto& value) {
+        text << value;
+    }, value);
+    return text.str();
+}
+
+size_t Scenario::KeyHash::operator()(const Key& key) const {
+    size_t position = static_cast<size_t>(key.second.row) * Position::MAX_COLS + key.second.col;
+    return std::hash<const Sheet*>()(key.first) * 31 + position;
+}
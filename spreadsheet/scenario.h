@@ -0,0 +1,61 @@
+#pragma once
+
+#include "common.h"
+
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class Sheet;
+
+// Values that replace cells of sheets in a what-if scenario. While the
+// scenario is current for a thread, Sheet::GetCell() returns its cells
+// there, so the formulas evaluated by the thread read them instead of the
+// cells of the sheets. The sheets do not change.
+class Scenario {
+public:
+    // Returns the index of the cell, a cell that was added already keeps
+    // its index and value
+    size_t Add(const Sheet* sheet, Position pos, CellInterface::Value value);
+    void Set(size_t index, CellInterface::Value value) { cells_[index].value = std::move(value); }
+    // Returns nullptr if the scenario does not replace the cell
+    const CellInterface* Find(const Sheet* sheet, Position pos) const;
+
+    // Makes the scenario current for the thread for the lifetime of the object
+    class Scope {
+    public:
+        explicit Scope(const Scenario& scenario);
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        const Scenario* previous_;
+    };
+
+    // nullptr outside of any scope
+    static const Scenario* GetCurrent();
+
+private:
+    class ValueCell final : public CellInterface {
+    public:
+        explicit ValueCell(Value value)
+            : value(std::move(value)) {
+        }
+
+        Value GetValue() const override { return value; }
+        std::string GetText() const override;
+        std::vector<Position> GetReferencedCells() const override { return {}; }
+
+        Value value;
+    };
+
+    using Key = std::pair<const Sheet*, Position>;
+    struct KeyHash {
+        size_t operator()(const Key& key) const;
+    };
+
+    std::vector<ValueCell> cells_;
+    std::unordered_map<Key, size_t, KeyHash> indexes_;
+};
@@ -0,0 +1,365 @@
+#include "server.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <streambuf>
+#include <system_error>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std::literals;
+
+namespace {
+const std::string DEFAULT_SHEET = "Sheet1";
+constexpr size_t FRAME_HEADER_SIZE = 4;
+
+std::optional<std::string> ReadLine(std::istream& input) {
+    std::string line;
+    if (!std::getline(input, line)) {
+        return std::nullopt;
+    }
+    if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+    }
+    return line;
+}
+
+std::optional<std::string> ReadFrame(std::istream& input) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    if (!input.read(reinterpret_cast<char*>(header), FRAME_HEADER_SIZE)) {
+        return std::nullopt;
+    }
+    uint32_t size = 0;
+    for (size_t i = 0; i < FRAME_HEADER_SIZE; ++i) {
+        size |= static_cast<uint32_t>(header[i]) << (8 * i);
+    }
+    if (size > SpreadsheetServer::MAX_FRAME_SIZE) {
+        throw std::length_error("frame of "s + std::to_string(size) + " bytes is too large");
+    }
+    std::string frame(size, '\0');
+    if (!input.read(frame.data(), size)) {
+        return std::nullopt;
+    }
+    return frame;
+}
+
+void WriteResponse(std::string& output, std::string_view response, bool binary) {
+    if (binary) {
+        for (size_t i = 0; i < FRAME_HEADER_SIZE; ++i) {
+            output += static_cast<char>(response.size() >> (8 * i));
+        }
+        output += response;
+    } else {
+        output += response;
+        output += '\n';
+    }
+}
+
+// Splits off the first word of the text
+std::string_view TakeWord(std::string_view& text) {
+    size_t end = std::min(text.find(' '), text.size());
+    std::string_view word = text.substr(0, end);
+    text.remove_prefix(std::min(end + 1, text.size()));
+    return word;
+}
+
+// Splits [Sheet!]A1 into the sheet name and the position
+std::pair<std::string_view, Position> ParseCell(std::string_view cell) {
+    std::string_view sheet = DEFAULT_SHEET;
+    if (size_t separator = cell.find('!'); separator != std::string_view::npos) {
+        sheet = cell.substr(0, separator);
+        cell.remove_prefix(separator + 1);
+    }
+    Position pos = Position::FromString(cell);
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("invalid cell " + std::string(cell));
+    }
+    return {sheet, pos};
+}
+
+void PrintValue(std::ostream& output, const CellInterface::Value& value) {
+    std::visit([&output](const auto& alternative) {
+        output << alternative;
+    }, value);
+}
+
+#ifndef _WIN32
+// Reads or writes a socket through a buffer, a connection uses one buffer
+// for each direction
+class SocketBuffer : public std::streambuf {
+public:
+    explicit SocketBuffer(int socket)
+        : socket_(socket) {
+        setp(buffer_, buffer_ + BUFFER_SIZE);
+    }
+    ~SocketBuffer() override {
+        sync();
+    }
+
+protected:
+    int_type underflow() override {
+        ssize_t size;
+        do {
+            size = read(socket_, buffer_, BUFFER_SIZE);
+        } while (size < 0 && errno == EINTR);
+        if (size <= 0) {
+            return traits_type::eof();
+        }
+        setg(buffer_, buffer_, buffer_ + size);
+        return traits_type::to_int_type(buffer_[0]);
+    }
+
+    int_type overflow(int_type ch) override {
+        if (sync() != 0) {
+            return traits_type::eof();
+        }
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    int sync() override {
+        const char* data = pbase();
+        while (data < pptr()) {
+            ssize_t written = write(socket_, data, pptr() - data);
+            if (written < 0 && errno != EINTR) {
+                return -1;
+            }
+            data += std::max<ssize_t>(written, 0);
+        }
+        setp(buffer_, buffer_ + BUFFER_SIZE);
+        return 0;
+    }
+
+private:
+    static constexpr size_t BUFFER_SIZE = 1 << 16;
+
+    int socket_;
+    char buffer_[BUFFER_SIZE];
+};
+#endif
+}  // namespace
+
+SpreadsheetServer::SpreadsheetServer(size_t threads)
+    : workbook_(CreateWorkbook(threads)) {
+    workbook_->AddSheet(DEFAULT_SHEET);
+}
+
+// The calling thread applies the commands the reader thread has queued
+// since the previous round, and writes their responses at once
+void SpreadsheetServer::Serve(std::istream& input, std::ostream& output) {
+    std::mutex queue_mutex;
+    std::condition_variable request_added;
+    std::deque<Request> requests;
+    bool input_ended = false;
+
+    std::thread reader([&] {
+        bool binary = false;
+        auto read = [&] {
+            return binary ? ReadFrame(input) : ReadLine(input);
+        };
+        auto push = [&](Request request) {
+            std::lock_guard lock(queue_mutex);
+            requests.push_back(std::move(request));
+            request_added.notify_one();
+        };
+        try {
+            while (std::optional<std::string> command = read()) {
+                if (*command == "quit") {
+                    break;
+                }
+                Request request{{}, binary, std::nullopt};
+                std::string_view arguments = *command;
+                std::string_view name = TakeWord(arguments);
+                size_t count = 0;
+                auto [end, error] = std::from_chars(arguments.data(), arguments.data() + arguments.size(), count);
+                if (name == "batch" && error == std::errc{} && end == arguments.data() + arguments.size()) {
+                    for (; count > 0; --count) {
+                        std::optional<std::string> batched = read();
+                        if (!batched) {
+                            break;
+                        }
+                        request.commands.push_back(std::move(*batched));
+                    }
+                } else {
+                    binary = binary || name == "binary";
+                    request.commands.push_back(std::move(*command));
+                }
+                push(std::move(request));
+            }
+        } catch (const std::exception& e) {
+            // the rest of the input cannot be parsed, so the connection ends
+            push(Request{{}, binary, "error "s + e.what()});
+        }
+        std::lock_guard lock(queue_mutex);
+        input_ended = true;
+        request_added.notify_one();
+    });
+
+    while (true) {
+        std::deque<Request> round;
+        {
+            std::unique_lock lock(queue_mutex);
+            request_added.wait(lock, [&] {
+                return !requests.empty() || input_ended;
+            });
+            if (requests.empty()) {
+                break;
+            }
+            round.swap(requests);
+        }
+        std::string responses;
+        for (const Request& request : round) {
+            std::lock_guard lock(mutex_);
+            for (const std::string& command : request.commands) {
+                WriteResponse(responses, ExecuteLocked(command), request.binary);
+            }
+            if (request.error) {
+                WriteResponse(responses, *request.error, request.binary);
+            }
+        }
+        output.write(responses.data(), responses.size());
+        output.flush();
+    }
+    reader.join();
+}
+
+void SpreadsheetServer::ServeSocket(const std::string& path) {
+#ifdef _WIN32
+    throw std::system_error(std::make_error_code(std::errc::function_not_supported), "Unix-domain sockets");
+#else
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::system_error(std::make_error_code(std::errc::filename_too_long), path);
+    }
+    std::copy(path.begin(), path.end(), address.sun_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        throw std::system_error(errno, std::generic_category(), "socket");
+    }
+    unlink(path.c_str());
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0
+        || listen(listener, SOMAXCONN) < 0) {
+        int error = errno;
+        close(listener);
+        throw std::system_error(error, std::generic_category(), path);
+    }
+    while (true) {
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            int error = errno;
+            close(listener);
+            throw std::system_error(error, std::generic_category(), "accept");
+        }
+        std::thread([this, connection] {
+            {
+                SocketBuffer input_buffer(connection);
+                SocketBuffer output_buffer(connection);
+                std::istream input(&input_buffer);
+                std::ostream output(&output_buffer);
+                Serve(input, output);
+            }
+            close(connection);
+        }).detach();
+    }
+#endif
+}
+
+std::string SpreadsheetServer::Execute(std::string_view command) {
+    std::lock_guard lock(mutex_);
+    return ExecuteLocked(command);
+}
+
+std::string SpreadsheetServer::ExecuteLocked(std::string_view command) {
+    try {
+        std::string_view arguments = command;
+        std::string_view name = TakeWord(arguments);
+        if (name == "set") {
+            auto [sheet, pos] = ParseCell(TakeWord(arguments));
+            GetSheet(sheet, true)->SetCell(pos, std::string(arguments));
+            return "ok";
+        }
+        if (name == "get") {
+            auto [sheet, pos] = ParseCell(arguments);
+            const CellInterface* cell = GetSheet(sheet, false)->GetCell(pos);
+            std::ostringstream response;
+            response << "ok ";
+            PrintValue(response, cell ? cell->GetValue() : CellInterface::Value(""s));
+            return response.str();
+        }
+        if (name == "clear") {
+            auto [sheet, pos] = ParseCell(arguments);
+            GetSheet(sheet, false)->ClearCell(pos);
+            return "ok";
+        }
+        if (name == "range") {
+            size_t separator = arguments.find(':');
+            if (separator == std::string_view::npos) {
+                throw std::invalid_argument("invalid range " + std::string(arguments));
+            }
+            auto [sheet, top_left] = ParseCell(arguments.substr(0, separator));
+            Position bottom_right = Position::FromString(arguments.substr(separator + 1));
+            Range range{top_left, {bottom_right.row - top_left.row + 1, bottom_right.col - top_left.col + 1}};
+            if (!bottom_right.IsValid() || !range.IsValid()) {
+                throw std::invalid_argument("invalid range " + std::string(arguments));
+            }
+            size_t cells = static_cast<size_t>(range.size.rows) * range.size.cols;
+            if (cells > MAX_RANGE_CELLS) {
+                throw std::length_error("range of "s + std::to_string(cells) + " cells is too large");
+            }
+            std::vector<CellInterface::Value> values(cells);
+            GetSheet(sheet, false)->GetValues(range, values.data());
+            std::ostringstream response;
+            response << "ok " << range.size.rows;
+            for (size_t i = 0; i < values.size(); ++i) {
+                response << (i % range.size.cols == 0 ? '\n' : '\t');
+                PrintValue(response, values[i]);
+            }
+            return response.str();
+        }
+        if (name == "print") {
+            std::ostringstream values;
+            GetSheet(arguments.empty() ? DEFAULT_SHEET : arguments, false)->PrintValues(values);
+            std::string text = values.str();
+            size_t lines = std::count(text.begin(), text.end(), '\n');
+            if (lines != 0) {
+                text.pop_back();
+            }
+            return "ok " + std::to_string(lines) + (lines != 0 ? "\n" + text : "");
+        }
+        if (name == "binary") {
+            return "ok";
+        }
+        return "error unknown command " + std::string(name);
+    } catch (const std::exception& error) {
+        return "error "s + error.what();
+    }
+}
+
+SheetInterface* SpreadsheetServer::GetSheet(std::string_view name, bool add) {
+    if (SheetInterface* sheet = workbook_->GetSheet(name)) {
+        return sheet;
+    }
+    if (!add) {
+        throw std::invalid_argument("no sheet " + std::string(name));
+    }
+    return workbook_->AddSheet(std::string(name));
+}
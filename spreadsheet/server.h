@@ -0,0 +1,67 @@
+#pragma once
+
+#include "common.h"
+
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Keeps a workbook in memory and applies the commands of other processes to
+// it. A connection sends commands one per line, or after the binary command
+// as frames of a 4-byte little-endian length followed by the command. The
+// next commands are read while the previous ones are applied, so a client
+// may send many commands before it reads the responses, which come in the
+// same order and the same framing:
+//   set [Sheet!]A1 text  - ok
+//   get [Sheet!]A1       - ok value
+//   clear [Sheet!]A1     - ok
+//   range [Sheet!]A1:B2  - ok rows, then a line of values separated by tabs per row
+//   print [Sheet]        - ok lines, then the values of the sheet as PrintValues() prints them
+//   batch n              - the responses to the next n commands, which are
+//                          applied together, without commands of other connections
+//   binary               - ok, then frames in both directions
+//   quit                 - ends the connection
+// A failed command is answered with "error" and the message. A frame longer
+// than MAX_FRAME_SIZE or a failed read is answered the same way and ends the
+// connection. A range of more than MAX_RANGE_CELLS cells is refused with an
+// error. Cells without a sheet name belong to Sheet1, set adds the sheets
+// that do not exist.
+class SpreadsheetServer {
+public:
+    static constexpr size_t MAX_FRAME_SIZE = 16 << 20;
+    // the values of a range are read while all other commands wait
+    static constexpr size_t MAX_RANGE_CELLS = 1 << 20;
+
+    // The threads are passed to CreateWorkbook()
+    explicit SpreadsheetServer(size_t threads = 0);
+
+    // Serves one connection until the input ends or quit comes
+    void Serve(std::istream& input, std::ostream& output);
+    // Serves each connection to a Unix-domain socket at the path by its own
+    // thread, until the process ends. Throws std::system_error if the socket
+    // cannot be created.
+    void ServeSocket(const std::string& path);
+
+    // Applies one command, the response is returned without the framing
+    std::string Execute(std::string_view command);
+
+private:
+    // Commands applied together and the framing of their responses
+    struct Request {
+        std::vector<std::string> commands;
+        bool binary = false;
+        // the response to a connection that cannot be read further
+        std::optional<std::string> error;
+    };
+
+    std::string ExecuteLocked(std::string_view command);
+    SheetInterface* GetSheet(std::string_view name, bool add);
+
+    // commands of all connections are applied one request at a time
+    std::mutex mutex_;
+    std::unique_ptr<WorkbookInterface> workbook_;
+};
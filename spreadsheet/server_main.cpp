@@ -0,0 +1,31 @@
+#include "server.h"
+
+#include <csignal>
+#include <exception>
+#include <iostream>
+#include <string_view>
+
+// Serves a workbook over the standard input and output, or over a
+// Unix-domain socket with --socket PATH
+int main(int argc, char* argv[]) {
+    std::ios::sync_with_stdio(false);
+#ifndef _WIN32
+    // a client that goes away ends its connection rather than the server
+    std::signal(SIGPIPE, SIG_IGN);
+#endif
+    try {
+        SpreadsheetServer server;
+        if (argc == 3 && argv[1] == std::string_view("--socket")) {
+            server.ServeSocket(argv[2]);
+        } else if (argc == 1) {
+            server.Serve(std::cin, std::cout);
+        } else {
+            std::cerr << "usage: spreadsheet_server [--socket PATH]" << std::endl;
+            return 1;
+        }
+    } catch (const std::exception& error) {
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
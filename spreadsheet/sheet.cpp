@@ -1,177 +1,1954 @@
 #include "sheet.h"
 
+#include "FormulaAST.h"
 #include "cell.h"
 #include "common.h"
+#include "workbook.h"
 
 #include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <deque>
 #include <functional>
 #include <iostream>
+#include <map>
 #include <optional>
+#include <tuple>
+#include <unordered_set>
+#include <utility>
 
 using namespace std::literals;
 using namespace std;
 
+namespace {
+// Inserts count value-initialized elements before the given index
+template <typename Items>
+void InsertEmpty(Items& items, int index, int count) {
+    if (index >= static_cast<int>(items.size())) {
+        return;
+    }
+    // the new elements are made by the vector, so rows get its allocator
+    items.resize(items.size() + count);
+    std::rotate(items.begin() + index, items.end() - count, items.end());
+}
+
+// Erases at most count elements starting with the given index
+template <typename Items>
+void Erase(Items& items, int index, int count) {
+    int last = std::min(index + count, static_cast<int>(items.size()));
+    if (index < last) {
+        items.erase(items.begin() + index, items.begin() + last);
+    }
+}
+
+// Shorter runs of filled formulas are evaluated cell by cell
+constexpr int MIN_BATCH_ROWS = 4;
+
+// The value of a text cell with the given text
+std::string_view GetTextValue(std::string_view text) {
+    if (!text.empty() && text[0] == ESCAPE_SIGN) {
+        text.remove_prefix(1);
+    }
+    return text;
+}
+
+int64_t GetCellKey(Position pos) {
+    return static_cast<int64_t>(pos.row) * Position::MAX_COLS + pos.col;
+}
+
+constexpr int GOAL_SEEK_ITERATIONS = 100;
+// relative to the target, or absolute for targets closer to zero than 1
+constexpr double GOAL_SEEK_TOLERANCE = 1e-9;
+}  // namespace
+
+Sheet::Sheet(Workbook* workbook, std::string name)
+    : workbook_(workbook)
+    , name_(std::move(name)) {
+}
+
+Sheet::~Sheet() {
+    if (recalculation_thread_.joinable()) {
+        StopRecalculationThread();
+    }
+}
+
 void Sheet::SetCell(Position pos, std::string text) {
     pos.ThrowIfInvalid();
-    int row_number = sheet_.size();
-    int col_number = row_number == 0 ? 0 : sheet_.at(0).size();
-    
-    if (pos.row >= row_number) {
-        sheet_.resize(pos.row + 1); 
-        for (int i = pos.row; i >= row_number; --i) {
-            sheet_[i].resize(col_number);
+    if (writer_locks_ && writer_locks_->exclusive_writer != std::this_thread::get_id()) {
+        {
+            std::shared_lock shared_lock(writer_locks_->sheet);
+            if (TrySetTextConcurrently(pos, text)) {
+                return;
+            }
+        }
+        std::unique_lock exclusive_lock(writer_locks_->sheet);
+        writer_locks_->exclusive_writer = std::this_thread::get_id();
+        try {
+            SetCell(pos, std::move(text));
+        } catch (...) {
+            writer_locks_->exclusive_writer = std::thread::id();
+            throw;
         }
+        writer_locks_->exclusive_writer = std::thread::id();
+        return;
     }
-    if (pos.col >= col_number) {
-        for (auto& row : sheet_) {
-            row.resize(pos.col + 1);
-        }        
+    auto lock = LockValues();
+    EditBatch batch(*this);
+    UpdateCell(pos, [&](Cell& cell) {
+        cell.Set(pos, std::move(text));
+    });
+}
+
+// Creates the cell if needed and applies the update to it
+void Sheet::UpdateCell(Position pos, const std::function<void(Cell&)>& update) {
+    TouchTile(pos);
+    RecheckTileOf(pos);
+    ExpandTileOf(pos);
+    std::optional<EditHistory::CellSnapshot> snapshot;
+    if (history_.IsRecording()) {
+        snapshot = SnapshotCell(pos);
     }
+    GrowGrid(pos);
 
-    if (sheet_[pos.row][pos.col] == nullptr)  {
-        auto cell_getter = [this](Position p) {return GetConcreteCell(p);};
-        sheet_[pos.row][pos.col] = std::make_unique<Cell>(this, cell_getter);
+    bool is_new_cell = sheet_[pos.row][pos.col] == nullptr;
+    if (is_new_cell)  {
+        sheet_[pos.row][pos.col] = MakeCell();
+        // the formulas referring to the position are checked for circular
+        // references through the cell
+        if (auto it = placeholders_.find(pos); it != placeholders_.end()) {
+            sheet_[pos.row][pos.col]->SetDependentCells(std::move(it->second));
+            placeholders_.erase(it);
+            placeholder_cells_.Erase(pos);
+        }
+        occupied_cells_.Insert(pos);
+        UpdatePrintArea();
     }   
     
-    sheet_[pos.row][pos.col]->Set(pos, text);    
+    try {
+        update(*sheet_[pos.row][pos.col]);
+    } catch (...) {
+        if (is_new_cell) {
+            DestroyCell(pos);
+            occupied_cells_.Erase(pos);
+            UpdatePrintArea();
+        }
+        throw;
+    }
+    if (snapshot) {
+        history_.Add(std::move(*snapshot));
+    }
 
-    if ((int)row_to_num_of_cells_.size() <= pos.row) {
-        row_to_num_of_cells_.resize(pos.row + 1);
+    if (is_new_cell) {
+        RebindFormulas(sheet_[pos.row][pos.col]->GetDependentCells());
     }
-    
-    if ((int)column_to_num_of_cells_.size() <= pos.col) {
-        column_to_num_of_cells_.resize(pos.col + 1);
-    }    
-    
-    row_to_num_of_cells_[pos.row]++;
-    column_to_num_of_cells_[pos.col]++;
 
-    print_area_.rows = std::max(print_area_.rows, pos.row);
-    print_area_.cols = std::max(print_area_.cols, pos.col);     
+    RecalculateAfterEdit();
+}
+
+bool Sheet::TrySetTextConcurrently(Position pos, std::string& text) {
+    bool is_formula = text.size() > 1 && text[0] == FORMULA_SIGN;
+    // formulas of other sheets may read any cell, an edit in progress
+    // records this one as its part, and the other features keep state
+    // shared by all cells
+    if (is_formula || workbook_ != nullptr || batch_depth_ > 0 || recalculation_mode_ == RecalculationMode::EagerBackground
+        || tracks_changes_ || compresses_tiles_ || has_compressed_tiles_
+        || pos.row >= static_cast<int>(sheet_.size()) || pos.col >= static_cast<int>(sheet_[pos.row].size())) {
+        return false;
+    }
+    std::lock_guard tile_lock(writer_locks_->tiles[GetTileIndex(pos) % writer_locks_->tiles.size()]);
+    CellPtr& cell = sheet_[pos.row][pos.col];
+    // the dependencies change
+    if (cell != nullptr ? cell->IsReferenced() || cell->GetFormula() != nullptr : placeholders_.count(pos) != 0) {
+        return false;
+    }
+    // taken without SnapshotCell(), which reads the print area
+    std::optional<EditHistory::CellSnapshot> snapshot;
+    if (history_.IsEnabled()) {
+        snapshot.emplace();
+        snapshot->position = pos;
+        if (cell != nullptr) {
+            snapshot->existed = true;
+            snapshot->text = cell->GetText();
+        }
+    }
+    bool is_new_cell = cell == nullptr;
+    if (is_new_cell) {
+        cell = MakeCell();
+    }
+    try {
+        cell->Set(pos, std::move(text));
+    } catch (...) {
+        if (is_new_cell) {
+            cell.reset();
+        }
+        throw;
+    }
+
+    std::lock_guard bookkeeping_lock(writer_locks_->bookkeeping);
+    if (snapshot) {
+        history_.Begin();
+        history_.Add(std::move(*snapshot));
+        history_.Commit();
+    }
+    if (is_new_cell) {
+        occupied_cells_.Insert(pos);
+        UpdatePrintArea();
+    }
+    return true;
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
     pos.ThrowIfInvalid();
-    if (pos.row > print_area_.rows || pos.col > print_area_.cols || sheet_[pos.row][pos.col] == nullptr) {
-        return nullptr;
+    // a what-if scenario holds every cell its formulas read
+    if (const Scenario* scenario = Scenario::GetCurrent()) {
+        if (const CellInterface* cell = scenario->Find(this, pos)) {
+            return cell;
+        }
     }
-    return sheet_[pos.row][pos.col].get();      
+    if (profiler_.IsEnabled()) {
+        profiler_.CountReferenceRead();
+    }
+    TouchTile(pos);
+    return GetConcreteCell(pos);
 }
 
 CellInterface* Sheet::GetCell(Position pos) {
     pos.ThrowIfInvalid();
-    if (pos.row > print_area_.rows || pos.col > print_area_.cols || sheet_[pos.row][pos.col] == nullptr) {
-        return nullptr;
-    }     
-    return sheet_[pos.row][pos.col].get();     
+    TouchTile(pos);
+    return GetConcreteCell(pos);
 }
 
 const Cell* Sheet::GetConcreteCell(Position pos) const {        
     pos.ThrowIfInvalid();
-    if (pos.row > print_area_.rows || pos.col > print_area_.cols || sheet_[pos.row][pos.col] == nullptr) {
+    if (pos.row > print_area_.rows || pos.col > print_area_.cols) {
         return nullptr;
     }
-    return sheet_[pos.row][pos.col].get();    
+    if (has_compressed_tiles_.load(std::memory_order_acquire)) {
+        // other readers may be expanding the tile
+        std::lock_guard lock(tiles_mutex_);
+        if (CellAt(pos) == nullptr) {
+            const_cast<Sheet*>(this)->ExpandTile(GetTileIndex(pos));
+        }
+        // expanding other tiles of the row may move it
+        return CellAt(pos);
+    }
+    return CellAt(pos);
 }
     
 Cell* Sheet::GetConcreteCell(Position pos) {
-    pos.ThrowIfInvalid();
-    if (pos.row > print_area_.rows || pos.col > print_area_.cols || sheet_[pos.row][pos.col] == nullptr) {
+    return const_cast<Cell*>(std::as_const(*this).GetConcreteCell(pos));
+}
+
+const Cell* Sheet::GetConcreteCell(const ExternalCell& cell) const {
+    const Sheet* sheet = workbook_ ? workbook_->FindSheet(cell.sheet) : nullptr;
+    if (sheet == nullptr || !cell.position.IsValid()) {
         return nullptr;
     }
-    return sheet_[pos.row][pos.col].get();      
+    return sheet->GetConcreteCell(cell.position);
 }
 
 void Sheet::ClearCell(Position pos) {
     pos.ThrowIfInvalid();
+    auto lock = LockValues();
     if (pos.row > print_area_.rows || pos.col > print_area_.cols) return;
-    if (sheet_[pos.row][pos.col]) {
-        sheet_[pos.row][pos.col].reset();            
-
-        row_to_num_of_cells_[pos.row]--;
-        column_to_num_of_cells_[pos.col]--;
-
-        for (int i = pos.row; i >= 0; --i) {
-            if (row_to_num_of_cells_[i] == 0) {
-                --print_area_.rows;  
-            } else {
-                break;
-            }
+    TouchTile(pos);
+    RecheckTileOf(pos);
+    ExpandTileOf(pos);
+    if (CellAt(pos)) {
+        EditBatch batch(*this);
+        if (history_.IsRecording()) {
+            history_.Add(SnapshotCell(pos));
         }
-
-        for (int i = pos.col; i >= 0; --i) {
-            if (column_to_num_of_cells_[i] == 0) {
-                --print_area_.cols;  
-            } else {
-                break;
-            }
-        }             
+        sheet_[pos.row][pos.col]->Clear();
+        DestroyCell(pos);
+        occupied_cells_.Erase(pos);
+        UpdatePrintArea();
+        RecalculateAfterEdit();
     }          
 }
 
 Size Sheet::GetPrintableSize() const {  return {print_area_.rows + 1, print_area_.cols + 1}; }
 
+void Sheet::UpdatePrintArea() {
+    Size size = occupied_cells_.GetBoundingSize();
+    print_area_ = {size.rows - 1, size.cols - 1};
+}
+
 std::ostream& Sheet::PrintValue (std::ostream &os, const Value& value) const {
     if (std::holds_alternative<std::string>(value)) {
         return os << std::get<std::string>(value);
     } else if (std::holds_alternative<double>(value)) {
         return os << std::get<double>(value);
     } else {
-        return os << "#ARITHM!";
+        return os << std::get<FormulaError>(value);
     }    
 }
 
 void Sheet::PrintValues(std::ostream& output) const {
-    if (print_area_ == Size{-1, -1}) {        
-        return;
-    }
-    for (int i = 0; i <= print_area_.rows; ++i ) {
-         bool is_first = true;
-        for (int j = 0; j <= print_area_.cols; ++j ) {
-           
-            if (is_first) {
-                if (sheet_[i][j] == nullptr) {
-                    output << ""s;                        
-                } else {                    
-                    PrintValue(output, sheet_[i][j]->GetValue());
+    PrintRange(output, {{0, 0}, GetPrintableSize()}, [&](const Cell* cell, std::string_view text, const Value* value) {
+        PrintCellValue(output, cell, text, value);
+    });
+}
+
+void Sheet::PrintTexts(std::ostream& output) const {
+    PrintRange(output, {{0, 0}, GetPrintableSize()}, [&](const Cell* cell, std::string_view text,
+                                                         const Value* /* value */) {
+        if (cell != nullptr) {
+            output << cell->GetText();
+        } else {
+            output << text;
+        }
+    });
+}
+
+void Sheet::GetValues(Range range, CellInterface::Value* values) const {
+    range.ThrowIfInvalid();
+    auto lock = LockValues();
+    std::fill_n(values, range.size.rows * range.size.cols, Value(""s));
+    ForEachCell(range, [&](Position pos, const Cell* cell, std::string_view text, const Value* compressed_value) {
+        Value& value = values[(pos.row - range.top_left.row) * range.size.cols + pos.col - range.top_left.col];
+        if (cell != nullptr) {
+            value = cell->GetValue();
+        } else if (compressed_value != nullptr) {
+            value = *compressed_value;
+        } else {
+            value = std::string(GetTextValue(text));
+        }
+    });
+}
+
+void Sheet::PrintValues(std::ostream& output, Range range) const {
+    range.ThrowIfInvalid();
+    auto lock = LockValues();
+    PrintRange(output, range, [&](const Cell* cell, std::string_view text, const Value* value) {
+        PrintCellValue(output, cell, text, value);
+    });
+}
+
+void Sheet::PrintCellValue(std::ostream& output, const Cell* cell, std::string_view text, const Value* value) const {
+    if (cell != nullptr) {
+        PrintValue(output, cell->GetValue());
+    } else if (value != nullptr) {
+        PrintValue(output, *value);
+    } else {
+        output << GetTextValue(text);
+    }
+}
+
+void Sheet::ForEachCell(Range range, const CellVisitor& visit) const {
+    if (!has_compressed_tiles_.load(std::memory_order_acquire)) {
+        occupied_cells_.ForEach(range, [&](Position pos) {
+            visit(pos, CellAt(pos), {}, nullptr);
+        });
+        return;
+    }
+    // the texts of compressed tiles are decoded without expanding them. The
+    // visitor may read cells, which expands tiles, so the cells are
+    // collected under the lock and visited after it.
+    std::unordered_map<int64_t, std::pair<std::string, std::optional<Value>>> compressed_cells;
+    std::vector<std::tuple<Position, const Cell*, const std::pair<std::string, std::optional<Value>>*>> cells;
+    {
+        std::lock_guard lock(tiles_mutex_);
+        int last_row = std::min(range.top_left.row + range.size.rows - 1, print_area_.rows);
+        int last_col = std::min(range.top_left.col + range.size.cols - 1, print_area_.cols);
+        for (int row = range.top_left.row & -TILE_SIZE; row <= last_row; row += TILE_SIZE) {
+            for (int col = range.top_left.col & -TILE_SIZE; col <= last_col; col += TILE_SIZE) {
+                const CompressedTile* tile = compressed_tiles_.Find(GetTileIndex({row, col}));
+                if (tile == nullptr) {
+                    continue;
                 }
-                is_first = false;
-            } else {
+                tile->ForEach([&](Position offset, std::string_view text, const Value* value) {
+                    compressed_cells.emplace(GetCellKey({row + offset.row, col + offset.col}),
+                                             std::pair{std::string(text), value ? std::optional(*value) : std::nullopt});
+                });
+            }
+        }
+        occupied_cells_.ForEach(range, [&](Position pos) {
+            const Cell* cell = CellAt(pos);
+            cells.emplace_back(pos, cell, cell != nullptr ? nullptr : &compressed_cells.at(GetCellKey(pos)));
+        });
+    }
+    for (const auto& [pos, cell, compressed] : cells) {
+        if (compressed == nullptr) {
+            visit(pos, cell, {}, nullptr);
+        } else {
+            visit(pos, cell, compressed->first, compressed->second ? &*compressed->second : nullptr);
+        }
+    }
+}
+
+void Sheet::PrintRange(std::ostream& output, Range range, const PrintVisitor& print) const {
+    // the column of the range the output stopped at
+    int row = 0;
+    int col = 0;
+    auto move_to = [&](int next_row, int next_col) {
+        for (; row < next_row; ++row, col = 0) {
+            for (; col < range.size.cols - 1; ++col) {
                 output << '\t';
-                if (sheet_[i][j] == nullptr) {
-                    output << ""s;                        
-                } else {
-                    PrintValue(output, sheet_[i][j]->GetValue());   
-                }
-                
             }
+            output << '\n';
+        }
+        for (; col < next_col; ++col) {
+            output << '\t';
+        }
+    };
+    ForEachCell(range, [&](Position pos, const Cell* cell, std::string_view text, const Value* value) {
+        move_to(pos.row - range.top_left.row, pos.col - range.top_left.col);
+        print(cell, text, value);
+    });
+    move_to(range.size.rows, 0);
+}
+
+void Sheet::InsertRows(int before, int count) {
+    ApplyStructuralChange({StructuralChange::Type::InsertRows, before, count});
+}
+
+void Sheet::InsertColumns(int before, int count) {
+    ApplyStructuralChange({StructuralChange::Type::InsertColumns, before, count});
+}
+
+void Sheet::DeleteRows(int first, int count) {
+    ApplyStructuralChange({StructuralChange::Type::DeleteRows, first, count});
+}
+
+void Sheet::DeleteColumns(int first, int count) {
+    ApplyStructuralChange({StructuralChange::Type::DeleteColumns, first, count});
+}
+
+void Sheet::CopyRange(Range source, Position destination) {
+    source.ThrowIfInvalid();
+    Range{destination, source.size}.ThrowIfInvalid();
+    auto lock = LockValues();
+
+    // the contents are taken before anything is written as the ranges may overlap
+    struct Content {
+        std::string text;
+        std::unique_ptr<FormulaInterface> formula;
+    };
+    int row_shift = destination.row - source.top_left.row;
+    int col_shift = destination.col - source.top_left.col;
+    std::vector<Content> contents(source.size.rows * source.size.cols);
+    occupied_cells_.ForEach(source, [&](Position pos) {
+        const Cell& cell = *GetConcreteCell(pos);
+        Content& content = contents[(pos.row - source.top_left.row) * source.size.cols
+                                    + pos.col - source.top_left.col];
+        if (const FormulaInterface* formula = cell.GetFormula()) {
+            MemoryScope scope(memory_, MemoryCategory::Formulas);
+            content.formula = formula->Clone(row_shift, col_shift);
+        } else {
+            content.text = cell.GetText();
+        }
+    });
+
+    std::vector<CopiedCell> cells;
+    cells.reserve(contents.size());
+    auto content = contents.begin();
+    for (int i = 0; i < source.size.rows; ++i) {
+        for (int j = 0; j < source.size.cols; ++j, ++content) {
+            cells.push_back({{destination.row + i, destination.col + j},
+                             std::move(content->text), std::move(content->formula)});
         }
-        output << '\n';
     }
+    PasteCells(cells);
 }
-void Sheet::PrintTexts(std::ostream& output) const {
-    for (int i = 0; i <= print_area_.rows; ++i ) {
-        bool is_first = true;
-        for (int j = 0; j <= print_area_.cols; ++j ) {
-            
-            if (is_first) {
-                if (sheet_[i][j] == nullptr) {
-                    output << ""s;                        
+
+void Sheet::FillDown(Range range) {
+    range.ThrowIfInvalid();
+    auto lock = LockValues();
+    if (range.size.rows < 2) {
+        return;
+    }
+    // the first row is read once, each row below gets its own copy
+    std::vector<const Cell*> first_row(range.size.cols);
+    occupied_cells_.ForEach({range.top_left, {1, range.size.cols}}, [&](Position pos) {
+        first_row[pos.col - range.top_left.col] = GetConcreteCell(pos);
+    });
+    std::vector<CopiedCell> cells;
+    cells.reserve((range.size.rows - 1) * range.size.cols);
+    for (int i = 1; i < range.size.rows; ++i) {
+        for (int j = 0; j < range.size.cols; ++j) {
+            CopiedCell& copied = cells.emplace_back();
+            copied.position = {range.top_left.row + i, range.top_left.col + j};
+            if (const Cell* cell = first_row[j]) {
+                if (const FormulaInterface* formula = cell->GetFormula()) {
+                    MemoryScope scope(memory_, MemoryCategory::Formulas);
+                    copied.formula = formula->Clone(i, 0);
                 } else {
-                    output << sheet_[i][j]->GetText();   
+                    copied.text = cell->GetText();
                 }
-                is_first = false;
+            }
+        }
+    }
+    PasteCells(cells);
+}
+
+void Sheet::PasteCells(std::vector<CopiedCell>& cells) {
+    EditBatch batch(*this);
+    size_t recorded_steps = history_.GetStepCount();
+    std::vector<EditHistory::CellSnapshot> written;
+    deferred_invalidations_.emplace();
+    try {
+        for (CopiedCell& copied : cells) {
+            Position pos = copied.position;
+            EditHistory::CellSnapshot snapshot = SnapshotCell(pos);
+            if (copied.formula) {
+                UpdateCell(pos, [&](Cell& cell) {
+                    cell.SetFormula(pos, std::move(copied.formula));
+                });
+            } else if (copied.text.empty()) {
+                ClearCell(pos);
             } else {
-                output << '\t';
-                if (sheet_[i][j] == nullptr) {
-                    output << ""s;                        
-                } else {
-                    output <<sheet_[i][j]->GetText();  
+                UpdateCell(pos, [&](Cell& cell) {
+                    cell.Set(pos, std::move(copied.text));
+                });
+            }
+            written.push_back(std::move(snapshot));
+        }
+    } catch (...) {
+        // restored in reverse, each state on the way back was valid on the way there
+        deferred_invalidations_.reset();
+        for (auto snapshot = written.rbegin(); snapshot != written.rend(); ++snapshot) {
+            RestoreCell(*snapshot);
+        }
+        history_.Truncate(recorded_steps);
+        throw;
+    }
+    std::vector<ChangedCell> changed;
+    for (Position pos : *deferred_invalidations_) {
+        changed.emplace_back(pos, GetConcreteCell(pos));
+    }
+    deferred_invalidations_.reset();
+    InvalidateDependents(changed);
+}
+
+bool Sheet::Undo() {
+    auto lock = LockValues();
+    auto record = history_.StartUndo();
+    if (!record) {
+        return false;
+    }
+    Replay(*record);
+    return true;
+}
+
+bool Sheet::Redo() {
+    auto lock = LockValues();
+    auto record = history_.StartRedo();
+    if (!record) {
+        return false;
+    }
+    Replay(*record);
+    return true;
+}
+
+void Sheet::SetUndoMemoryLimit(size_t bytes) {
+    history_.SetMemoryLimit(bytes);
+}
+
+void Sheet::SetLazyFormulaCompilation(bool enabled) {
+    lazy_formula_compilation_ = enabled;
+}
+
+void Sheet::SetSubexpressionSharing(bool enabled) {
+    auto lock = LockValues();
+    if (enabled == (subexpressions_ != nullptr)) {
+        return;
+    }
+    subexpressions_ = enabled ? std::make_unique<SubexpressionTable>(this) : nullptr;
+    ShareFormulaSubexpressions();
+}
+
+void Sheet::SetConcurrentWrites(bool enabled) {
+    writer_locks_ = enabled ? std::make_unique<WriterLocks>() : nullptr;
+}
+
+void Sheet::ReshareSubexpressions() {
+    if (subexpressions_) {
+        auto lock = LockValues();
+        // the values of subexpressions still in use are recalculated
+        subexpressions_->Clear();
+        ShareFormulaSubexpressions();
+    }
+}
+
+void Sheet::ShareFormulaSubexpressions() {
+    MemoryScope scope(memory_, MemoryCategory::Formulas);
+    occupied_cells_.ForEach({{0, 0}, GetPrintableSize()}, [&](Position pos) {
+        // compressed formulas share the subexpressions when they are expanded
+        const Cell* cell = CellAt(pos);
+        if (cell == nullptr) {
+            return;
+        }
+        if (auto formula = cell->GetFormulaHandle()) {
+            formula->ShareSubexpressions(subexpressions_.get());
+        }
+    });
+}
+
+// Reverts the steps of the record, the edits made for that are recorded as
+// the record that reverts them back
+void Sheet::Replay(EditHistory::Record& record) {
+    EditBatch batch(*this);
+    for (auto step = record.rbegin(); step != record.rend(); ++step) {
+        if (auto* snapshot = std::get_if<EditHistory::CellSnapshot>(&*step)) {
+            RestoreCell(*snapshot);
+        } else {
+            ApplyStructuralChange(std::get<StructuralChange>(*step).Inverse());
+        }
+    }
+}
+
+EditHistory::CellSnapshot Sheet::SnapshotCell(Position pos) const {
+    EditHistory::CellSnapshot snapshot;
+    snapshot.position = pos;
+    if (const Cell* cell = GetConcreteCell(pos)) {
+        snapshot.existed = true;
+        snapshot.formula = cell->GetFormulaHandle();
+        if (!snapshot.formula) {
+            snapshot.text = cell->GetText();
+        }
+    }
+    return snapshot;
+}
+
+// Deleted cells and the formulas that lose references to them are restored
+// after the deletion is reverted
+void Sheet::RecordDeletedCells(const std::vector<Cell*>& deleted_cells, const StructuralChange& change) {
+    std::set<Position> deleted_positions;
+    for (const Cell* cell : deleted_cells) {
+        deleted_positions.insert(cell->GetPosition());
+        history_.Add(SnapshotCell(cell->GetPosition()));
+    }
+    std::set<Position> dependent_positions;
+    for (const Cell* cell : deleted_cells) {
+        for (Position pos : cell->GetDependentCells()) {
+            if (deleted_positions.count(pos) == 0) {
+                dependent_positions.insert(pos);
+            }
+        }
+    }
+    placeholder_cells_.ForEach({change.GetMovedRange().top_left, change.IsRowChange()
+                                    ? Size{change.count, Position::MAX_COLS}
+                                    : Size{Position::MAX_ROWS, change.count}}, [&](Position placeholder) {
+        for (Position pos : placeholders_.at(placeholder)) {
+            if (change.Apply(pos).IsValid()) {
+                dependent_positions.insert(pos);
+            }
+        }
+    });
+    for (Position pos : dependent_positions) {
+        auto snapshot = SnapshotCell(pos);
+        // the deletion rewrites the formula in place, so a copy is kept
+        if (snapshot.formula) {
+            MemoryScope scope(memory_, MemoryCategory::Formulas);
+            snapshot.formula = snapshot.formula->Clone(0, 0);
+        }
+        history_.Add(std::move(snapshot));
+    }
+}
+
+void Sheet::RestoreCell(EditHistory::CellSnapshot& snapshot) {
+    Position pos = snapshot.position;
+    if (!snapshot.existed) {
+        ClearCell(pos);
+    } else if (snapshot.formula) {
+        UpdateCell(pos, [&](Cell& cell) {
+            cell.SetFormula(pos, std::move(snapshot.formula));
+        });
+    } else {
+        UpdateCell(pos, [&](Cell& cell) {
+            cell.Set(pos, std::move(snapshot.text));
+        });
+    }
+}
+
+void Sheet::ApplyStructuralChange(const StructuralChange& change) {
+    int limit = change.IsRowChange() ? Position::MAX_ROWS : Position::MAX_COLS;
+    if (change.first < 0 || change.first >= limit || change.count < 0) {
+        throw InvalidPositionException("invalid position");
+    }
+    auto lock = LockValues();
+    ExpandTilesMovedBy(change);
+    // references to positions without cells move too
+    Size placeholders_size = placeholder_cells_.GetBoundingSize();
+    int last = change.IsRowChange() ? std::max(print_area_.rows, placeholders_size.rows - 1)
+                                    : std::max(print_area_.cols, placeholders_size.cols - 1);
+    if (change.count == 0 || change.first > last) {
+        return;
+    }
+    if (!change.IsDeletion() && last + change.count >= limit) {
+        throw TableTooBigException("cells would move beyond the table");
+    }
+
+    EditBatch batch(*this);
+    incompressible_tiles_.clear();
+    std::vector<Cell*> deleted_cells;
+    std::vector<Position> affected_placeholders;
+    std::vector<Cell*> affected_cells = CollectCellsAffectedBy(change, deleted_cells, affected_placeholders);
+    if (history_.IsRecording()) {
+        RecordDeletedCells(deleted_cells, change);
+    }
+    history_.Add(change);
+    for (Cell* cell : deleted_cells) {
+        cell->DetachExternalCells();
+    }
+    occupied_cells_.HandleStructuralChange(change);
+    UpdatePrintArea();
+    MoveCells(change);
+    MovePlaceholders(change, affected_placeholders);
+
+    std::vector<Cell*> cells_to_recalculate;
+    for (Cell* cell : affected_cells) {
+        if (cell->HandleStructuralChange(change)) {
+            cells_to_recalculate.push_back(cell);
+        }
+    }
+    // shared subexpressions refer to the cells by their old positions
+    ReshareSubexpressions();
+
+    std::set<Position> dirty_cells;
+    for (Position pos : dirty_cells_) {
+        Position moved = change.Apply(pos);
+        if (moved.IsValid()) {
+            dirty_cells.insert(dirty_cells.end(), moved);
+        }
+    }
+    dirty_cells_ = std::move(dirty_cells);
+    MoveTrackedChanges(change);
+
+    for (Cell* cell : cells_to_recalculate) {
+        cell->InvalidateCache();
+    }
+    if (workbook_) {
+        workbook_->HandleStructuralChange(*this, change);
+    }
+    RecalculateAfterEdit();
+}
+
+// Returns the cells that move along with their neighbours in the dependency
+// graph, the positions stored in those neighbours have to be updated too.
+// Deleted cells are returned separately.
+std::vector<Cell*> Sheet::CollectCellsAffectedBy(const StructuralChange& change,
+                                                 std::vector<Cell*>& deleted_cells,
+                                                 std::vector<Position>& affected_placeholders) {
+    std::unordered_set<Cell*> affected_cells;
+    auto add_cells = [&](const auto& positions) {
+        for (Position pos : positions) {
+            if (Cell* cell = GetConcreteCell(pos)) {
+                affected_cells.insert(cell);
+            }
+        }
+    };
+
+    std::set<Position> placeholders;
+    occupied_cells_.ForEach(change.GetMovedRange(), [&](Position pos) {
+        Cell* cell = CellAt(pos);
+        if (change.Apply(pos).IsValid()) {
+            affected_cells.insert(cell);
+        } else {
+            deleted_cells.push_back(cell);
+        }
+        add_cells(cell->GetDependentCells());
+        add_cells(cell->GetReferencedCells());
+        // the placeholders the moved formulas refer to keep their positions
+        for (Position referenced : cell->GetReferencedCells()) {
+            if (placeholder_cells_.Contains(referenced)) {
+                placeholders.insert(referenced);
+            }
+        }
+    });
+    placeholder_cells_.ForEach(change.GetMovedRange(), [&](Position pos) {
+        add_cells(placeholders_.at(pos));
+        placeholders.insert(pos);
+    });
+    affected_placeholders.assign(placeholders.begin(), placeholders.end());
+
+    for (Cell* cell : deleted_cells) {
+        affected_cells.erase(cell);
+    }
+    return {affected_cells.begin(), affected_cells.end()};
+}
+
+// Shifts the storage, deleted cells are destroyed
+// Rows and columns past the printable area are not kept
+void Sheet::MoveCells(const StructuralChange& change) {
+    switch (change.type) {
+        case StructuralChange::Type::InsertRows:
+            InsertEmpty(sheet_, change.first, change.count);
+            if (static_cast<int>(sheet_.size()) > print_area_.rows + 1) {
+                sheet_.resize(print_area_.rows + 1);
+            }
+            break;
+        case StructuralChange::Type::InsertColumns:
+            for (auto& row : sheet_) {
+                InsertEmpty(row, change.first, change.count);
+                if (static_cast<int>(row.size()) > print_area_.cols + 1) {
+                    row.resize(print_area_.cols + 1);
                 }
-                
             }
+            break;
+        case StructuralChange::Type::DeleteRows:
+            Erase(sheet_, change.first, change.count);
+            break;
+        case StructuralChange::Type::DeleteColumns:
+            for (auto& row : sheet_) {
+                Erase(row, change.first, change.count);
+            }
+            break;
+    }
+}
+
+// Moves the placeholders and their dependents like cells, the deleted ones
+// are dropped
+void Sheet::MovePlaceholders(const StructuralChange& change, const std::vector<Position>& affected) {
+    std::vector<std::pair<Position, Cell::PositionSet>> moved_placeholders;
+    for (Position pos : affected) {
+        auto node = placeholders_.extract(pos);
+        placeholder_cells_.Erase(pos);
+        Position moved = change.Apply(pos);
+        if (!moved.IsValid()) {
+            continue;
+        }
+        Cell::PositionSet moved_dependents(node.mapped().get_allocator());
+        for (Position dependent : node.mapped()) {
+            // the change keeps the order of positions that are not deleted
+            Position moved_dependent = change.Apply(dependent);
+            if (moved_dependent.IsValid()) {
+                moved_dependents.insert(moved_dependents.end(), moved_dependent);
+            }
+        }
+        if (!moved_dependents.empty()) {
+            moved_placeholders.emplace_back(moved, std::move(moved_dependents));
+        }
+    }
+    // moved placeholders may take the places of the ones not yet moved
+    for (auto& [pos, dependents] : moved_placeholders) {
+        placeholders_.emplace(pos, std::move(dependents));
+        placeholder_cells_.Insert(pos);
+    }
+}
+
+// Rows are as long as their last cell needs, concurrent writers grow the
+// rows of a tile a tile at a time, as growing them excludes the other writers
+void Sheet::GrowGrid(Position pos) {
+    int new_row_number = writer_locks_ ? (pos.row | (TILE_SIZE - 1)) + 1 : pos.row + 1;
+    int new_col_number = writer_locks_ ? (pos.col | (TILE_SIZE - 1)) + 1 : pos.col + 1;
+    if (pos.row >= static_cast<int>(sheet_.size())) {
+        sheet_.resize(new_row_number);
+    }
+    int first_row = writer_locks_ ? pos.row & -TILE_SIZE : pos.row;
+    for (int row = first_row; row < new_row_number && row < static_cast<int>(sheet_.size()); ++row) {
+        if (static_cast<int>(sheet_[row].size()) < new_col_number && (row == pos.row || writer_locks_)) {
+            sheet_[row].resize(new_col_number);
+        }
+    }
+}
+
+Cell* Sheet::CellAt(Position pos) const {
+    if (pos.row >= static_cast<int>(sheet_.size())) {
+        return nullptr;
+    }
+    const CellRow& row = sheet_[pos.row];
+    return pos.col < static_cast<int>(row.size()) ? row[pos.col].get() : nullptr;
+}
+
+// Frees the ends of rows that only compressed tiles occupy
+void Sheet::ReleaseRows(int first, int count) {
+    for (int i = first; i < first + count && i < static_cast<int>(sheet_.size()); ++i) {
+        CellRow& row = sheet_[i];
+        size_t size = row.size();
+        while (size > 0 && row[size - 1] == nullptr) {
+            --size;
+        }
+        if (size < row.size()) {
+            row.resize(size);
+            row.shrink_to_fit();
+        }
+    }
+}
+
+void Sheet::SetRecalculationMode(RecalculationMode mode) {
+    if (mode == recalculation_mode_) {
+        return;
+    }
+    if (recalculation_mode_ == RecalculationMode::EagerBackground) {
+        StopRecalculationThread();
+        if (workbook_) {
+            workbook_->SetBackgroundRecalculation(false);
+        }
+    }
+    // outdated cells are not tracked in the lazy mode
+    if (recalculation_mode_ == RecalculationMode::Lazy) {
+        CollectStaleCells();
+    }
+    recalculation_mode_ = mode;
+
+    switch (mode) {
+        case RecalculationMode::Lazy:
+            dirty_cells_.clear();
+            break;
+        case RecalculationMode::EagerSync:
+            RecalculateDirtyCells();
+            break;
+        case RecalculationMode::EagerBackground:
+            if (workbook_) {
+                workbook_->SetBackgroundRecalculation(true);
+            }
+            StartRecalculationThread();
+            break;
+        case RecalculationMode::Manual:
+            break;
+    }
+}
+
+RecalculationMode Sheet::GetRecalculationMode() const {
+    return recalculation_mode_;
+}
+
+void Sheet::Recalculate() {
+    auto lock = LockValues();
+    if (recalculation_mode_ == RecalculationMode::Lazy) {
+        CollectStaleCells();
+    }
+    RecalculateDirtyCells();
+    ReportChanges(true);
+}
+
+void Sheet::SetChangeTracking(bool enabled, ChangeListener listener) {
+    auto lock = LockValues();
+    tracks_changes_ = enabled;
+    change_listener_ = enabled ? std::move(listener) : nullptr;
+    possible_changes_.clear();
+    changed_cells_.clear();
+}
+
+std::vector<Position> Sheet::TakeChangedCells() {
+    auto lock = LockValues();
+    if (tracks_changes_ && !change_listener_) {
+        ReportChanges(true);
+    }
+    std::vector<Position> result(changed_cells_.begin(), changed_cells_.end());
+    changed_cells_.clear();
+    return result;
+}
+
+void Sheet::ReportChanges(bool evaluate) {
+    if (possible_changes_.empty()) {
+        return;
+    }
+    // the listener may edit the sheet, which records new possible changes
+    auto possible_changes = std::move(possible_changes_);
+    possible_changes_.clear();
+    std::vector<Position> changed;
+    for (auto& [pos, old_value] : possible_changes) {
+        const Cell* cell = GetConcreteCell(pos);
+        // the manual mode serves the outdated value until Recalculate()
+        if (cell != nullptr && cell->IsStale() && (!evaluate || ServesStaleValues())) {
+            possible_changes_.insert(possible_changes_.end(), {pos, std::move(old_value)});
+            continue;
+        }
+        Value value = cell != nullptr ? cell->GetValue() : Value{""};
+        if (!old_value || !(*old_value == value)) {
+            changed.push_back(pos);
+        }
+    }
+    if (changed.empty()) {
+        return;
+    }
+    if (change_listener_) {
+        change_listener_(changed);
+    } else {
+        changed_cells_.insert(changed.begin(), changed.end());
+    }
+}
+
+void Sheet::MoveTrackedChanges(const StructuralChange& change) {
+    std::map<Position, std::optional<Value>> possible_changes;
+    for (auto& [pos, old_value] : possible_changes_) {
+        Position moved = change.Apply(pos);
+        if (moved.IsValid()) {
+            possible_changes.insert(possible_changes.end(), {moved, std::move(old_value)});
+        }
+    }
+    possible_changes_ = std::move(possible_changes);
+
+    std::set<Position> changed_cells;
+    for (Position pos : changed_cells_) {
+        Position moved = change.Apply(pos);
+        if (moved.IsValid()) {
+            changed_cells.insert(changed_cells.end(), moved);
         }
-        output << '\n';
+    }
+    changed_cells_ = std::move(changed_cells);
+}
+
+void Sheet::ScheduleRecalculation(const std::vector<Position>& cells) {
+    if (recalculation_mode_ != RecalculationMode::Lazy) {
+        dirty_cells_.insert(cells.begin(), cells.end());
+    }
+}
+
+bool Sheet::ServesStaleValues() const {
+    return recalculation_mode_ == RecalculationMode::Manual && !recalculating_;
+}
+
+std::unique_lock<std::recursive_mutex> Sheet::LockValues() const {
+    bool background = workbook_ ? workbook_->HasBackgroundRecalculation()
+                                : recalculation_mode_ == RecalculationMode::EagerBackground;
+    if (background) {
+        return std::unique_lock(GetValuesMutex());
+    }
+    return {};
+}
+
+std::recursive_mutex& Sheet::GetValuesMutex() const {
+    return workbook_ ? workbook_->GetValuesMutex() : values_mutex_;
+}
+
+void Sheet::RecalculateAfterEdit() {
+    if (batch_depth_ > 0) {
+        return;
+    }
+    if (recalculation_mode_ == RecalculationMode::EagerSync) {
+        RecalculateDirtyCells();
+    } else if (recalculation_mode_ == RecalculationMode::EagerBackground && !dirty_cells_.empty()) {
+        dirty_cells_added_.notify_one();
+    }
+    // without a listener the changes are found when they are taken
+    if (change_listener_) {
+        ReportChanges(false);
+    }
+    if (compresses_tiles_) {
+        CompressTilesAfterEdit();
+    }
+}
+
+void Sheet::RecalculateDirtyCells() {
+    // a dirty cell may have been read since it went out of date, in the manual
+    // mode such a read used outdated values of other dirty cells
+    for (Position pos : dirty_cells_) {
+        if (const Cell* cell = GetConcreteCell(pos)) {
+            cell->MarkStale();
+        }
+    }
+    recalculating_ = true;
+    if (!profiler_.IsEnabled()) {
+        EvaluateRowBatches();
+    }
+    while (!dirty_cells_.empty()) {
+        Position pos = *dirty_cells_.begin();
+        dirty_cells_.erase(dirty_cells_.begin());
+        if (const Cell* cell = GetConcreteCell(pos)) {
+            cell->GetValue();
+        }
+    }
+    recalculating_ = false;
+}
+
+// Finds runs of dirty formulas filled down a column, like B1=A1*2, B2=A2*2,
+// B3=A3*2, and evaluates each run at once
+void Sheet::EvaluateRowBatches() {
+    std::map<int, std::vector<int>> rows_by_column;
+    for (Position pos : dirty_cells_) {
+        rows_by_column[pos.col].push_back(pos.row);
+    }
+    for (const auto& [col, rows] : rows_by_column) {
+        size_t start = 0;
+        while (start < rows.size()) {
+            size_t end = start + 1;
+            // cells of the column may have been calculated for an earlier run
+            const Cell* first = GetConcreteCell({rows[start], col});
+            if (first != nullptr && first->IsStale()) {
+                const FormulaInterface& formula = *first->GetFormula();
+                while (end < rows.size() && rows[end] == rows[start] + static_cast<int>(end - start)) {
+                    const Cell* cell = GetConcreteCell({rows[end], col});
+                    if (cell == nullptr || !cell->IsStale()
+                        || !cell->GetFormula()->IsShiftedCopyOf(formula, end - start, 0)) {
+                        break;
+                    }
+                    ++end;
+                }
+            }
+            if (end - start >= MIN_BATCH_ROWS) {
+                EvaluateRowBatch({rows[start], col}, end - start);
+            }
+            start = end;
+        }
+    }
+}
+
+void Sheet::EvaluateRowBatch(Position first, int rows) {
+    const Cell* cell = GetConcreteCell(first);
+    // a run that reads its own cells, like a running total, is a chain
+    // and is left to the evaluation cell by cell
+    for (Position referenced : cell->GetReferencedCells()) {
+        if (referenced.col == first.col && referenced.row > first.row - rows && referenced.row < first.row + rows) {
+            return;
+        }
+    }
+    auto values = cell->GetFormula()->EvaluateRows(*this, rows);
+    for (int i = 0; i < rows; ++i) {
+        Position pos{first.row + i, first.col};
+        if (std::holds_alternative<double>(values[i])) {
+            GetConcreteCell(pos)->SetCalculatedValue(std::get<double>(values[i]));
+        } else {
+            GetConcreteCell(pos)->SetCalculatedValue(std::get<FormulaError>(values[i]));
+        }
+        dirty_cells_.erase(pos);
+    }
+}
+
+void Sheet::CollectStaleCells() {
+    occupied_cells_.ForEach({{0, 0}, GetPrintableSize()}, [&](Position pos) {
+        // compressed formulas are up to date
+        const Cell* cell = CellAt(pos);
+        if (cell != nullptr && cell->IsStale()) {
+            dirty_cells_.insert(dirty_cells_.end(), pos);
+        }
+    });
+}
+
+void Sheet::StartRecalculationThread() {
+    stop_recalculation_thread_ = false;
+    recalculation_thread_ = std::thread([this] {
+        RunRecalculationThread();
+    });
+}
+
+void Sheet::StopRecalculationThread() {
+    {
+        std::lock_guard lock(GetValuesMutex());
+        stop_recalculation_thread_ = true;
+    }
+    dirty_cells_added_.notify_one();
+    recalculation_thread_.join();
+}
+
+void Sheet::RunRecalculationThread() {
+    std::unique_lock lock(GetValuesMutex());
+    while (true) {
+        dirty_cells_added_.wait(lock, [this] {
+            return stop_recalculation_thread_ || !dirty_cells_.empty();
+        });
+        if (stop_recalculation_thread_) {
+            return;
+        }
+        Position pos = *dirty_cells_.begin();
+        dirty_cells_.erase(dirty_cells_.begin());
+        if (const Cell* cell = GetConcreteCell(pos)) {
+            cell->GetValue();
+        }
+        if (dirty_cells_.empty() && change_listener_) {
+            ReportChanges(false);
+        }
+        // one cell at a time, so writers and readers are not kept waiting
+        lock.unlock();
+        std::this_thread::yield();
+        lock.lock();
+    }
+}
+
+void Sheet::SetProfilingEnabled(bool enabled) {
+    profiler_.SetEnabled(enabled);
+}
+
+std::vector<CellProfile> Sheet::GetProfile(size_t top_n) const {
+    std::vector<CellProfile> result;
+    for (CellProfile& profile : profiler_.GetProfiles()) {
+        if (result.size() == top_n) {
+            break;
+        }
+        // the statistics outlive cells that were cleared or stopped being formulas
+        const Cell* cell = GetConcreteCell(profile.position);
+        if (cell == nullptr) {
+            continue;
+        }
+        std::string text = cell->GetText();
+        if (text.empty() || text[0] != FORMULA_SIGN) {
+            continue;
+        }
+        profile.expression = text.substr(1);
+        result.push_back(std::move(profile));
+    }
+    return result;
+}
+
+namespace {
+void AddToHistogram(std::vector<size_t>& histogram, size_t value) {
+    if (histogram.size() <= value) {
+        histogram.resize(value + 1);
+    }
+    ++histogram[value];
+}
+}  // namespace
+
+DependencyAnalysis Sheet::AnalyzeDependencies(size_t top_n) const {
+    auto lock = LockValues();
+    DependencyAnalysis result;
+    // the cells that are linked to other cells and the placeholders. The
+    // tiles of compressed formulas and of compressed cells formulas read
+    // are expanded, so that the linked cells are in the grid.
+    std::vector<const Cell*> cells;
+    std::vector<const Cell::PositionSet*> dependents;
+    std::vector<Position> positions;
+    std::unordered_map<int64_t, size_t> indexes;
+    auto add_node = [&](Position pos, const Cell* cell, const Cell::PositionSet& cell_dependents) {
+        indexes[GetCellKey(pos)] = cells.size();
+        cells.push_back(cell);
+        dependents.push_back(&cell_dependents);
+        positions.push_back(pos);
+    };
+    std::vector<Position> linked_compressed_cells;
+    ForEachCell({{0, 0}, GetPrintableSize()}, [&](Position pos, const Cell* cell, std::string_view /* text */,
+                                                  const Value* value) {
+        if (cell == nullptr && (value != nullptr || placeholder_cells_.Contains(pos))) {
+            linked_compressed_cells.push_back(pos);
+        }
+    });
+    for (Position pos : linked_compressed_cells) {
+        GetConcreteCell(pos);
+    }
+    ForEachCell({{0, 0}, GetPrintableSize()}, [&](Position pos, const Cell* cell, std::string_view /* text */,
+                                                  const Value* /* value */) {
+        AddToHistogram(result.fan_out, cell ? cell->GetDependentCells().size() : 0);
+        if (cell != nullptr && (cell->GetFormula() != nullptr || cell->IsReferenced())) {
+            add_node(pos, cell, cell->GetDependentCells());
+        }
+    });
+    for (const auto& [pos, placeholder_dependents] : placeholders_) {
+        AddToHistogram(result.fan_out, placeholder_dependents.size());
+        add_node(pos, nullptr, placeholder_dependents);
+    }
+    auto index_of = [&](Position pos) {
+        return indexes.at(GetCellKey(pos));
+    };
+    auto is_formula = [&](size_t i) {
+        return cells[i] != nullptr && cells[i]->GetFormula() != nullptr;
+    };
+
+    // formulas in topological order, each one a level above the highest
+    // formula it reads
+    std::vector<size_t> order;
+    std::vector<size_t> unread_formulas(cells.size());
+    for (size_t i = 0; i < cells.size(); ++i) {
+        if (!is_formula(i)) {
+            continue;
+        }
+        std::vector<Position> referenced_cells = cells[i]->GetReferencedCells();
+        AddToHistogram(result.fan_in, referenced_cells.size());
+        for (Position pos : referenced_cells) {
+            unread_formulas[i] += is_formula(index_of(pos));
+        }
+        if (unread_formulas[i] == 0) {
+            order.push_back(i);
+        }
+    }
+    std::vector<size_t> levels(cells.size());
+    // the formula the longest chain to a formula comes from
+    std::vector<size_t> previous(cells.size(), cells.size());
+    for (size_t next = 0; next < order.size(); ++next) {
+        size_t i = order[next];
+        for (Position pos : *dependents[i]) {
+            size_t dependent = index_of(pos);
+            if (levels[dependent] < levels[i] + 1) {
+                levels[dependent] = levels[i] + 1;
+                previous[dependent] = i;
+            }
+            if (--unread_formulas[dependent] == 0) {
+                order.push_back(dependent);
+            }
+        }
+    }
+    std::optional<size_t> last;
+    for (size_t i : order) {
+        AddToHistogram(result.levels, levels[i]);
+        if (!last || levels[i] > levels[*last]) {
+            last = i;
+        }
+    }
+    if (last) {
+        for (size_t i = *last; i != cells.size(); i = previous[i]) {
+            result.longest_chain.push_back(positions[i]);
+        }
+        std::reverse(result.longest_chain.begin(), result.longest_chain.end());
+    }
+    result.widest_level = std::max_element(result.levels.begin(), result.levels.end()) - result.levels.begin();
+
+    // Counting the dependents of every cell takes quadratic time, so the
+    // cells are taken by an upper bound of the count, which counts shared
+    // dependents once per path, until the bound cannot beat the top_n-th count
+    std::vector<size_t> bounds(cells.size());
+    auto add_bound = [&](size_t i) {
+        for (Position pos : *dependents[i]) {
+            size_t dependent = index_of(pos);
+            bounds[i] = std::min(bounds[i] + bounds[dependent] + 1, cells.size());
+        }
+    };
+    for (auto it = order.rbegin(); it != order.rend(); ++it) {
+        add_bound(*it);
+    }
+    std::vector<size_t> candidates;
+    for (size_t i = 0; i < cells.size(); ++i) {
+        if (!is_formula(i)) {
+            add_bound(i);
+        }
+        if (bounds[i] > 0) {
+            candidates.push_back(i);
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(), [&](size_t lhs, size_t rhs) {
+        return bounds[lhs] > bounds[rhs];
+    });
+    std::vector<size_t> visited(cells.size(), cells.size());
+    std::vector<size_t> stack;
+    for (size_t candidate : candidates) {
+        if (result.hubs.size() == top_n && (top_n == 0 || result.hubs.back().second >= bounds[candidate])) {
+            break;
+        }
+        size_t count = 0;
+        stack.assign(1, candidate);
+        while (!stack.empty()) {
+            size_t i = stack.back();
+            stack.pop_back();
+            for (Position pos : *dependents[i]) {
+                size_t dependent = index_of(pos);
+                if (visited[dependent] != candidate) {
+                    visited[dependent] = candidate;
+                    ++count;
+                    stack.push_back(dependent);
+                }
+            }
+        }
+        std::pair<Position, size_t> hub{positions[candidate], count};
+        auto more_dependents = [](const auto& lhs, const auto& rhs) {
+            return lhs.second != rhs.second ? lhs.second > rhs.second : lhs.first < rhs.first;
+        };
+        result.hubs.insert(std::upper_bound(result.hubs.begin(), result.hubs.end(), hub, more_dependents), hub);
+        if (result.hubs.size() > top_n) {
+            result.hubs.pop_back();
+        }
+    }
+    return result;
+}
+
+void Sheet::SetTileCompression(std::chrono::milliseconds idle_time, size_t memory_limit) {
+    auto lock = LockValues();
+    tile_idle_time_ = idle_time;
+    tile_memory_limit_ = memory_limit;
+    compresses_tiles_ = idle_time != std::chrono::milliseconds::max() || memory_limit != 0;
+    // tiles that were not accessed since count as accessed now
+    std::lock_guard tiles_lock(tiles_mutex_);
+    tile_accesses_.clear();
+    compression_enabled_at_ = Clock::now();
+    tiles_checked_at_ = compression_enabled_at_;
+    incompressible_tiles_.clear();
+    pressure_check_interval_ = 1;
+    edits_until_pressure_check_ = 0;
+}
+
+void Sheet::CompressColdTiles() {
+    auto lock = LockValues();
+    if (compresses_tiles_) {
+        incompressible_tiles_.clear();
+        CompressTiles();
+    }
+}
+
+void Sheet::SetPageFile(const std::string& path, size_t resident_bytes) {
+    auto lock = LockValues();
+    compressed_tiles_.SetPageFile(path, resident_bytes);
+}
+
+void Sheet::CompressTilesAfterEdit() {
+    auto idle_time = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - tiles_checked_at_);
+    // tiles are checked at most once per idle time unless memory runs short
+    if (idle_time >= tile_idle_time_) {
+        incompressible_tiles_.clear();
+        TryCompressTiles();
+        return;
+    }
+    if (!IsOverTileMemoryLimit()) {
+        pressure_check_interval_ = 1;
+        edits_until_pressure_check_ = 0;
+        return;
+    }
+    if (edits_until_pressure_check_ > 0) {
+        --edits_until_pressure_check_;
+        return;
+    }
+    if (TryCompressTiles()) {
+        pressure_check_interval_ = 1;
+    } else {
+        pressure_check_interval_ = std::min(pressure_check_interval_ * 2, MAX_PRESSURE_CHECK_INTERVAL);
+        edits_until_pressure_check_ = pressure_check_interval_;
+    }
+}
+
+void Sheet::RecheckTileOf(Position pos) {
+    if (compresses_tiles_) {
+        incompressible_tiles_.erase(GetTileIndex(pos));
+    }
+}
+
+bool Sheet::IsOverTileMemoryLimit() const {
+    return tile_memory_limit_ != 0 && memory_.GetUsage().GetTotal() > tile_memory_limit_;
+}
+
+// Compresses the tiles that were not accessed for the idle time and then,
+// while memory runs short, the least recently accessed ones
+bool Sheet::TryCompressTiles() {
+    try {
+        return CompressTiles();
+    } catch (const PageFileException&) {
+        // the edit is made, the tiles that could not be paged out stay expanded
+        return false;
+    }
+}
+
+bool Sheet::CompressTiles() {
+    Clock::time_point now = Clock::now();
+    tiles_checked_at_ = now;
+    std::vector<std::pair<Clock::time_point, int>> tiles;
+    {
+        std::lock_guard lock(tiles_mutex_);
+        occupied_cells_.ForEachTile([&](Position top_left) {
+            int index = GetTileIndex(top_left);
+            if (!compressed_tiles_.Contains(index) && incompressible_tiles_.count(index) == 0) {
+                auto access = tile_accesses_.find(index);
+                tiles.push_back({access == tile_accesses_.end() ? compression_enabled_at_ : access->second, index});
+            }
+        });
+    }
+    std::sort(tiles.begin(), tiles.end());
+    bool compressed = false;
+    for (auto [accessed_at, index] : tiles) {
+        auto idle_time = std::chrono::duration_cast<std::chrono::milliseconds>(now - accessed_at);
+        if (idle_time < tile_idle_time_ && !IsOverTileMemoryLimit()) {
+            break;
+        }
+        if (CompressTile(index)) {
+            compressed = true;
+        } else {
+            incompressible_tiles_.insert(index);
+        }
+    }
+    return compressed;
+}
+
+// Formulas are compressed with their values, so only up-to-date ones are.
+// The cells they read keep them as dependents, so a change upstream expands
+// the tile before the formula is marked stale. The formulas reading cells of
+// the tile take them by position through placeholders until it is expanded.
+bool Sheet::CompressTile(int index) {
+    Position top_left = GetTileTopLeft(index);
+    std::vector<CompressedTile::CellData> cells;
+    bool compressible = true;
+    occupied_cells_.ForEach({top_left, {TILE_SIZE, TILE_SIZE}}, [&](Position pos) {
+        const Cell* cell = CellAt(pos);
+        if (!compressible || cell->IsStale()) {
+            compressible = false;
+            return;
+        }
+        CompressedTile::CellData& data = cells.emplace_back();
+        data.offset = {pos.row - top_left.row, pos.col - top_left.col};
+        data.text = cell->GetText();
+        if (const FormulaInterface* formula = cell->GetFormula()) {
+            compressible = FormulaSurvivesText(*formula, data.text);
+            data.value = cell->GetKnownValue();
+        }
+    });
+    if (!compressible || cells.empty()) {
+        return false;
+    }
+    Cell::PositionSet dependents(TrackingAllocator<Position>(memory_.GetCounter(MemoryCategory::Dependencies)));
+    {
+        std::lock_guard lock(tiles_mutex_);
+        compressed_tiles_.Insert(index, CompressedTile(cells, memory_.GetCounter(MemoryCategory::CompressedTiles)));
+        for (const CompressedTile::CellData& data : cells) {
+            Position pos{top_left.row + data.offset.row, top_left.col + data.offset.col};
+            CellPtr cell = std::move(sheet_[pos.row][pos.col]);
+            if (cell->IsReferenced()) {
+                const auto& placeholder = placeholders_.emplace(pos, cell->TakeDependentCells()).first->second;
+                placeholder_cells_.Insert(pos);
+                dependents.insert(placeholder.begin(), placeholder.end());
+            }
+        }
+        ReleaseRows(top_left.row, TILE_SIZE);
+        has_compressed_tiles_.store(true, std::memory_order_release);
+        tile_accesses_.erase(index);
+    }
+    // the formulas are bound to the compressed cells
+    RebindFormulas(dependents);
+    return true;
+}
+
+// A formula is restored from its text, which does not give back e.g.
+// deleted references or numbers printed with fewer digits
+bool Sheet::FormulaSurvivesText(const FormulaInterface& formula, const std::string& text) {
+    try {
+        return formula.IsShiftedCopyOf(*ParseFormula(text.substr(1)), 0, 0);
+    } catch (const FormulaException&) {
+        return false;
+    }
+}
+
+void Sheet::ExpandTile(int index) {
+    auto tile = compressed_tiles_.Extract(index);
+    if (!tile) {
+        return;
+    }
+    Position top_left = GetTileTopLeft(index);
+    tile->ForEach([&](Position offset, std::string_view text, const Value* value) {
+        Position pos{top_left.row + offset.row, top_left.col + offset.col};
+        CellPtr cell = MakeCell();
+        cell->Restore(pos, std::string(text), value);
+        // the formulas reading the cell stay unbound and read it by position
+        if (auto it = placeholders_.find(pos); it != placeholders_.end()) {
+            cell->SetDependentCells(std::move(it->second));
+            placeholders_.erase(it);
+            placeholder_cells_.Erase(pos);
+        }
+        GrowGrid(pos);
+        sheet_[pos.row][pos.col] = std::move(cell);
+    });
+    // readers that see no compressed tiles read the grid without the lock
+    has_compressed_tiles_.store(!compressed_tiles_.IsEmpty(), std::memory_order_release);
+}
+
+// Expanding a tile changes how the cells are stored and not what they
+// contain, so reads expand tiles too
+void Sheet::ExpandTileOf(Position pos) const {
+    if (has_compressed_tiles_.load(std::memory_order_acquire)) {
+        std::lock_guard lock(tiles_mutex_);
+        const_cast<Sheet*>(this)->ExpandTile(GetTileIndex(pos));
+    }
+}
+
+void Sheet::ExpandTilesMovedBy(const StructuralChange& change) {
+    std::lock_guard lock(tiles_mutex_);
+    for (int index : compressed_tiles_.GetIndexes()) {
+        Position top_left = GetTileTopLeft(index);
+        if ((change.IsRowChange() ? top_left.row : top_left.col) + TILE_SIZE > change.first) {
+            ExpandTile(index);
+        }
+    }
+}
+
+void Sheet::TouchTile(Position pos) const {
+    if (compresses_tiles_) {
+        std::lock_guard lock(tiles_mutex_);
+        tile_accesses_[GetTileIndex(pos)] = Clock::now();
+    }
+}
+
+int Sheet::GetTileIndex(Position pos) {
+    return (pos.row / TILE_SIZE) * TILES_PER_ROW + pos.col / TILE_SIZE;
+}
+
+Position Sheet::GetTileTopLeft(int index) {
+    return {index / TILES_PER_ROW * TILE_SIZE, index % TILES_PER_ROW * TILE_SIZE};
+}
+
+Sheet::CellPtr Sheet::MakeCell() {
+    auto cell_getter = [this](Position p) {return GetConcreteCell(p);};
+    return MakeTracked<Cell>(memory_.GetCounter(MemoryCategory::Cells), this, cell_getter);
+}
+
+void Sheet::DestroyCell(Position pos) {
+    CellPtr cell = std::move(sheet_[pos.row][pos.col]);
+    if (!cell->IsReferenced()) {
+        return;
+    }
+    auto it = placeholders_.emplace(pos, cell->TakeDependentCells()).first;
+    placeholder_cells_.Insert(pos);
+    // the formulas are bound to the destroyed cell
+    cell.reset();
+    RebindFormulas(it->second);
+}
+
+void Sheet::RebindFormulas(const Cell::PositionSet& cells) {
+    MemoryScope scope(memory_, MemoryCategory::Formulas);
+    for (Position pos : cells) {
+        // formulas of compressed tiles are not bound
+        if (const Cell* cell = FindBoundCell(pos)) {
+            if (auto formula = cell->GetFormulaHandle()) {
+                formula->BindCells(this);
+            }
+        }
+    }
+}
+
+// Cells of compressed tiles are not expanded, the formulas read them by
+// position instead
+const Cell* Sheet::FindBoundCell(Position pos) const {
+    if (has_compressed_tiles_.load(std::memory_order_acquire)) {
+        std::lock_guard lock(tiles_mutex_);
+        return CellAt(pos);
+    }
+    return CellAt(pos);
+}
+
+MemoryUsage Sheet::GetMemoryUsage() const {
+    return memory_.GetUsage();
+}
+
+void Sheet::PrintProfile(std::ostream& output, size_t top_n) const {
+    using Micros = std::chrono::duration<double, std::micro>;
+    output << "cell\tevaluations\treads\tinclusive_us\texclusive_us\texpression\n";
+    for (const CellProfile& profile : GetProfile(top_n)) {
+        output << profile.position.ToString() << '\t'
+               << profile.evaluations << '\t'
+               << profile.referenced_reads << '\t'
+               << Micros(profile.inclusive_time).count() << '\t'
+               << Micros(profile.exclusive_time).count() << '\t'
+               << profile.expression << '\n';
+    }
+}
+
+std::vector<std::vector<CellInterface::Value>> Sheet::Sweep(
+    const std::vector<Position>& inputs, const std::vector<std::vector<double>>& values,
+    const std::vector<Position>& outputs) const {
+    for (Position pos : inputs) {
+        pos.ThrowIfInvalid();
+    }
+    for (Position pos : outputs) {
+        pos.ThrowIfInvalid();
+    }
+    for (const auto& input_values : values) {
+        if (input_values.size() != inputs.size()) {
+            throw std::invalid_argument("a scenario has to give a value to each input");
+        }
+    }
+    auto lock = LockValues();
+    std::vector<std::vector<Value>> result(values.size());
+    if (values.empty()) {
+        return result;
+    }
+    WhatIfCone cone = PrepareWhatIf(inputs, outputs);
+    // the first scenario compiles lazily compiled formulas, so the others
+    // only read what the threads share
+    result[0] = EvaluateScenario(cone, cone.scenario, values[0], outputs);
+    ThreadPool& pool = GetThreadPool();
+    size_t task_count = std::min(values.size() - 1, pool.GetThreadCount());
+    std::vector<std::function<void()>> tasks;
+    for (size_t task = 0; task < task_count; ++task) {
+        tasks.push_back([&, task] {
+            Scenario scenario = cone.scenario;
+            for (size_t i = 1 + task; i < values.size(); i += task_count) {
+                result[i] = EvaluateScenario(cone, scenario, values[i], outputs);
+            }
+        });
+    }
+    pool.Run(std::move(tasks));
+    return result;
+}
+
+// The secant method, each step evaluates one scenario
+std::optional<double> Sheet::GoalSeek(Position input, Position output, double target) const {
+    input.ThrowIfInvalid();
+    output.ThrowIfInvalid();
+    auto lock = LockValues();
+    WhatIfCone cone = PrepareWhatIf({input}, {output});
+    // the difference between the output and the target
+    auto evaluate = [&](double x) -> std::optional<double> {
+        Value value = EvaluateScenario(cone, cone.scenario, {x}, {output})[0];
+        if (const double* number = std::get_if<double>(&value)) {
+            return *number - target;
+        }
+        return std::nullopt;
+    };
+
+    double x0 = 0;
+    if (const Cell* cell = GetConcreteCell(input)) {
+        Value value = cell->GetValue();
+        if (const double* number = std::get_if<double>(&value)) {
+            x0 = *number;
+        } else if (const std::string* text = std::get_if<std::string>(&value)) {
+            std::from_chars(text->data(), text->data() + text->size(), x0);
+        }
+    }
+    double x1 = x0 + std::max(std::abs(x0) * 0.01, 0.01);
+    double tolerance = GOAL_SEEK_TOLERANCE * std::max(1.0, std::abs(target));
+    std::optional<double> y0 = evaluate(x0);
+    for (int i = 0; i < GOAL_SEEK_ITERATIONS && y0; ++i) {
+        if (std::abs(*y0) <= tolerance) {
+            return x0;
+        }
+        std::optional<double> y1 = evaluate(x1);
+        if (!y1 || *y1 == *y0) {
+            return std::nullopt;
+        }
+        double x2 = x1 - *y1 * (x1 - x0) / (*y1 - *y0);
+        x0 = x1;
+        y0 = y1;
+        x1 = x2;
+    }
+    return std::nullopt;
+}
+
+// The cone is the formulas that depend on the inputs and that the outputs
+// depend on. Everything else the cone reads is copied into the scenario,
+// so scenarios do not touch the cells of the sheets.
+Sheet::WhatIfCone Sheet::PrepareWhatIf(const std::vector<Position>& inputs,
+                                       const std::vector<Position>& outputs) const {
+    WhatIfCone cone;
+    for (Position pos : inputs) {
+        cone.inputs.push_back(cone.scenario.Add(this, pos, 0.0));
+    }
+
+    std::set<Position> reached(inputs.begin(), inputs.end());
+    std::vector<Position> stack(inputs.begin(), inputs.end());
+    while (!stack.empty()) {
+        const Cell::PositionSet* dependents = FindDependents(stack.back());
+        stack.pop_back();
+        if (dependents == nullptr) {
+            continue;
+        }
+        for (Position dependent : *dependents) {
+            if (reached.insert(dependent).second) {
+                stack.push_back(dependent);
+            }
+        }
+    }
+    std::set<Position> formulas;
+    for (Position output : outputs) {
+        if (reached.count(output) != 0 && cone.scenario.Find(this, output) == nullptr
+            && formulas.insert(output).second) {
+            stack.push_back(output);
+        }
+    }
+    while (!stack.empty()) {
+        const Cell* cell = GetConcreteCell(stack.back());
+        stack.pop_back();
+        for (Position pos : cell->GetReferencedCells()) {
+            if (reached.count(pos) != 0 && cone.scenario.Find(this, pos) == nullptr
+                && formulas.insert(pos).second) {
+                stack.push_back(pos);
+            }
+        }
+    }
+
+    // a formula comes after the formulas of the cone it reads
+    std::map<Position, size_t> unresolved;
+    for (Position pos : formulas) {
+        size_t count = 0;
+        for (Position referenced : GetConcreteCell(pos)->GetReferencedCells()) {
+            count += formulas.count(referenced);
+        }
+        if (count == 0) {
+            stack.push_back(pos);
+        } else {
+            unresolved[pos] = count;
+        }
+    }
+    while (!stack.empty()) {
+        Position pos = stack.back();
+        stack.pop_back();
+        const Cell* cell = GetConcreteCell(pos);
+        cone.formulas.push_back({cell, cone.scenario.Add(this, pos, 0.0)});
+        for (Position dependent : cell->GetDependentCells()) {
+            auto it = unresolved.find(dependent);
+            if (it != unresolved.end() && --it->second == 0) {
+                unresolved.erase(it);
+                stack.push_back(dependent);
+            }
+        }
+    }
+
+    auto copy_cell = [&cone](const Sheet* sheet, Position pos) {
+        if (cone.scenario.Find(sheet, pos) == nullptr) {
+            const Cell* cell = sheet->GetConcreteCell(pos);
+            cone.scenario.Add(sheet, pos, cell ? cell->GetValue() : Value(""s));
+        }
+    };
+    for (auto [cell, index] : cone.formulas) {
+        for (Position pos : cell->GetReferencedCells()) {
+            copy_cell(this, pos);
+        }
+        for (const ExternalCell& external_cell : cell->GetFormula()->GetExternalCells()) {
+            const Sheet* sheet = workbook_ ? workbook_->FindSheet(external_cell.sheet) : nullptr;
+            if (sheet != nullptr) {
+                copy_cell(sheet, external_cell.position);
+            }
+        }
+    }
+    for (Position output : outputs) {
+        copy_cell(this, output);
+    }
+    return cone;
+}
+
+std::vector<Sheet::Value> Sheet::EvaluateScenario(const WhatIfCone& cone, Scenario& scenario,
+                                                  const std::vector<double>& input_values,
+                                                  const std::vector<Position>& outputs) const {
+    for (size_t i = 0; i < input_values.size(); ++i) {
+        scenario.Set(cone.inputs[i], input_values[i]);
+    }
+    Scenario::Scope scope(scenario);
+    for (auto [cell, index] : cone.formulas) {
+        auto value = cell->GetFormula()->Evaluate(*this);
+        if (const double* number = std::get_if<double>(&value)) {
+            scenario.Set(index, *number);
+        } else {
+            scenario.Set(index, std::get<FormulaError>(value));
+        }
+    }
+    std::vector<Value> result;
+    result.reserve(outputs.size());
+    for (Position output : outputs) {
+        result.push_back(scenario.Find(this, output)->GetValue());
+    }
+    return result;
+}
+
+ThreadPool& Sheet::GetThreadPool() const {
+    if (workbook_) {
+        return workbook_->GetThreadPool();
+    }
+    if (!thread_pool_) {
+        thread_pool_ = std::make_unique<ThreadPool>(0);
+    }
+    return *thread_pool_;
+}
+
+const SheetInterface* Sheet::FindSheet(std::string_view name) const {
+    return workbook_ ? workbook_->FindSheet(name) : nullptr;
+}
+
+void Sheet::AddExternalDependent(const ExternalCell& cell, Position dependent) {
+    if (workbook_) {
+        workbook_->AddExternalDependent(cell, {name_, dependent});
+    }
+}
+
+void Sheet::RemoveExternalDependent(const ExternalCell& cell, Position dependent) {
+    if (workbook_) {
+        workbook_->RemoveExternalDependent(cell, {name_, dependent});
+    }
+}
+
+std::vector<ExternalCell> Sheet::GetDependentCells(const ExternalCell& cell) const {
+    std::vector<ExternalCell> result;
+    const Sheet* sheet = cell.sheet == name_ ? this : nullptr;
+    if (workbook_) {
+        sheet = workbook_->FindSheet(cell.sheet);
+        result = workbook_->GetExternalDependents(cell);
+    }
+    if (sheet == nullptr) {
+        return result;
+    }
+    if (const Cell::PositionSet* dependents = sheet->FindDependents(cell.position)) {
+        for (Position pos : *dependents) {
+            result.push_back({cell.sheet, pos});
+        }
+    }
+    return result;
+}
+
+void Sheet::AddPlaceholderDependent(Position pos, Position dependent) {
+    auto it = placeholders_.find(pos);
+    if (it == placeholders_.end()) {
+        Cell::PositionSet dependents(TrackingAllocator<Position>(memory_.GetCounter(MemoryCategory::Dependencies)));
+        it = placeholders_.emplace(pos, std::move(dependents)).first;
+        placeholder_cells_.Insert(pos);
+    }
+    it->second.insert(dependent);
+}
+
+void Sheet::RemovePlaceholderDependent(Position pos, Position dependent) {
+    auto it = placeholders_.find(pos);
+    if (it == placeholders_.end()) {
+        return;
+    }
+    it->second.erase(dependent);
+    if (it->second.empty()) {
+        placeholders_.erase(it);
+        placeholder_cells_.Erase(pos);
+    }
+}
+
+const Cell::PositionSet* Sheet::FindDependents(Position pos) const {
+    if (const Cell* cell = GetConcreteCell(pos)) {
+        return &cell->GetDependentCells();
+    }
+    auto it = placeholders_.find(pos);
+    return it == placeholders_.end() ? nullptr : &it->second;
+}
+
+void Sheet::InvalidateDependents(const Cell& cell) {
+    if (deferred_invalidations_) {
+        deferred_invalidations_->push_back(cell.GetPosition());
+    } else {
+        InvalidateDependents({{cell.GetPosition(), &cell}});
+    }
+}
+
+void Sheet::InvalidateDependents(const std::vector<ChangedCell>& changed) {
+    std::vector<Position> outdated_formulas;
+    std::deque<Position> cells_to_invalidate;
+    std::set<Position> invalidated;
+    auto add_dependents = [&](const Cell::PositionSet& dependents) {
+        for (Position pos : dependents) {
+            if (invalidated.insert(pos).second) {
+                cells_to_invalidate.push_front(pos);
+            }
+        }
+    };
+    for (const auto& [pos, cell] : changed) {
+        if (cell != nullptr) {
+            RecordPossibleChange(*cell);
+            if (cell->GetFormula()) {
+                outdated_formulas.push_back(pos);
+            }
+            add_dependents(cell->GetDependentCells());
+        } else if (auto it = placeholders_.find(pos); it != placeholders_.end()) {
+            add_dependents(it->second);
+        }
+    }
+
+    while (!cells_to_invalidate.empty()) {
+        Position current = cells_to_invalidate.back();
+        cells_to_invalidate.pop_back();
+        const Cell* cell = GetConcreteCell(current);
+        RecordPossibleChange(*cell);
+        cell->MarkStale();
+        if (cell->GetFormula()) {
+            outdated_formulas.push_back(current);
+        }
+        add_dependents(cell->GetDependentCells());
+    }
+    ScheduleRecalculation(outdated_formulas);
+
+    // formulas of other sheets may refer to any of the changed cells
+    for (const auto& [pos, cell] : changed) {
+        invalidated.insert(pos);
+    }
+    InvalidateExternalDependents(invalidated);
+}
+
+void Sheet::InvalidateExternalDependents(const std::set<Position>& cells) {
+    if (workbook_) {
+        workbook_->InvalidateExternalDependents(*this, cells);
+    }
+}
+
+void Sheet::InvalidateExternalDependent(Position dependent) {
+    auto lock = LockValues();
+    if (Cell* cell = GetConcreteCell(dependent)) {
+        // like any dependent cell it keeps the outdated value until it is recalculated
+        cell->MarkStale();
+        cell->InvalidateDependents();
+        RecalculateAfterEdit();
+    }
+}
+
+void Sheet::HandleExternalStructuralChange(Position dependent, std::string_view sheet,
+                                           const StructuralChange& change) {
+    auto lock = LockValues();
+    Cell* cell = GetConcreteCell(dependent);
+    if (cell && cell->HandleExternalStructuralChange(sheet, change)) {
+        cell->InvalidateCache();
+        RecalculateAfterEdit();
     }
 }
 
@@ -2,15 +2,44 @@
 
 #include "cell.h"
 #include "common.h"
+#include "compressed_tile.h"
+#include "edit_history.h"
+#include "memory_tracker.h"
+#include "occupancy_index.h"
+#include "profiler.h"
+#include "scenario.h"
+#include "thread_pool.h"
+#include "tile_store.h"
 
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <map>
+#include <mutex>
+#include <scoped_allocator>
+#include <set>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
-class Sheet : public SheetInterface {
-    using CellPtr = std::unique_ptr<Cell>;    
+class SubexpressionTable;
+class Workbook;
+
+class Sheet : public BindableSheetInterface {
+    using CellPtr = TrackedPtr<Cell>;
+    using CellRow = TrackedVector<CellPtr>;
+    // the rows take the counter of the grid
+    using Grid = std::vector<CellRow, std::scoped_allocator_adaptor<TrackingAllocator<CellRow>>>;
     using Value = std::variant<std::string, double, FormulaError>;
 public:
-    ~Sheet() = default;
+    Sheet() = default;
+    // A sheet of the workbook, formulas refer to its cells as name!A1
+    Sheet(Workbook* workbook, std::string name);
+    ~Sheet();
     
     void SetCell(Position pos, std::string text) override;
     const CellInterface* GetCell(Position pos) const override;
@@ -19,16 +48,321 @@ public:
     Size GetPrintableSize() const override;
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
+    void GetValues(Range range, CellInterface::Value* values) const override;
+    void PrintValues(std::ostream& output, Range range) const override;
+
+    void InsertRows(int before, int count) override;
+    void InsertColumns(int before, int count) override;
+    void DeleteRows(int first, int count) override;
+    void DeleteColumns(int first, int count) override;
+    void CopyRange(Range source, Position destination) override;
+    void FillDown(Range range) override;
+
+    bool Undo() override;
+    bool Redo() override;
+    void SetUndoMemoryLimit(size_t bytes) override;
+    void SetLazyFormulaCompilation(bool enabled) override;
+    bool CompilesFormulasLazily() const { return lazy_formula_compilation_; }
+    void SetSubexpressionSharing(bool enabled) override;
+    // nullptr unless the subexpressions of formulas are shared
+    SubexpressionTable* GetSubexpressionTable() const { return subexpressions_.get(); }
+    // Shares the subexpressions of the formulas anew after the cells they
+    // refer to moved, does nothing unless the sharing is enabled
+    void ReshareSubexpressions();
+    const Cell* FindBoundCell(Position pos) const override;
+    // True if formulas may read the cells they are bound to directly: no
+    // what-if scenario replaces cells and no reads are counted or tracked
+    bool AllowsBoundReads() const override {
+        return Scenario::GetCurrent() == nullptr && !profiler_.IsEnabled() && !compresses_tiles_;
+    }
+    void SetConcurrentWrites(bool enabled) override;
+
+    void SetRecalculationMode(RecalculationMode mode) override;
+    RecalculationMode GetRecalculationMode() const override;
+    void Recalculate() override;
+
+    void SetChangeTracking(bool enabled, ChangeListener listener) override;
+    std::vector<Position> TakeChangedCells() override;
+    // Called by cells before their values may change, the value recorded
+    // first since the last report is kept
+    void RecordPossibleChange(const Cell& cell) {
+        if (tracks_changes_) {
+            possible_changes_.emplace(cell.GetPosition(), cell.GetKnownValue());
+        }
+    }
+
+    void SetProfilingEnabled(bool enabled) override;
+    std::vector<CellProfile> GetProfile(size_t top_n) const override;
+    void PrintProfile(std::ostream& output, size_t top_n) const override;
+    DependencyAnalysis AnalyzeDependencies(size_t top_n) const override;
+    EvaluationProfiler& GetProfiler() { return profiler_; }
+
+    MemoryUsage GetMemoryUsage() const override;
+    void SetTileCompression(std::chrono::milliseconds idle_time, size_t memory_limit) override;
+    void CompressColdTiles() override;
+    void SetPageFile(const std::string& path, size_t resident_bytes) override;
+
+    std::vector<std::vector<CellInterface::Value>> Sweep(
+        const std::vector<Position>& inputs, const std::vector<std::vector<double>>& values,
+        const std::vector<Position>& outputs) const override;
+    std::optional<double> GoalSeek(Position input, Position output, double target) const override;
+    MemoryTracker& GetMemoryTracker() { return memory_; }
+
+    const SheetInterface* FindSheet(std::string_view name) const override;
+    // Empty unless the sheet belongs to a workbook
+    const std::string& GetName() const { return name_; }
+
+    // Links between formulas of this sheet and the cells of other sheets
+    // they refer to, they are only kept in a workbook
+    void AddExternalDependent(const ExternalCell& cell, Position dependent);
+    void RemoveExternalDependent(const ExternalCell& cell, Position dependent);
+    // Formulas refer to positions without cells through placeholders, the
+    // cell created at such a position takes over their dependents
+    void AddPlaceholderDependent(Position pos, Position dependent);
+    void RemovePlaceholderDependent(Position pos, Position dependent);
+    // Returns the cells of any sheet that directly depend on the given cell
+    std::vector<ExternalCell> GetDependentCells(const ExternalCell& cell) const;
+    // Marks the formulas depending on the cell as stale, in other sheets too.
+    // While a paste is written the cells are collected and invalidated
+    // together after it.
+    void InvalidateDependents(const Cell& cell);
+    // Marks formulas of other sheets that refer to the given cells as stale
+    void InvalidateExternalDependents(const std::set<Position>& cells);
+    // Called by the workbook when a cell of another sheet the formula refers to changed
+    void InvalidateExternalDependent(Position dependent);
+    // Called by the workbook when rows or columns of another sheet the
+    // formula refers to were inserted or deleted
+    void HandleExternalStructuralChange(Position dependent, std::string_view sheet,
+                                        const StructuralChange& change);
+
+    // Called by cells with the formulas that went out of date after an edit
+    void ScheduleRecalculation(const std::vector<Position>& cells);
+    // True if outdated cached values are returned instead of being recalculated
+    bool ServesStaleValues() const;
+    // Guards cell values while they may be recalculated by the background thread
+    std::unique_lock<std::recursive_mutex> LockValues() const;
     
     const Cell* GetConcreteCell(Position pos) const;
     Cell* GetConcreteCell(Position pos);
+    // A cell of another sheet of the workbook, nullptr if there is none
+    const Cell* GetConcreteCell(const ExternalCell& cell) const;
     
 private:	    
-    std::vector<std::vector<CellPtr>> sheet_;  
-    std::vector<int> row_to_num_of_cells_;
-    std::vector<int> column_to_num_of_cells_;
+    // Makes one undoable edit of the nested edits and defers recalculation
+    // until the outermost batch ends
+    class EditBatch {
+    public:
+        explicit EditBatch(Sheet& sheet) : sheet_(sheet) {
+            if (sheet_.batch_depth_++ == 0) {
+                sheet_.history_.Begin();
+            }
+        }
+        ~EditBatch() {
+            if (--sheet_.batch_depth_ == 0) {
+                sheet_.history_.Commit();
+                sheet_.RecalculateAfterEdit();
+            }
+        }
+
+        EditBatch(const EditBatch&) = delete;
+        EditBatch& operator=(const EditBatch&) = delete;
+
+    private:
+        Sheet& sheet_;
+    };
+
+    Workbook* workbook_ = nullptr;
+    std::string name_;
+    // declared before everything it counts
+    MemoryTracker memory_;
+    Grid sheet_{TrackingAllocator<CellRow>(memory_.GetCounter(MemoryCategory::Grid))};
+    OccupancyIndex occupied_cells_;
+    // the dependents of referenced positions that have no cells
+    using Placeholders = std::map<Position, Cell::PositionSet, std::less<Position>,
+                                  TrackingAllocator<std::pair<const Position, Cell::PositionSet>>>;
+    Placeholders placeholders_{TrackingAllocator<Position>(memory_.GetCounter(MemoryCategory::Dependencies))};
+    // the positions of placeholders_
+    OccupancyIndex placeholder_cells_;
+    // the last occupied row and column
     Size print_area_{-1, -1};
+    mutable EvaluationProfiler profiler_;
+
+    RecalculationMode recalculation_mode_ = RecalculationMode::Lazy;
+    std::set<Position> dirty_cells_;
+    bool recalculating_ = false;
+    mutable std::recursive_mutex values_mutex_;
+    std::condition_variable_any dirty_cells_added_;
+    std::thread recalculation_thread_;
+    bool stop_recalculation_thread_ = false;
+    int batch_depth_ = 0;
+
+    bool tracks_changes_ = false;
+    ChangeListener change_listener_;
+    // cells whose values may have changed since the last report with the
+    // values they had, nullopt if the value was not known
+    std::map<Position, std::optional<Value>> possible_changes_;
+    // changes waiting for TakeChangedCells()
+    std::set<Position> changed_cells_;
+    // cells whose dependents are invalidated after the paste being written
+    std::optional<std::vector<Position>> deferred_invalidations_;
+
+    using Clock = std::chrono::steady_clock;
+    static constexpr int TILE_SIZE = OccupancyIndex::TILE_SIZE;
+    static constexpr int TILES_PER_ROW = Position::MAX_COLS / TILE_SIZE;
+    static constexpr size_t MAX_PRESSURE_CHECK_INTERVAL = 1024;
+    bool compresses_tiles_ = false;
+    std::chrono::milliseconds tile_idle_time_ = std::chrono::milliseconds::max();
+    size_t tile_memory_limit_ = 0;
+    // guards the compressed tiles, the cells readers expand from them and
+    // the accesses, as concurrent readers of the sheet change them
+    mutable std::mutex tiles_mutex_;
+    // compressed tiles by their indexes, their cells are null in the grid
+    mutable TileStore compressed_tiles_{memory_.GetCounter(MemoryCategory::CompressedTiles)};
+    // false while no tile is compressed, so reads take no lock
+    mutable std::atomic<bool> has_compressed_tiles_ = false;
+    // the last accesses to tiles while the compression is on
+    mutable std::unordered_map<int, Clock::time_point> tile_accesses_;
+    Clock::time_point compression_enabled_at_;
+    Clock::time_point tiles_checked_at_;
+    // tiles found not compressible, they are checked again after their cells
+    // change or the idle time passes
+    std::unordered_set<int> incompressible_tiles_;
+    // while memory runs short and nothing can be compressed, the tiles are
+    // checked after twice as many edits each time
+    size_t pressure_check_interval_ = 1;
+    size_t edits_until_pressure_check_ = 0;
+
+    // the pool of a sheet without a workbook, created by the first Sweep()
+    mutable std::unique_ptr<ThreadPool> thread_pool_;
+
+    EditHistory history_;
+    bool lazy_formula_compilation_ = false;
+    std::unique_ptr<SubexpressionTable> subexpressions_;
+
+    // Locks of the threads that call SetCell() at once
+    struct WriterLocks {
+        // shared by the writers of texts of cells no formula reads,
+        // exclusive for other writes
+        std::shared_mutex sheet;
+        // a tile is guarded by the lock its index maps to
+        std::array<std::mutex, 64> tiles;
+        // the undo history and the index of occupied cells
+        std::mutex bookkeeping;
+        // the thread holding the exclusive lock, whose nested writes take no locks
+        std::atomic<std::thread::id> exclusive_writer;
+    };
+    // nullptr unless concurrent writes are enabled
+    std::unique_ptr<WriterLocks> writer_locks_;
     
     std::ostream& PrintValue (std::ostream &os, const Value& value) const;
+    // Prints the cells of the range separated by tabs, a line per row
+    // Visits the occupied cells of the range, the cell is nullptr for a
+    // cell of a compressed tile and its text is given instead, along with
+    // the value of a formula
+    using CellVisitor = std::function<void(Position pos, const Cell* cell, std::string_view text, const Value* value)>;
+    void ForEachCell(Range range, const CellVisitor& visit) const;
+    using PrintVisitor = std::function<void(const Cell* cell, std::string_view text, const Value* value)>;
+    void PrintRange(std::ostream& output, Range range, const PrintVisitor& print) const;
+    void PrintCellValue(std::ostream& output, const Cell* cell, std::string_view text, const Value* value) const;
+    void UpdatePrintArea();
+    void UpdateCell(Position pos, const std::function<void(Cell&)>& update);
+    // Makes room for the cell in the grid
+    void GrowGrid(Position pos);
+    // The cell in the grid, nullptr if there is none or it is compressed
+    Cell* CellAt(Position pos) const;
+    // Frees the ends of the rows whose cells are compressed
+    void ReleaseRows(int first, int count);
+    // The content of a cell to be written by a paste, an empty text clears it
+    struct CopiedCell {
+        Position position;
+        std::string text;
+        std::unique_ptr<FormulaInterface> formula;
+    };
+    // Writes the cells as one edit. If one of them cannot be written, e.g.
+    // because of a circular reference, the cells written before it are
+    // restored and the exception is rethrown.
+    void PasteCells(std::vector<CopiedCell>& cells);
+    // Invalidates the dependents of many changed cells in one pass, the
+    // dependents of a position without a cell are those of its placeholder
+    using ChangedCell = std::pair<Position, const Cell*>;
+    void InvalidateDependents(const std::vector<ChangedCell>& changed);
+    // Sets the text under the shared lock if it is not a formula and no
+    // formula reads the cell, otherwise returns false with the text intact
+    bool TrySetTextConcurrently(Position pos, std::string& text);
+    CellPtr MakeCell();
+    // Destroys the cell, the formulas referring to it keep a placeholder
+    void DestroyCell(Position pos);
+    // Returns the dependents of the cell or the placeholder at the
+    // position, nullptr if there are neither
+    const Cell::PositionSet* FindDependents(Position pos) const;
+    // Binds the formulas anew after a cell they read was created or destroyed
+    void RebindFormulas(const Cell::PositionSet& cells);
+    void ApplyStructuralChange(const StructuralChange& change);
+    // Also collects the placeholders that move or whose dependents move
+    std::vector<Cell*> CollectCellsAffectedBy(const StructuralChange& change,
+                                              std::vector<Cell*>& deleted_cells,
+                                              std::vector<Position>& affected_placeholders);
+    void MoveCells(const StructuralChange& change);
+    void MovePlaceholders(const StructuralChange& change, const std::vector<Position>& affected);
+    EditHistory::CellSnapshot SnapshotCell(Position pos) const;
+    void RecordDeletedCells(const std::vector<Cell*>& deleted_cells, const StructuralChange& change);
+    void RestoreCell(EditHistory::CellSnapshot& snapshot);
+    // Passes the table to all formulas, nullptr stops the sharing
+    void ShareFormulaSubexpressions();
+    void Replay(EditHistory::Record& record);
+    void RecalculateAfterEdit();
+    void RecalculateDirtyCells();
+    void EvaluateRowBatches();
+    void EvaluateRowBatch(Position first, int rows);
+    void CollectStaleCells();
+    // Compares the possibly changed cells with their recorded values. Formulas
+    // whose values are out of date are evaluated only if evaluate is set and
+    // the recalculation mode does not serve outdated values, otherwise they
+    // are compared once a recalculation or a reader has evaluated them.
+    void ReportChanges(bool evaluate);
+    // Moves the positions of tracked changes after rows or columns were
+    // inserted or deleted, changes of deleted cells are dropped
+    void MoveTrackedChanges(const StructuralChange& change);
+    void CompressTilesAfterEdit();
+
+    // The formulas of the sheet between the inputs and the outputs of a
+    // what-if analysis and the scenario that holds their values
+    struct WhatIfCone {
+        // the indexes of the inputs in the scenario
+        std::vector<size_t> inputs;
+        // the formulas in the order of evaluation with their indexes
+        std::vector<std::pair<const Cell*, size_t>> formulas;
+        // the inputs, the formulas, the cells they read and the outputs
+        Scenario scenario;
+    };
+    WhatIfCone PrepareWhatIf(const std::vector<Position>& inputs, const std::vector<Position>& outputs) const;
+    std::vector<Value> EvaluateScenario(const WhatIfCone& cone, Scenario& scenario,
+                                        const std::vector<double>& input_values,
+                                        const std::vector<Position>& outputs) const;
+    ThreadPool& GetThreadPool() const;
+    bool IsOverTileMemoryLimit() const;
+    // Returns false if no tile was compressed
+    bool CompressTiles();
+    // Same, but a failing page file leaves the tiles expanded
+    bool TryCompressTiles();
+    // Forgets that the tile of the edited cell could not be compressed
+    void RecheckTileOf(Position pos);
+    // Returns false if the tile has cells that cannot be compressed
+    bool CompressTile(int index);
+    static bool FormulaSurvivesText(const FormulaInterface& formula, const std::string& text);
+    // Called with tiles_mutex_ locked
+    void ExpandTile(int index);
+    void ExpandTileOf(Position pos) const;
+    // Compressed tiles do not move, so the ones the change moves are expanded
+    void ExpandTilesMovedBy(const StructuralChange& change);
+    // Records an access to the tile of the cell while the compression is on
+    void TouchTile(Position pos) const;
+    static int GetTileIndex(Position pos);
+    static Position GetTileTopLeft(int index);
+    void StartRecalculationThread();
+    void StopRecalculationThread();
+    void RunRecalculationThread();
+    // In a workbook all sheets share the mutex, formulas read cells of other sheets
+    std::recursive_mutex& GetValuesMutex() const;
 };
 
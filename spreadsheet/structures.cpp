@@ -1,11 +1,10 @@
 #include "common.h"
 
 #include <cctype>
-#include <sstream>
 #include <algorithm>
+#include <iterator>
 
 const int LETTERS = 26;
-const int MAX_POSITION_LENGTH = 17;
 const int MAX_POS_LETTER_COUNT = 3;
 
 const Position Position::NONE = {-1, -1};
@@ -28,50 +27,55 @@ void Position::ThrowIfInvalid() const {
     }
 }
 
-std::string Position::ToString() const {
+std::to_chars_result Position::ToChars(char* first, char* last) const {
     if (!IsValid()) {
-        return "";
+        return {first, std::errc::invalid_argument};
     }
 
-    std::string result;
-    result.reserve(MAX_POSITION_LENGTH);
-    int c = col;
-    while (c >= 0) {
-        result.insert(result.begin(), 'A' + c % LETTERS);
-        c = c / LETTERS - 1;
+    // the letters come out from the last one
+    char letters[MAX_POS_LETTER_COUNT];
+    char* letters_begin = std::end(letters);
+    for (int c = col; c >= 0; c = c / LETTERS - 1) {
+        *--letters_begin = static_cast<char>('A' + c % LETTERS);
     }
+    if (last - first < std::end(letters) - letters_begin) {
+        return {last, std::errc::value_too_large};
+    }
+    first = std::copy(letters_begin, std::end(letters), first);
+    return std::to_chars(first, last, row + 1);
+}
 
-    result += std::to_string(row + 1);
-
-    return result;
+std::string Position::ToString() const {
+    char buffer[MAX_STRING_LENGTH];
+    auto [end, error] = ToChars(std::begin(buffer), std::end(buffer));
+    if (error != std::errc{}) {
+        return "";
+    }
+    return std::string(buffer, end);
 }
 
 Position Position::FromString(std::string_view str) {
-    auto it = std::find_if(str.begin(), str.end(), [](const char c) {
-        return !(std::isalpha(c) && std::isupper(c));
-    });
-    auto letters = str.substr(0, it - str.begin());
-    auto digits = str.substr(it - str.begin());
-
-    if (letters.empty() || digits.empty()) {
-        return Position::NONE;
+    size_t letter_count = 0;
+    while (letter_count < str.size() && str[letter_count] >= 'A' && str[letter_count] <= 'Z') {
+        ++letter_count;
     }
-    if (letters.size() > MAX_POS_LETTER_COUNT) {
+    if (letter_count == 0 || letter_count > MAX_POS_LETTER_COUNT) {
         return Position::NONE;
     }
 
-    if (!std::isdigit(digits[0])) {
+    const char* digits = str.data() + letter_count;
+    const char* end = str.data() + str.size();
+    if (digits == end || !std::isdigit(static_cast<unsigned char>(*digits))) {
         return Position::NONE;
     }
-
     int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
+    auto [digits_end, error] = std::from_chars(digits, end, row);
+    if (error != std::errc{} || digits_end != end) {
         return Position::NONE;
     }
 
     int col = 0;
-    for (char ch : letters) {
+    for (char ch : str.substr(0, letter_count)) {
         col *= LETTERS;
         col += ch - 'A' + 1;
     }
@@ -81,4 +85,50 @@ Position Position::FromString(std::string_view str) {
 
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
-}
\ No newline at end of file
+}
+
+bool Range::IsValid() const {
+    Position bottom_right{top_left.row + size.rows - 1, top_left.col + size.cols - 1};
+    return size.rows > 0 && size.cols > 0 && top_left.IsValid() && bottom_right.IsValid();
+}
+
+void Range::ThrowIfInvalid() const {
+    if (!IsValid()) {
+        throw InvalidPositionException("invalid range");
+    }
+}
+
+bool StructuralChange::IsRowChange() const {
+    return type == Type::InsertRows || type == Type::DeleteRows;
+}
+
+bool StructuralChange::IsDeletion() const {
+    return type == Type::DeleteRows || type == Type::DeleteColumns;
+}
+
+StructuralChange StructuralChange::Inverse() const {
+    static const Type inverse[] = {Type::DeleteRows, Type::InsertRows, Type::DeleteColumns, Type::InsertColumns};
+    return {inverse[static_cast<int>(type)], first, count};
+}
+
+Position StructuralChange::Apply(Position pos) const {
+    int& index = IsRowChange() ? pos.row : pos.col;
+    if (index < first) {
+        return pos;
+    }
+    if (!IsDeletion()) {
+        index += count;
+    } else if (index < first + count) {
+        return Position::NONE;
+    } else {
+        index -= count;
+    }
+    return pos;
+}
+
+Range StructuralChange::GetMovedRange() const {
+    if (IsRowChange()) {
+        return {{first, 0}, {Position::MAX_ROWS - first, Position::MAX_COLS}};
+    }
+    return {{0, first}, {Position::MAX_ROWS, Position::MAX_COLS - first}};
+}
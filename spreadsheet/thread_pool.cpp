@@ -0,0 +1,73 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <utility>
+
+ThreadPool::ThreadPool(size_t threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    workers_.reserve(threads);
+    for (size_t i = 0; i < threads; ++i) {
+        workers_.emplace_back([this] {
+            RunWorker();
+        });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    task_added_.notify_all();
+    for (std::thread& worker : workers_) {
+        worker.join();
+    }
+}
+
+void ThreadPool::Run(std::vector<std::function<void()>> tasks) {
+    Batch batch;
+    std::unique_lock lock(mutex_);
+    for (auto& task : tasks) {
+        tasks_.push_back({std::move(task), &batch});
+    }
+    batch.unfinished_tasks = tasks.size();
+    task_added_.notify_all();
+    task_finished_.wait(lock, [&batch] {
+        return batch.unfinished_tasks == 0;
+    });
+    if (batch.error) {
+        std::rethrow_exception(batch.error);
+    }
+}
+
+void ThreadPool::RunWorker() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+        task_added_.wait(lock, [this] {
+            return stopping_ || !tasks_.empty();
+        });
+        if (stopping_) {
+            return;
+        }
+        Task task = std::move(tasks_.front());
+        tasks_.pop_front();
+
+        lock.unlock();
+        std::exception_ptr error;
+        try {
+            task.run();
+        } catch (...) {
+            error = std::current_exception();
+        }
+        lock.lock();
+
+        if (error && !task.batch->error) {
+            task.batch->error = error;
+        }
+        if (--task.batch->unfinished_tasks == 0) {
+            task_finished_.notify_all();
+        }
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that run batches of independent tasks
+class ThreadPool {
+public:
+    // 0 threads means the number of hardware threads
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t GetThreadCount() const { return workers_.size(); }
+
+    // Runs the tasks and waits until all of them finish. If some tasks
+    // throw, the first exception is rethrown after that. Several threads may
+    // run batches at once, each waits only for its own tasks.
+    void Run(std::vector<std::function<void()>> tasks);
+
+private:
+    // The tasks of one Run call that have not finished and their first error
+    struct Batch {
+        size_t unfinished_tasks = 0;
+        std::exception_ptr error;
+    };
+
+    struct Task {
+        std::function<void()> run;
+        Batch* batch;
+    };
+
+    void RunWorker();
+
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable task_added_;
+    std::condition_variable task_finished_;
+    std::deque<Task> tasks_;
+    bool stopping_ = false;
+};
@@ -0,0 +1,103 @@
+#include "tile_store.h"
+
+TileStore::TileStore(MemoryCounter* counter)
+    : counter_(counter) {
+}
+
+void TileStore::SetPageFile(const std::string& path, size_t resident_bytes) {
+    for (auto& [index, entry] : tiles_) {
+        Load(index, entry);
+        entry.pages.clear();
+    }
+    page_file_.reset();
+    max_resident_bytes_ = resident_bytes;
+    if (!path.empty()) {
+        page_file_ = std::make_unique<PageFile>(path);
+        EvictToLimit();
+    }
+}
+
+std::vector<int> TileStore::GetIndexes() const {
+    std::vector<int> result;
+    result.reserve(tiles_.size());
+    for (const auto& [index, entry] : tiles_) {
+        result.push_back(index);
+    }
+    return result;
+}
+
+void TileStore::Insert(int index, CompressedTile tile) {
+    Extract(index);
+    Entry& entry = tiles_[index];
+    entry.tile.emplace(std::move(tile));
+    entry.used = lru_.insert(lru_.begin(), index);
+    resident_bytes_ += entry.tile->GetMemorySize();
+    try {
+        EvictToLimit();
+    } catch (const PageFileException&) {
+        // the caller keeps the cells of the tile
+        Extract(index);
+        throw;
+    }
+}
+
+const CompressedTile* TileStore::Find(int index) {
+    auto it = tiles_.find(index);
+    if (it == tiles_.end()) {
+        return nullptr;
+    }
+    CompressedTile& tile = Load(index, it->second);
+    EvictToLimit();
+    return &tile;
+}
+
+std::optional<CompressedTile> TileStore::Extract(int index) {
+    auto it = tiles_.find(index);
+    if (it == tiles_.end()) {
+        return std::nullopt;
+    }
+    Entry& entry = it->second;
+    Load(index, entry);
+    if (page_file_) {
+        page_file_->Free(entry.pages);
+    }
+    resident_bytes_ -= entry.tile->GetMemorySize();
+    lru_.erase(entry.used);
+    CompressedTile tile = std::move(*entry.tile);
+    tiles_.erase(it);
+    return tile;
+}
+
+// Makes the tile the most recently used one
+CompressedTile& TileStore::Load(int index, Entry& entry) {
+    if (entry.tile) {
+        lru_.splice(lru_.begin(), lru_, entry.used);
+    } else {
+        entry.tile.emplace(CompressedTile::Deserialize(page_file_->Read(entry.pages, entry.size), counter_));
+        entry.used = lru_.insert(lru_.begin(), index);
+        resident_bytes_ += entry.tile->GetMemorySize();
+    }
+    return *entry.tile;
+}
+
+void TileStore::Unload(Entry& entry) {
+    resident_bytes_ -= entry.tile->GetMemorySize();
+    lru_.erase(entry.used);
+    entry.tile.reset();
+}
+
+// The most recently used tile stays, it may be in use
+void TileStore::EvictToLimit() {
+    if (!page_file_) {
+        return;
+    }
+    while (resident_bytes_ > max_resident_bytes_ && lru_.size() > 1) {
+        Entry& entry = tiles_.at(lru_.back());
+        if (entry.pages.empty()) {
+            std::string data = entry.tile->Serialize();
+            entry.pages = page_file_->Write(data);
+            entry.size = data.size();
+        }
+        Unload(entry);
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "compressed_tile.h"
+#include "memory_tracker.h"
+#include "page_file.h"
+
+#include <list>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Compressed tiles of a sheet by their indexes. With a page file the store
+// is a buffer pool: at most the given number of bytes of tiles stay in
+// memory, the least recently used tiles are written out and read back
+// when they are needed. Tiles never change, so a tile read back keeps its
+// pages and is evicted again without writing.
+class TileStore {
+public:
+    // The memory of the tiles in memory is counted by the counter
+    explicit TileStore(MemoryCounter* counter);
+
+    // An empty path reads all tiles back and removes the page file
+    void SetPageFile(const std::string& path, size_t resident_bytes);
+
+    bool IsEmpty() const { return tiles_.empty(); }
+    bool Contains(int index) const { return tiles_.count(index) != 0; }
+    std::vector<int> GetIndexes() const;
+
+    // Throws PageFileException if other tiles cannot be paged out to make
+    // room, the tile is not inserted then
+    void Insert(int index, CompressedTile tile);
+    // Returns nullptr if there is no such tile. The tile may be read from
+    // the page file, the pointer is valid until the store is used again.
+    const CompressedTile* Find(int index);
+    std::optional<CompressedTile> Extract(int index);
+
+private:
+    struct Entry {
+        std::optional<CompressedTile> tile;
+        // empty until the tile is written out
+        PageFile::Pages pages;
+        size_t size = 0;
+        // the position in lru_ while the tile is in memory
+        std::list<int>::iterator used;
+    };
+
+    CompressedTile& Load(int index, Entry& entry);
+    void Unload(Entry& entry);
+    void EvictToLimit();
+
+    MemoryCounter* counter_;
+    std::unordered_map<int, Entry> tiles_;
+    // the tiles in memory, the most recently used first
+    std::list<int> lru_;
+    size_t resident_bytes_ = 0;
+    size_t max_resident_bytes_ = 0;
+    std::unique_ptr<PageFile> page_file_;
+};
@@ -0,0 +1,201 @@
+#include "workbook.h"
+
+#include <algorithm>
+#include <cctype>
+
+namespace {
+bool IsValidSheetName(const std::string& name) {
+    auto is_name_char = [](char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+    };
+    return !name.empty() && !std::isdigit(static_cast<unsigned char>(name[0]))
+           && std::all_of(name.begin(), name.end(), is_name_char);
+}
+}  // namespace
+
+Workbook::Workbook(size_t threads)
+    : threads_(threads) {
+}
+
+Workbook::~Workbook() {
+    // background threads may read other sheets, so all of them stop before
+    // the first sheet is destroyed
+    for (auto& [name, sheet] : sheets_) {
+        sheet->SetRecalculationMode(RecalculationMode::Lazy);
+    }
+}
+
+SheetInterface* Workbook::AddSheet(std::string name) {
+    if (!IsValidSheetName(name)) {
+        throw std::invalid_argument("invalid sheet name: " + name);
+    }
+    if (sheets_.count(name) != 0) {
+        throw std::invalid_argument("sheet already exists: " + name);
+    }
+    auto lock = HasBackgroundRecalculation() ? std::unique_lock(values_mutex_)
+                                             : std::unique_lock<std::recursive_mutex>();
+    Sheet* sheet = sheets_.emplace(name, std::make_unique<Sheet>(this, name)).first->second.get();
+
+    // references to the sheet evaluated to #REF! so far
+    for (const ExternalCell& dependent : CollectDependentsOfSheet(name)) {
+        if (Sheet* dependent_sheet = FindSheet(dependent.sheet)) {
+            dependent_sheet->InvalidateExternalDependent(dependent.position);
+        }
+    }
+    return sheet;
+}
+
+SheetInterface* Workbook::GetSheet(std::string_view name) {
+    return FindSheet(name);
+}
+
+const SheetInterface* Workbook::GetSheet(std::string_view name) const {
+    return FindSheet(name);
+}
+
+std::vector<std::string> Workbook::GetSheetNames() const {
+    std::vector<std::string> result;
+    for (const auto& [name, sheet] : sheets_) {
+        result.push_back(name);
+    }
+    return result;
+}
+
+Sheet* Workbook::FindSheet(std::string_view name) const {
+    auto it = sheets_.find(name);
+    return it == sheets_.end() ? nullptr : it->second.get();
+}
+
+void Workbook::Recalculate() {
+    // a sheet is recalculated after the sheets it refers to
+    std::map<Sheet*, std::set<Sheet*>> referenced_sheets;
+    std::map<Sheet*, std::vector<Sheet*>> dependent_sheets;
+    for (const auto& [cell, dependents] : external_dependents_) {
+        Sheet* referenced = FindSheet(cell.sheet);
+        if (referenced == nullptr) {
+            continue;
+        }
+        for (const ExternalCell& dependent : dependents) {
+            Sheet* sheet = FindSheet(dependent.sheet);
+            if (sheet != referenced && referenced_sheets[sheet].insert(referenced).second) {
+                dependent_sheets[referenced].push_back(sheet);
+            }
+        }
+    }
+
+    std::vector<Sheet*> ready_sheets;
+    std::map<Sheet*, size_t> unresolved_references;
+    for (const auto& [name, sheet] : sheets_) {
+        size_t references = referenced_sheets[sheet.get()].size();
+        if (references == 0) {
+            ready_sheets.push_back(sheet.get());
+        } else {
+            unresolved_references[sheet.get()] = references;
+        }
+    }
+
+    while (!ready_sheets.empty()) {
+        if (ready_sheets.size() == 1) {
+            ready_sheets.front()->Recalculate();
+        } else {
+            std::vector<std::function<void()>> tasks;
+            for (Sheet* sheet : ready_sheets) {
+                tasks.push_back([sheet] {
+                    sheet->Recalculate();
+                });
+            }
+            GetThreadPool().Run(std::move(tasks));
+        }
+
+        std::vector<Sheet*> next_sheets;
+        for (Sheet* sheet : ready_sheets) {
+            for (Sheet* dependent : dependent_sheets[sheet]) {
+                if (--unresolved_references[dependent] == 0) {
+                    unresolved_references.erase(dependent);
+                    next_sheets.push_back(dependent);
+                }
+            }
+        }
+        ready_sheets = std::move(next_sheets);
+    }
+
+    // sheets that refer to each other are left, their formulas recalculate
+    // the outdated cells of the other sheets they read
+    for (const auto& [sheet, references] : unresolved_references) {
+        sheet->Recalculate();
+    }
+}
+
+ThreadPool& Workbook::GetThreadPool() {
+    if (!thread_pool_) {
+        thread_pool_ = std::make_unique<ThreadPool>(threads_);
+    }
+    return *thread_pool_;
+}
+
+void Workbook::AddExternalDependent(const ExternalCell& cell, const ExternalCell& dependent) {
+    external_dependents_[cell].insert(dependent);
+}
+
+void Workbook::RemoveExternalDependent(const ExternalCell& cell, const ExternalCell& dependent) {
+    auto it = external_dependents_.find(cell);
+    if (it == external_dependents_.end()) {
+        return;
+    }
+    it->second.erase(dependent);
+    if (it->second.empty()) {
+        external_dependents_.erase(it);
+    }
+}
+
+std::vector<ExternalCell> Workbook::GetExternalDependents(const ExternalCell& cell) const {
+    auto it = external_dependents_.find(cell);
+    if (it == external_dependents_.end()) {
+        return {};
+    }
+    return {it->second.begin(), it->second.end()};
+}
+
+void Workbook::InvalidateExternalDependents(const Sheet& sheet, const std::set<Position>& cells) {
+    if (external_dependents_.empty()) {
+        return;
+    }
+    for (Position pos : cells) {
+        for (const ExternalCell& dependent : GetExternalDependents({sheet.GetName(), pos})) {
+            if (Sheet* dependent_sheet = FindSheet(dependent.sheet)) {
+                dependent_sheet->InvalidateExternalDependent(dependent.position);
+            }
+        }
+    }
+}
+
+void Workbook::HandleStructuralChange(const Sheet& sheet, const StructuralChange& change) {
+    // the dependents update their references and relink to the moved cells
+    std::set<Sheet*> dependent_sheets;
+    for (const ExternalCell& dependent : CollectDependentsOfSheet(sheet.GetName())) {
+        if (Sheet* dependent_sheet = FindSheet(dependent.sheet)) {
+            dependent_sheet->HandleExternalStructuralChange(dependent.position, sheet.GetName(), change);
+            dependent_sheets.insert(dependent_sheet);
+        }
+    }
+    for (Sheet* dependent_sheet : dependent_sheets) {
+        dependent_sheet->ReshareSubexpressions();
+    }
+}
+
+void Workbook::SetBackgroundRecalculation(bool enabled) {
+    background_sheets_ += enabled ? 1 : -1;
+}
+
+std::set<ExternalCell> Workbook::CollectDependentsOfSheet(const std::string& name) const {
+    std::set<ExternalCell> result;
+    for (auto it = external_dependents_.lower_bound({name, Position::NONE});
+         it != external_dependents_.end() && it->first.sheet == name; ++it) {
+        result.insert(it->second.begin(), it->second.end());
+    }
+    return result;
+}
+
+std::unique_ptr<WorkbookInterface> CreateWorkbook(size_t threads) {
+    return std::make_unique<Workbook>(threads);
+}
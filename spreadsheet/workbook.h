@@ -0,0 +1,60 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+#include "sheet.h"
+#include "thread_pool.h"
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <set>
+
+class Workbook : public WorkbookInterface {
+public:
+    explicit Workbook(size_t threads);
+    ~Workbook();
+
+    SheetInterface* AddSheet(std::string name) override;
+    SheetInterface* GetSheet(std::string_view name) override;
+    const SheetInterface* GetSheet(std::string_view name) const override;
+    std::vector<std::string> GetSheetNames() const override;
+    void Recalculate() override;
+
+    // Returns nullptr if there is no sheet with the given name
+    Sheet* FindSheet(std::string_view name) const;
+
+    // Dependencies of formulas on the cells they refer to by a sheet name,
+    // the referenced sheet does not have to exist
+    void AddExternalDependent(const ExternalCell& cell, const ExternalCell& dependent);
+    void RemoveExternalDependent(const ExternalCell& cell, const ExternalCell& dependent);
+    std::vector<ExternalCell> GetExternalDependents(const ExternalCell& cell) const;
+
+    // Marks formulas that refer to the given cells of the sheet as stale
+    void InvalidateExternalDependents(const Sheet& sheet, const std::set<Position>& cells);
+    // Updates formulas that refer to the sheet after rows or columns were inserted or deleted there
+    void HandleStructuralChange(const Sheet& sheet, const StructuralChange& change);
+
+    // While any sheet is recalculated in the background, all sheets guard
+    // their values with the shared mutex
+    void SetBackgroundRecalculation(bool enabled);
+    bool HasBackgroundRecalculation() const { return background_sheets_ > 0; }
+    std::recursive_mutex& GetValuesMutex() const { return values_mutex_; }
+
+    // The workers shared by the sheets
+    ThreadPool& GetThreadPool();
+
+private:
+    // Returns the formulas that refer to any cell of the sheet with the given name
+    std::set<ExternalCell> CollectDependentsOfSheet(const std::string& name) const;
+
+    size_t threads_;
+    // created on the first use
+    std::unique_ptr<ThreadPool> thread_pool_;
+    mutable std::recursive_mutex values_mutex_;
+    std::atomic<int> background_sheets_ = 0;
+    // referenced cell -> formulas of any sheet that refer to it
+    std::map<ExternalCell, std::set<ExternalCell>> external_dependents_;
+    // destroyed first, sheets may still use the members above
+    std::map<std::string, std::unique_ptr<Sheet>, std::less<>> sheets_;
+};